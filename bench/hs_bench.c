@@ -0,0 +1,136 @@
+// Baseline for bench/run.exs: the same compiles and scans, made by calling
+// Hyperscan directly, so the difference is the cost of the NIF layer.
+// Prints JSON to stdout.
+//
+//     make bench
+
+#include <hs/hs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define NEEDLE "token7abc "
+#define NEEDLE_SIZE (sizeof(NEEDLE) - 1)
+
+// Each measurement repeats until it has run for at least this long.
+#define MIN_NANOSECONDS 500000000LL
+
+long long now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Expressions token1[a-z]+ through token<count>[a-z]+, as in bench/run.exs.
+hs_database_t * compile_patterns(unsigned int count) {
+  char ** expressions = calloc(count, sizeof(* expressions));
+  unsigned int * flags = calloc(count, sizeof(* flags));
+  unsigned int * ids = calloc(count, sizeof(* ids));
+
+  for (unsigned int i = 0; i < count; i++) {
+    expressions[i] = malloc(32);
+    snprintf(expressions[i], 32, "token%u[a-z]+", i + 1);
+    ids[i] = i + 1;
+  }
+
+  hs_database_t * db;
+  hs_compile_error_t * compile_error;
+  hs_error_t error = hs_compile_multi((const char * const *) expressions, flags, ids, count, HS_MODE_BLOCK, NULL, &db, &compile_error);
+  if (error != HS_SUCCESS) {
+    fprintf(stderr, "hs_compile_multi failed: %s\n", compile_error->message);
+    exit(1);
+  }
+
+  for (unsigned int i = 0; i < count; i++) {
+    free(expressions[i]);
+  }
+  free(expressions);
+  free(flags);
+  free(ids);
+  return db;
+}
+
+// `size` bytes of filler with the needle every `interval` bytes, or none
+// when `interval` is zero, as in bench/run.exs.
+char * make_input(size_t size, size_t interval) {
+  char * input = malloc(size);
+  memset(input, '.', size);
+  if (interval) {
+    for (size_t offset = 0; offset + NEEDLE_SIZE <= size; offset += interval) {
+      memcpy(input + offset, NEEDLE, NEEDLE_SIZE);
+    }
+  }
+  return input;
+}
+
+int count_callback(unsigned int id, unsigned long long from, unsigned long long to, unsigned int flags, void * context) {
+  (* (unsigned long long *) context)++;
+  return 0;
+}
+
+void bench_compile() {
+  unsigned int counts[] = {10, 1000, 100000};
+
+  for (int i = 0; i < 3; i++) {
+    long long start = now();
+    hs_database_t * db = compile_patterns(counts[i]);
+    long long elapsed = now() - start;
+    hs_free_database(db);
+    printf("%s    {\"patterns\": %u, \"ns\": %lld}", i ? ",\n" : "", counts[i], elapsed);
+  }
+}
+
+void bench_scan() {
+  size_t sizes[] = {1024, 64 * 1024, 1024 * 1024};
+  const char * densities[] = {"none", "sparse", "dense"};
+  size_t intervals[] = {0, 4096, 64};
+
+  hs_database_t * db = compile_patterns(100);
+  hs_scratch_t * scratch = NULL;
+  hs_error_t error = hs_alloc_scratch(db, &scratch);
+  if (error != HS_SUCCESS) {
+    fprintf(stderr, "hs_alloc_scratch failed: %d\n", error);
+    exit(1);
+  }
+
+  int first = 1;
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++) {
+      char * input = make_input(sizes[i], intervals[j]);
+      unsigned long long matches = 0;
+      long long scans = 0;
+      long long start = now();
+      long long elapsed;
+
+      do {
+        error = hs_scan(db, input, sizes[i], 0, scratch, count_callback, &matches);
+        if (error != HS_SUCCESS) {
+          fprintf(stderr, "hs_scan failed: %d\n", error);
+          exit(1);
+        }
+        scans++;
+        elapsed = now() - start;
+      } while (elapsed < MIN_NANOSECONDS);
+
+      printf("%s    {\"size\": %zu, \"density\": \"%s\", \"scans\": %lld, \"matches_per_scan\": %llu, \"ns_per_scan\": %.1f, \"mb_per_s\": %.1f}",
+        first ? "" : ",\n", sizes[i], densities[j], scans, matches / scans,
+        (double) elapsed / scans, (double) sizes[i] * scans / elapsed * 1000.0);
+      first = 0;
+      free(input);
+    }
+  }
+
+  hs_free_scratch(scratch);
+  hs_free_database(db);
+}
+
+int main() {
+  printf("{\n  \"hyperscan_version\": \"%s\",\n", hs_version());
+  printf("  \"compile_multi\": [\n");
+  bench_compile();
+  printf("\n  ],\n  \"hs_scan\": [\n");
+  bench_scan();
+  printf("\n  ]\n}\n");
+  return 0;
+}
@@ -0,0 +1,41 @@
+# Compares match_multi_batch/3 against calling match_multi/3 per string.
+#
+#     mix run bench/match_multi_batch.exs
+
+expressions = for i <- 1..100, do: "token#{i}[a-z]+"
+flags = List.duplicate(0, length(expressions))
+ids = Enum.to_list(1..length(expressions))
+{:ok, db} = Hyperscan.compile_multi(expressions, flags, ids, Hyperscan.mode("HS_MODE_BLOCK"))
+{:ok, scratch} = Hyperscan.alloc_scratch(db)
+
+strings =
+  for i <- 1..100_000 do
+    "https://example.com/path/#{i}?q=token#{rem(i, 150)}abc"
+  end
+
+time = fn fun ->
+  {microseconds, _} = :timer.tc(fun)
+  microseconds
+end
+
+# The per-call baseline does not depend on the batch size, so it is timed
+# once and repeated in every row.
+per_call =
+  time.(fn ->
+    for string <- strings, do: Hyperscan.match_multi(db, string, scratch)
+  end)
+
+IO.puts("batch size\tper-call ns/string\tbatch ns/string")
+
+for batch_size <- [1, 2, 5, 10, 100, 1_000, 10_000, 100_000] do
+  batches = Enum.chunk_every(strings, batch_size)
+
+  batched =
+    time.(fn ->
+      for batch <- batches, do: Hyperscan.match_multi_batch(db, batch, scratch)
+    end)
+
+  IO.puts(
+    "#{batch_size}\t#{div(per_call * 1000, length(strings))}\t#{div(batched * 1000, length(strings))}"
+  )
+end
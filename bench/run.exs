@@ -0,0 +1,83 @@
+# Benchmarks compiling, scanning and building results through the NIFs.
+# bench/hs_bench.c runs the same workloads against Hyperscan directly, as a
+# baseline for the overhead of the NIF layer.
+#
+#     mix bench
+#     make bench
+#
+# Both write JSON to bench/results/.
+
+alias Hyperscan, as: HS
+
+results_dir = "bench/results"
+File.mkdir_p!(results_dir)
+
+formatters = fn name ->
+  [
+    Benchee.Formatters.Console,
+    {Benchee.Formatters.JSON, file: Path.join(results_dir, "#{name}.json")}
+  ]
+end
+
+mode = HS.mode("HS_MODE_BLOCK")
+som = HS.flag("HS_FLAG_SOM_LEFTMOST")
+
+# Expressions token1[a-z]+ through token<count>[a-z]+, as in hs_bench.c.
+patterns = fn count -> for i <- 1..count, do: "token#{i}[a-z]+" end
+
+# `size` bytes of filler with a match every `interval` bytes, or none when
+# `interval` is nil, as in hs_bench.c.
+needle = "token7abc "
+
+make_input = fn
+  size, nil ->
+    :binary.copy(".", size)
+
+  size, interval ->
+    unit = needle <> :binary.copy(".", interval - byte_size(needle))
+    binary_part(:binary.copy(unit, div(size, interval) + 1), 0, size)
+end
+
+Benchee.run(
+  %{
+    "compile_multi" => fn expressions ->
+      count = length(expressions)
+      {:ok, _} = HS.compile_multi(expressions, List.duplicate(0, count), Enum.to_list(1..count), mode)
+    end
+  },
+  inputs: for(count <- [10, 1_000, 100_000], do: {"#{count} patterns", patterns.(count)}),
+  time: 2,
+  warmup: 0,
+  memory_time: 0,
+  formatters: formatters.("compile_multi")
+)
+
+expressions = patterns.(100)
+count = length(expressions)
+ids = Enum.to_list(1..count)
+{:ok, db} = HS.compile_multi(expressions, List.duplicate(0, count), ids, mode)
+{:ok, som_db} = HS.compile_multi(expressions, List.duplicate(som, count), ids, mode)
+{:ok, scratch} = HS.alloc_scratch(db)
+{:ok, som_scratch} = HS.alloc_scratch(som_db)
+
+inputs =
+  for {size_name, size} <- [{"1 KB", 1024}, {"64 KB", 64 * 1024}, {"1 MB", 1024 * 1024}],
+      {density, interval} <- [{"none", nil}, {"sparse", 4096}, {"dense", 64}] do
+    {"#{size_name} #{density}", make_input.(size, interval)}
+  end
+
+Benchee.run(
+  %{
+    "match" => fn input -> {:ok, _} = HS.match(db, input, scratch) end,
+    "match_multi" => fn input -> {:ok, _} = HS.match_multi(db, input, scratch) end,
+    "scan tuples" => fn input -> {:ok, _} = HS.scan(db, input, scratch, result: :tuples) end,
+    "scan packed" => fn input -> {:ok, _} = HS.scan(db, input, scratch, result: :packed) end,
+    "replace" => fn input -> {:ok, _} = HS.replace(som_db, input, "*", som_scratch) end,
+    "replace iodata" => fn input -> {:ok, _} = HS.replace(som_db, input, "*", som_scratch, result: :iodata) end
+  },
+  inputs: inputs,
+  time: 1,
+  warmup: 0.5,
+  memory_time: 0,
+  formatters: formatters.("scan")
+)
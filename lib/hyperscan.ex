@@ -8,12 +8,68 @@ defmodule Hyperscan do
     :ok = :erlang.load_nif(nif_path, 0)
   end
 
-  @doc false
+  @doc """
+  Returns `{:ok, platform}` describing the CPU of the current host.
+
+  A platform can be passed to compile/4 and the other compile functions to
+  build a database for it. See make_platform/2 to target other hosts.
+  """
   def populate_platform(), do: exit(:nif_not_loaded)
 
-  @doc false
+  @doc """
+  Returns the fields of a platform as a map.
+
+  # Example
+
+      iex> {:ok, platform} = Hyperscan.make_platform(Hyperscan.tune("HS_TUNE_FAMILY_HSW"), Hyperscan.cpu_feature("HS_CPU_FEATURES_AVX2"))
+      iex> Hyperscan.platform_info_to_map(platform)
+      %{tune: 3, cpu_features: 4, reserved1: 0, reserved2: 0}
+  """
   def platform_info_to_map(_platform_info), do: exit(:nif_not_loaded)
 
+  @doc """
+  Returns `{:ok, platform}` for a platform other than the current host.
+
+  `tune` is a value from tune/1, and `cpu_features` is zero or more values
+  from cpu_feature/1 combined with Bitwise.bor/2. A database compiled for a
+  platform uses the instructions in `cpu_features` and is tuned for the
+  `tune` microarchitecture. It fails to load on a host without those
+  instructions. Tuning never stops a database from loading.
+  """
+  def make_platform(_tune, _cpu_features), do: exit(:nif_not_loaded)
+
+  @doc """
+  Look up a tune family constant by name, for make_platform/2.
+
+  Names follow the pattern `HS_TUNE_FAMILY_*`, as in the [docs].
+
+  [docs]: https://intel.github.io/hyperscan/dev-reference/api_constants.html#cpu-tuning-flags
+
+  Raises :badarg if it is not a valid tune family name.
+
+  # Example
+
+      iex> Hyperscan.tune("HS_TUNE_FAMILY_SKX")
+      7
+  """
+  def tune(_name), do: exit(:nif_not_loaded)
+
+  @doc """
+  Look up a CPU feature constant by name, for make_platform/2.
+
+  Names follow the pattern `HS_CPU_FEATURES_*`, as in the [docs].
+
+  [docs]: https://intel.github.io/hyperscan/dev-reference/api_constants.html#cpu-feature-support-flags
+
+  Raises :badarg if it is not a valid CPU feature name.
+
+  # Example
+
+      iex> Hyperscan.cpu_feature("HS_CPU_FEATURES_AVX512")
+      8
+  """
+  def cpu_feature(_name), do: exit(:nif_not_loaded)
+
   @doc """
   Check if the current system architecture supports Hyperscan.
   """
@@ -24,6 +80,48 @@ defmodule Hyperscan do
   """
   def version(), do: exit(:nif_not_loaded)
 
+  @doc """
+  Returns whether the NIF was built with the Chimera bindings, with
+  `CHIMERA=1 mix compile`. Changing `CHIMERA` between builds rebuilds the
+  NIF. See ch_compile_multi/4.
+  """
+  def chimera_enabled(), do: exit(:nif_not_loaded)
+
+  @doc """
+  Returns the input size, in bytes, at which scans move to a dirty scheduler.
+
+  Inputs shorter than this are scanned directly on the calling process's
+  scheduler, and the scan time is charged to the process as reductions. Longer
+  inputs are rescheduled onto a dirty CPU scheduler so that they do not block
+  other processes. Defaults to 65536.
+  """
+  def dirty_scan_threshold(), do: exit(:nif_not_loaded)
+
+  @doc """
+  Set the input size, in bytes, at which scans move to a dirty scheduler.
+
+  The setting is global to the node. Zero sends every scan to a dirty
+  scheduler. See dirty_scan_threshold/0.
+  """
+  def set_dirty_scan_threshold(_bytes), do: exit(:nif_not_loaded)
+
+  @doc """
+  Returns the memory Hyperscan currently has allocated, by category.
+
+  The result is a map of `:database`, `:scratch`, `:stream` and `:misc` to
+  maps of `:bytes` and `:count`, the number of allocations. All of it is
+  allocated through `enif_alloc`, so is also included in the `:system` total
+  of `:erlang.memory/0`. Databases loaded with deserialize_database_at/1 live
+  in their resource instead and are not counted here.
+
+  # Example
+
+      iex> %{database: %{bytes: bytes, count: count}} = Hyperscan.memory_stats()
+      iex> is_integer(bytes) and is_integer(count)
+      true
+  """
+  def memory_stats(), do: exit(:nif_not_loaded)
+
   @doc """
   Look up a flag constant by name.
 
@@ -75,6 +173,9 @@ defmodule Hyperscan do
 
   Returns `{:ok, db}` where db represents the compiled regex, or `{:error, reason}` on error.
 
+  Compilation runs on a dirty CPU scheduler, so a slow compile does not hold
+  up other processes on the calling process's scheduler.
+
   See the [docs] for more information:
 
   [docs]: http://intel.github.io/hyperscan/dev-reference/api_files.html#c.hs_compile
@@ -90,7 +191,12 @@ defmodule Hyperscan do
     compile(expression, flags, mode, platform)
   end
 
-  @doc false
+  @doc """
+  Compile a regular expression for a platform.
+
+  Like compile/3, but builds the database for `platform`, from
+  populate_platform/0 or make_platform/2, or for the current host if nil.
+  """
   def compile(_expression, _flags, _mode, _platform), do: exit(:nif_not_loaded)
 
   @doc """
@@ -106,6 +212,9 @@ defmodule Hyperscan do
     match_multi/3 if its corresponding expression matches the input string.
   - `mode` is an integer returned by mode/1.
 
+  Like compile/3, this runs on a dirty CPU scheduler. Large pattern sets can
+  take seconds to compile, but only the calling process waits on them.
+
   See the [docs] for more information:
 
   [docs]: http://intel.github.io/hyperscan/dev-reference/api_files.html#c.hs_compile_multi
@@ -128,9 +237,150 @@ defmodule Hyperscan do
     compile_multi(expression_list, flags_list, id_list, mode, platform)
   end
 
-  @doc false
+  @doc """
+  Compile multiple regular expressions for a platform.
+
+  Like compile_multi/4, but builds the database for `platform`, as with
+  compile/4. Hyperscan.Variants uses this to build a database for each kind
+  of host in a fleet.
+  """
   def compile_multi(_expression_list, _flags_list, _id_list, _mode, _platform), do: exit(:nif_not_loaded)
 
+  @doc """
+  Compile multiple regular expressions with extended parameters.
+
+  Takes the same arguments as compile_multi/4, plus `ext_list`, which has one
+  element for each expression: nil, or a map with any of these keys:
+
+  - `:min_offset` - the minimum end offset of a match.
+  - `:max_offset` - the maximum end offset of a match. Bounding this lets
+    Hyperscan stop looking for the expression past that point in the input.
+  - `:min_length` - the minimum length of a match, from start to end.
+  - `:edit_distance` - match within this Levenshtein distance.
+  - `:hamming_distance` - match within this Hamming distance.
+
+  Runs on a dirty CPU scheduler.
+
+  See the [docs] for more information:
+
+  [docs]: http://intel.github.io/hyperscan/dev-reference/api_files.html#c.hs_expr_ext
+
+  # Example
+
+      iex> mode = Hyperscan.mode("HS_MODE_BLOCK")
+      iex> {:ok, db} = Hyperscan.compile_ext_multi(["foo", "bar"], [0, 0], [1, 2], [%{max_offset: 3}, nil], mode)
+      iex> {:ok, scratch} = Hyperscan.alloc_scratch(db)
+      iex> Hyperscan.match_multi(db, "foo bar", scratch)
+      {:ok, [2, 1]}
+      iex> Hyperscan.match_multi(db, "bar foo", scratch)
+      {:ok, [2]}
+  """
+  def compile_ext_multi(expression_list, flags_list, id_list, ext_list, mode) do
+    platform = nil
+    compile_ext_multi(expression_list, flags_list, id_list, ext_list, mode, platform)
+  end
+
+  @doc false
+  def compile_ext_multi(_expression_list, _flags_list, _id_list, _ext_list, _mode, _platform), do: exit(:nif_not_loaded)
+
+  @doc """
+  Compile multiple regular expressions with Chimera.
+
+  Chimera runs expressions through Hyperscan first and hands only likely
+  matches to PCRE, so it supports what Hyperscan alone does not, such as
+  capture groups and backreferences. Only available when chimera_enabled/0
+  is true.
+
+  Takes the same arguments as compile_multi/4. Flags are those named
+  CH_FLAG_* by flag/1, and `mode` is mode("CH_MODE_GROUPS") to report
+  capture groups or mode("CH_MODE_NOGROUPS") not to.
+
+  Runs on a dirty CPU scheduler.
+
+  # Example
+
+      {:ok, db} = ch_compile_multi(["(\\\\w+)@(\\\\w+)"], [0], [1], mode("CH_MODE_GROUPS"))
+      {:ok, scratch} = ch_alloc_scratch(db)
+      ch_scan(db, "mail bob@example", scratch)
+      #=> {:ok, [{1, 5, 16, [{5, 16}, {5, 8}, {9, 16}]}]}
+  """
+  def ch_compile_multi(expression_list, flags_list, id_list, mode) do
+    platform = nil
+    ch_compile_multi(expression_list, flags_list, id_list, mode, platform)
+  end
+
+  @doc false
+  def ch_compile_multi(_expression_list, _flags_list, _id_list, _mode, _platform), do: exit(:nif_not_loaded)
+
+  @doc """
+  Allocate a scratch for scanning with a database from ch_compile_multi/4.
+  """
+  def ch_alloc_scratch(_db), do: exit(:nif_not_loaded)
+
+  @doc """
+  Scan a string with a database from ch_compile_multi/4.
+
+  Returns `{:ok, matches}` where `matches` is a list of
+  `{id, from, to, captures}` in the order they were found. With
+  CH_MODE_GROUPS, `captures` has an element for the whole match followed by
+  one for each group, which is `{from, to}`, or nil if the group took no
+  part in the match. With CH_MODE_NOGROUPS it is empty.
+
+  Returns `{:error, :CH_ERROR_MATCHLIMIT}` or
+  `{:error, :CH_ERROR_RECURSIONLIMIT}` if PCRE gave up on an expression.
+  """
+  def ch_scan(_db, _string, _scratch), do: exit(:nif_not_loaded)
+
+  @doc """
+  Compile a set of literal strings into a database.
+
+  Literals are matched byte for byte, with no regex syntax, and may contain
+  NUL bytes. Large keyword lists compile much faster this way than through
+  compile_multi/4, and into smaller databases.
+
+  - `literals` is a list of binaries, or a binary from pack_literals/1.
+    Packing half a million literals into one binary saves decoding as many
+    terms.
+  - `flags` is an integer applying to every literal, or a list with one for
+    each. Only HS_FLAG_CASELESS, HS_FLAG_SINGLEMATCH and HS_FLAG_SOM_LEFTMOST
+    are supported.
+  - `ids` is a list with one ID for each literal, or nil to number them from
+    zero in order.
+  - `mode` is an integer returned by mode/1.
+
+  Runs on a dirty CPU scheduler.
+
+  # Example
+
+      iex> {:ok, db} = Hyperscan.compile_literals(["foo", "a.b"], 0, nil, Hyperscan.mode("HS_MODE_BLOCK"))
+      iex> {:ok, scratch} = Hyperscan.alloc_scratch(db)
+      iex> Hyperscan.match_multi(db, "a.b", scratch)
+      {:ok, [1]}
+      iex> Hyperscan.match_multi(db, "axb", scratch)
+      {:ok, []}
+  """
+  def compile_literals(literals, flags, ids, mode) do
+    platform = nil
+    compile_literals(literals, flags, ids, mode, platform)
+  end
+
+  @doc false
+  def compile_literals(_literals, _flags, _ids, _mode, _platform), do: exit(:nif_not_loaded)
+
+  @doc """
+  Pack a list of literals into a binary for compile_literals/4.
+
+  Each literal is prefixed with its length as a 32-bit big-endian integer.
+
+  # Example
+
+      iex> Hyperscan.pack_literals(["ab", "c"])
+      <<0, 0, 0, 2, ?a, ?b, 0, 0, 0, 1, ?c>>
+  """
+  def pack_literals(literals) do
+    for literal <- literals, into: <<>>, do: <<byte_size(literal)::32, literal::binary>>
+  end
+
   @doc """
   Returns a map with debugging info about a regular expression.
   """
@@ -142,17 +392,100 @@ defmodule Hyperscan do
   @doc false
   def database_size(_db), do: exit(:nif_not_loaded)
 
+  @doc """
+  Turn counting of scan stats for a database on or off. Returns :ok.
+
+  Stats are off by default. While on, every scan of the database counts
+  towards database_stats/1, whichever process runs it. Counting adds a call
+  through an extra callback per match and two clock reads per scan.
+  Turning stats off keeps the counts.
+  """
+  def set_database_stats(_db, _enabled), do: exit(:nif_not_loaded)
+
+  @doc """
+  Zero the counts returned by database_stats/1. Returns :ok.
+
+  Scans running at the same time may count towards either side of a reset.
+  """
+  def reset_database_stats(_db), do: exit(:nif_not_loaded)
+
+  @doc """
+  Returns the stats counted for a database since they were first enabled.
+
+  Returns `{:error, :stats_not_enabled}` if set_database_stats/2 has never
+  turned them on, and otherwise `{:ok, stats}` with these keys:
+
+  - `:enabled` - whether scans are being counted.
+  - `:scans` and `:bytes` - scans run and bytes scanned. Each call to
+    scan_stream/3 counts as a scan.
+  - `:matches` - matches reported, in total.
+  - `:scan_ns` - total time spent scanning.
+  - `:latency_ns` - a histogram of scan times, as a list of
+    `{upper_bound, count}` for the buckets that have counts. A bucket counts
+    scans that took less than `upper_bound` nanoseconds and at least half of
+    it.
+  - `:patterns` - a map of expression ID to its number of matches, for IDs
+    that have matched. Empty for databases loaded with
+    deserialize_database/1, whose IDs are not known.
+
+  # Example
+
+      iex> {:ok, db} = compile_multi(["a", "b"], [0, 0], [1, 2], mode("HS_MODE_BLOCK"))
+      iex> {:ok, scratch} = alloc_scratch(db)
+      iex> :ok = Hyperscan.set_database_stats(db, true)
+      iex> {:ok, _} = Hyperscan.match_multi(db, "aab", scratch)
+      iex> {:ok, stats} = Hyperscan.database_stats(db)
+      iex> Map.take(stats, [:scans, :bytes, :matches, :patterns])
+      %{scans: 1, bytes: 3, matches: 3, patterns: %{1 => 2, 2 => 1}}
+  """
+  def database_stats(_db), do: exit(:nif_not_loaded)
+
   @doc false
   def serialize_database(_db), do: exit(:nif_not_loaded)
 
   @doc false
   def deserialize_database(_binary), do: exit(:nif_not_loaded)
 
+  @doc false
+  def deserialize_database(_binary, _id_list), do: exit(:nif_not_loaded)
+
+  @doc false
+  def deserialize_database_at(_binary), do: exit(:nif_not_loaded)
+
+  @doc false
+  def deserialize_database_file(_path), do: exit(:nif_not_loaded)
+
+  @doc false
+  def serialized_database_info(_binary), do: exit(:nif_not_loaded)
+
+  @doc false
+  def serialized_database_size(_binary), do: exit(:nif_not_loaded)
+
   @doc """
   Allocate a scratch memory buffer for running the regex.
   """
   def alloc_scratch(_db), do: exit(:nif_not_loaded)
 
+  @doc """
+  Allocate a pool of scratch buffers that any number of processes can share.
+
+  The pool can be passed wherever a scanning function takes a scratch. Each
+  scan borrows a scratch from the pool and returns it when done, allocating
+  another if all are in use. The pool grows to the peak number of concurrent
+  scans. Sharing one scratch between processes instead fails with
+  `{:error, :HS_SCRATCH_IN_USE}` when two scans overlap.
+
+  A pool only works with the database it was allocated for.
+
+  # Example
+
+      iex> {:ok, db} = compile("a", 0, mode("HS_MODE_BLOCK"))
+      iex> {:ok, pool} = alloc_scratch_pool(db)
+      iex> Hyperscan.match(db, "abc", pool)
+      {:ok, true}
+  """
+  def alloc_scratch_pool(_db), do: exit(:nif_not_loaded)
+
   @doc """
   Re-allocate a scratch memory buffer.
 
@@ -162,6 +495,47 @@ defmodule Hyperscan do
   """
   def realloc_scratch(_db, _scratch), do: exit(:nif_not_loaded)
 
+  @doc """
+  Create a ruleset, a handle to a database that can be replaced while in use.
+
+  Returns `{:ok, ruleset}`. Scan by pinning the current generation with
+  pin_ruleset/1 and passing its database and scratch pool to any scanning
+  function. Replace the database with swap_ruleset/2.
+
+  # Example
+
+      iex> {:ok, db} = compile("a", 0, mode("HS_MODE_BLOCK"))
+      iex> {:ok, ruleset} = Hyperscan.new_ruleset(db)
+      iex> {1, db, pool} = Hyperscan.pin_ruleset(ruleset)
+      iex> Hyperscan.match(db, "a", pool)
+      {:ok, true}
+      iex> {:ok, db} = compile("b", 0, mode("HS_MODE_BLOCK"))
+      iex> Hyperscan.swap_ruleset(ruleset, db)
+      {:ok, 2}
+      iex> {2, db, pool} = Hyperscan.pin_ruleset(ruleset)
+      iex> Hyperscan.match(db, "a", pool)
+      {:ok, false}
+  """
+  def new_ruleset(_db), do: exit(:nif_not_loaded)
+
+  @doc """
+  Replace a ruleset's database, returning `{:ok, generation}`.
+
+  The new database gets a scratch pool of its own, which grows as scans need
+  it, so there is no need to call realloc_scratch/2. Scans already holding an
+  older generation finish with it undisturbed. Its database and scratch are
+  freed once no process references them.
+  """
+  def swap_ruleset(_ruleset, _db), do: exit(:nif_not_loaded)
+
+  @doc """
+  Returns `{generation, db, pool}` for a ruleset's current database.
+
+  The database and pool belong together and stay valid for as long as they
+  are referenced, even after a swap.
+  """
+  def pin_ruleset(_ruleset), do: exit(:nif_not_loaded)
+
   @doc """
   Create a new scratch buffer of the same size.
   """
@@ -175,7 +549,11 @@ defmodule Hyperscan do
   @doc """
   Test whether the given compiled regex matches a string.
 
-  Requires a scratch buffer allocated by alloc_scratch/1.
+  Requires a scratch buffer allocated by alloc_scratch/1, or a pool from
+  alloc_scratch_pool/1. The same goes for every other scanning function.
+
+  Inputs of at least dirty_scan_threshold/0 bytes are scanned on a dirty
+  scheduler. The same applies to match_multi/3, replace/5 and replace_multi/5.
   """
   def match(_db, _string, _scratch), do: exit(:nif_not_loaded)
 
@@ -184,12 +562,199 @@ defmodule Hyperscan do
 
   The regex should be compiled by compile_multi. Returns a list of expression
   IDs that matched the string. Note that the order of the returned IDs is
-  undefined.
+  undefined, and an ID appears once for each time its expression matched. See
+  scan/4 for a way to get each ID once.
 
   See the docs for compile_multi/4 for more info.
   """
   def match_multi(_db, _string, _scratch), do: exit(:nif_not_loaded)
 
+  @doc """
+  Test whether multiple compiled regexes match each of a list of strings.
+
+  Equivalent to calling match_multi/3 on each string, but in a single call,
+  which saves the fixed cost of a NIF call per string. That matters when the
+  strings are short. Returns `{:ok, results}` where `results` holds one list
+  of IDs per string, in the same order as `strings`.
+
+  Long batches periodically yield to other processes, and a string of at
+  least dirty_scan_threshold/0 bytes moves the rest of the batch to a dirty
+  scheduler.
+
+  # Example
+
+      iex> {:ok, db} = compile_multi(["a", "b"], [0, 0], [1, 2], mode("HS_MODE_BLOCK"))
+      iex> {:ok, scratch} = alloc_scratch(db)
+      iex> Hyperscan.match_multi_batch(db, ["a", "b", "c"], scratch)
+      {:ok, [[1], [2], []]}
+  """
+  def match_multi_batch(_db, _strings, _scratch), do: exit(:nif_not_loaded)
+
+  @doc """
+  Allocate a pool for scanning batches in parallel with match_multi_parallel/2.
+
+  The pool holds the database and one scratch per native worker thread. The
+  library runs one worker thread per online CPU, started on first use. The
+  scratches are allocated once, here, and can be reused by any number of
+  batches.
+  """
+  def alloc_batch_pool(_db), do: exit(:nif_not_loaded)
+
+  @doc """
+  Scan a batch of records across all CPUs.
+
+  `records` is either a list of binaries or a single binary of
+  newline-separated records. A trailing newline does not start another
+  record. The batch is split across the native worker threads of `pool` from
+  alloc_batch_pool/1. Binaries are shared with the workers, not copied.
+
+  Returns `{:ok, ref}` immediately. When the batch is done, the calling
+  process receives `{:hyperscan_batch, ref, {:ok, results}}`. `results` has
+  one list of IDs per record, in order, as match_multi/3 would return. If any
+  scan fails, the message carries `{:error, reason}` instead.
+
+  # Example
+
+      iex> {:ok, db} = compile_multi(["a", "b"], [0, 0], [1, 2], mode("HS_MODE_BLOCK"))
+      iex> {:ok, pool} = alloc_batch_pool(db)
+      iex> {:ok, ref} = match_multi_parallel(pool, "a\\nb\\nc\\n")
+      iex> receive do {:hyperscan_batch, ^ref, result} -> result end
+      {:ok, [[1], [2], []]}
+  """
+  def match_multi_parallel(_pool, _records), do: exit(:nif_not_loaded)
+
+  @doc """
+  Compile multiple regular expressions into `num_shards` databases at once.
+
+  Takes the same arguments as compile_multi/4. Each expression goes to a
+  shard chosen from its ID, and the shards compile in parallel on native
+  threads of their own, one per online CPU at most. These are separate from
+  the workers used by match_multi_parallel/2, so compiles never delay batch
+  scans. Returns `{:ok, sharded}`, or the error of the first shard that
+  failed, with the expression index counted in the full list.
+
+  # Example
+
+      iex> {:ok, sharded} = compile_sharded(["a", "b"], [0, 0], [1, 2], mode("HS_MODE_BLOCK"), 4)
+      iex> {:ok, ids} = match_multi_sharded(sharded, "ab")
+      iex> Enum.sort(ids)
+      [1, 2]
+      iex> {:ok, [_shard]} = recompile_sharded(sharded, ["a", "c"], [0, 0], [1, 2])
+      iex> match_multi_sharded(sharded, "b")
+      {:ok, []}
+  """
+  def compile_sharded(_expression_list, _flags_list, _id_list, _mode, _num_shards), do: exit(:nif_not_loaded)
+
+  @doc """
+  Replace the rules of a sharded database from compile_sharded/5.
+
+  Takes the complete new rule set. Only shards whose rules changed are
+  compiled, in parallel, and they are swapped in together once all succeed.
+  Returns `{:ok, shards}`, listing the indexes of the shards replaced. On
+  error the database keeps its old rules. Scans already running finish with
+  the shards they started with.
+  """
+  def recompile_sharded(_sharded, _expression_list, _flags_list, _id_list), do: exit(:nif_not_loaded)
+
+  @doc """
+  Returns `{generation, dbs}` for a sharded database.
+
+  `dbs` has one database per shard, or nil for a shard with no rules. The
+  databases stay valid for as long as they are referenced, even after a
+  recompile.
+  """
+  def pin_sharded_database(_sharded), do: exit(:nif_not_loaded)
+
+  @doc """
+  Find the matches of every shard of a sharded database in a string.
+
+  Returns `{:ok, ids}` with the IDs of all shards merged, as match_multi/3
+  would return for a single database, though not in order of the matches.
+  The scratch is managed by the sharded database. Each one is grown to fit
+  every shard, so one scratch serves a whole scan.
+  """
+  def match_multi_sharded(_sharded, _string), do: exit(:nif_not_loaded)
+
+  @doc """
+  Find the matches of compiled regexes in a string.
+
+  Like match_multi/3, but the `:result` option selects the shape of the
+  result:
+
+  - `:ids` (default) returns a list of expression IDs, one per match.
+  - `:tuples` returns a list of `{id, from, to}` tuples.
+  - `:packed` returns a single binary of fixed-width records, one per match,
+    which can be read with
+    `for <<id::32-native, from::64-native, to::64-native <- packed>>`. This
+    allocates no terms per match, so it suits inputs with many matches.
+
+  Other options:
+
+  - `unique: true` reports each expression ID once, at its first match,
+    however many times the expression matches.
+  - `stop_on: :all` stops scanning once every ID in the database has been
+    reported. IDs are not known for databases loaded with
+    deserialize_database/1, and expressions compiled with HS_FLAG_QUIET never
+    report, so in those cases the scan runs to the end.
+  - `stop_on: ids` stops scanning as soon as any ID in the list `ids` is
+    reported.
+
+  Matches are returned in the order Hyperscan reported them, which is by
+  ascending `to` offset. `from` is zero unless the expression was compiled
+  with HS_FLAG_SOM_LEFTMOST.
+
+  # Example
+
+      iex> {:ok, db} = compile_multi(["a", "b"], [0, 0], [1, 2], mode("HS_MODE_BLOCK"))
+      iex> {:ok, scratch} = alloc_scratch(db)
+      iex> Hyperscan.scan(db, "abab", scratch)
+      {:ok, [1, 2, 1, 2]}
+      iex> Hyperscan.scan(db, "ab", scratch, result: :tuples)
+      {:ok, [{1, 0, 1}, {2, 0, 2}]}
+      iex> {:ok, packed} = Hyperscan.scan(db, "ab", scratch, result: :packed)
+      iex> for <<id::32-native, from::64-native, to::64-native <- packed>>, do: {id, from, to}
+      [{1, 0, 1}, {2, 0, 2}]
+      iex> Hyperscan.scan(db, "aaab", scratch, unique: true)
+      {:ok, [1, 2]}
+      iex> Hyperscan.scan(db, "abab", scratch, stop_on: :all)
+      {:ok, [1, 2]}
+  """
+  def scan(_db, _string, _scratch, _opts \\ []), do: exit(:nif_not_loaded)
+
+  @doc """
+  Test whether a compiled regex matches iodata.
+
+  Like match/3, but takes iodata such as a list of binaries. The database
+  must have been compiled with HS_MODE_VECTORED. The binaries are scanned in
+  place, so this avoids flattening the iodata with IO.iodata_to_binary/1.
+
+  # Example
+
+      iex> {:ok, db} = compile("foo", 0, mode("HS_MODE_VECTORED"))
+      iex> {:ok, scratch} = alloc_scratch(db)
+      iex> Hyperscan.match_vectored(db, ["f", ["o" | "o"]], scratch)
+      {:ok, true}
+  """
+  def match_vectored(_db, _iodata, _scratch), do: exit(:nif_not_loaded)
+
+  @doc """
+  Find the matches of multiple compiled regexes in iodata.
+
+  The database must have been compiled with HS_MODE_VECTORED. Returns
+  `{:ok, matches}` where `matches` is a list of `{id, from, to}` tuples in the
+  order they were found. Offsets are into the iodata as if it were flattened.
+  `from` is zero unless the expression was compiled with
+  HS_FLAG_SOM_LEFTMOST.
+
+  # Example
+
+      iex> {:ok, db} = compile_multi(["foo", "bar"], [0, 0], [1, 2], mode("HS_MODE_VECTORED"))
+      iex> {:ok, scratch} = alloc_scratch(db)
+      iex> Hyperscan.match_multi_vectored(db, ["fo", "o b", ?a, "r"], scratch)
+      {:ok, [{1, 0, 3}, {2, 0, 7}]}
+  """
+  def match_multi_vectored(_db, _iodata, _scratch), do: exit(:nif_not_loaded)
+
   @doc """
   Replace parts of a string that match a regular expression.
 
@@ -197,12 +762,150 @@ defmodule Hyperscan do
 
   Requires a scratch buffer allocated by alloc_scratch/1.
 
+  Where matches overlap, the leftmost is replaced, and of those starting at
+  the same offset the longest.
+
+  The `:result` option selects the shape of the result:
+
+  - `:binary` (default) returns a new binary. Its size is computed before it
+    is written, so the output is written exactly once.
+  - `:iodata` returns a list of sub-binaries of `string` and `replacement`,
+    which copies nothing. Use it when the result is headed for a socket or
+    file.
+
   # Example
 
       iex> {:ok, db} = compile("b", flag("HS_FLAG_SOM_LEFTMOST"), mode("HS_MODE_BLOCK"))
       iex> {:ok, scratch} = alloc_scratch(db)
       iex> Hyperscan.replace(db, "a b c", "x", scratch)
       {:ok, "a x c"}
+      iex> Hyperscan.replace(db, "a b c", "x", scratch, result: :iodata)
+      {:ok, ["a ", "x", " c"]}
+  """
+  def replace(_db, _string, _replacement, _scratch, _opts \\ []), do: exit(:nif_not_loaded)
+
+  @doc """
+  Replace matches of several expressions, each with its own replacement.
+
+  The database must have been compiled with HS_FLAG_SOM_LEFTMOST.
+  `replacements` is a map of expression ID to one of:
+
+  - a binary, which replaces the match.
+  - `{:mask, byte}`, which overwrites the match with `byte`, keeping its
+    length. Useful for redaction.
+
+  Matches of IDs missing from the map are left alone and do not take part in
+  overlap resolution.
+
+  The `:overlap` option chooses which of several overlapping matches wins:
+
+  - `:leftmost_longest` (default) replaces the leftmost, and of those starting
+    at the same offset the longest, lower IDs breaking ties.
+  - `:priority` lets lower IDs win over higher ones wherever they overlap.
+
+  Takes the same `:result` option as replace/5.
+
+  # Example
+
+      iex> {:ok, db} = compile_multi(["\\\\d{4}", "secret"], [flag("HS_FLAG_SOM_LEFTMOST"), flag("HS_FLAG_SOM_LEFTMOST")], [1, 2], mode("HS_MODE_BLOCK"))
+      iex> {:ok, scratch} = alloc_scratch(db)
+      iex> Hyperscan.replace_multi(db, "pin 1234 is secret", %{1 => {:mask, ?*}, 2 => "[redacted]"}, scratch)
+      {:ok, "pin **** is [redacted]"}
+  """
+  def replace_multi(_db, _string, _replacements, _scratch, _opts \\ []), do: exit(:nif_not_loaded)
+
+  @doc """
+  Open a stream for scanning data that arrives in pieces.
+
+  The database must have been compiled with HS_MODE_STREAM. Matches that span
+  pieces are found, and the total scan cost is linear in the bytes scanned.
+
+  Returns `{:ok, stream}`. A stream must only be used by one process at a
+  time. Calls that find it busy return `{:error, :stream_in_use}`.
+
+  # Example
+
+      iex> {:ok, db} = compile("foo", 0, mode("HS_MODE_STREAM"))
+      iex> {:ok, scratch} = alloc_scratch(db)
+      iex> {:ok, stream} = open_stream(db)
+      iex> Hyperscan.scan_stream(stream, "xf", scratch)
+      {:ok, []}
+      iex> Hyperscan.scan_stream(stream, "oo", scratch)
+      {:ok, [{0, 0, 4}]}
+      iex> Hyperscan.close_stream(stream, scratch)
+      {:ok, []}
+  """
+  def open_stream(_db), do: exit(:nif_not_loaded)
+
+  @doc """
+  Scan the next piece of data written to a stream.
+
+  Returns `{:ok, matches}` where `matches` is a list of `{id, from, to}`
+  tuples in the order they were found. Offsets are counted from the start of
+  the stream. `from` is only set when the expression was compiled with
+  HS_FLAG_SOM_LEFTMOST, and is zero otherwise. In stream mode that flag also
+  requires one of the HS_MODE_SOM_HORIZON_* modes.
+
+  Returns `{:error, :stream_closed}` if the stream has been closed.
+  """
+  def scan_stream(_stream, _string, _scratch), do: exit(:nif_not_loaded)
+
+  @doc """
+  Reset a stream to its initial state so it can be reused.
+
+  Returns `{:ok, matches}` with any matches that occur at the end of the data
+  scanned so far. Passing `nil` as the scratch discards those matches.
+  """
+  def reset_stream(_stream, _scratch), do: exit(:nif_not_loaded)
+
+  @doc """
+  Close a stream and free its state.
+
+  Returns `{:ok, matches}` with any matches that occur at the end of the
+  data. Passing `nil` as the scratch discards those matches. A stream that is
+  never closed is freed when it is garbage collected.
+  """
+  def close_stream(_stream, _scratch), do: exit(:nif_not_loaded)
+
+  @doc """
+  Compress the state of a stream into a binary.
+
+  The binary holds everything needed to resume scanning and is usually much
+  smaller than the open stream. It can be stored in ETS or sent to another
+  node running the same Hyperscan version and database. To park an idle
+  stream, compress it and then close it with `close_stream(stream, nil)`.
+
+  Returns `{:ok, binary}`.
+  """
+  def compress_stream(_stream), do: exit(:nif_not_loaded)
+
+  @doc """
+  Open a new stream from state saved by compress_stream/1.
+
+  `db` must be the database the stream was opened with. Returns
+  `{:ok, stream}`.
+
+  # Example
+
+      iex> {:ok, db} = compile("foo", 0, mode("HS_MODE_STREAM"))
+      iex> {:ok, scratch} = alloc_scratch(db)
+      iex> {:ok, stream} = open_stream(db)
+      iex> {:ok, []} = scan_stream(stream, "fo", scratch)
+      iex> {:ok, state} = compress_stream(stream)
+      iex> {:ok, []} = close_stream(stream, nil)
+      iex> {:ok, stream} = expand_stream(db, state)
+      iex> Hyperscan.scan_stream(stream, "o", scratch)
+      {:ok, [{0, 0, 3}]}
+  """
+  def expand_stream(_db, _binary), do: exit(:nif_not_loaded)
+
+  @doc """
+  Reset an open stream and load state saved by compress_stream/1 into it.
+
+  This reuses the stream's memory instead of opening a new stream. Returns
+  `{:ok, matches}` with any end-of-data matches from the state being
+  discarded, as reset_stream/2 does. Passing `nil` as the scratch discards
+  them.
   """
-  def replace(_db, _string, _replacement, _scratch), do: exit(:nif_not_loaded)
+  def reset_and_expand_stream(_stream, _binary, _scratch), do: exit(:nif_not_loaded)
 end
@@ -0,0 +1,141 @@
+defmodule Hyperscan.Cache do
+  @moduledoc """
+  Caches compiled databases on disk.
+
+  Compiling a large set of expressions can take tens of seconds. compile_multi/6
+  does so once, saves the serialized database to a directory, and on later
+  calls loads it from there instead, which takes milliseconds.
+
+  Files are named by a hash of everything that goes into the compile: the
+  expressions, flags, IDs, mode, target platform and Hyperscan version. A
+  change to any of them compiles a new database under a new name. Stale files
+  are never removed.
+
+  A file that cannot be loaded, because it is corrupt or was written by a
+  different version of Hyperscan, is recompiled and overwritten. Files are
+  written to a temporary name and renamed into place, so a reader never sees
+  a partial file, even with several nodes sharing the directory.
+
+  Databases loaded from the cache keep their IDs, so they behave exactly as
+  freshly compiled ones do.
+  """
+
+  import Bitwise
+  require Logger
+
+  @extension ".hsdb"
+
+  @doc """
+  Compile multiple regular expressions, or load them from `dir`.
+
+  Takes the same arguments as Hyperscan.compile_multi/4, after `dir`, and
+  returns the same results. `platform` is a platform from
+  Hyperscan.populate_platform/0 or Hyperscan.make_platform/2, or nil for the
+  current host.
+
+  # Example
+
+      iex> dir = Path.join(System.tmp_dir!(), "hyperscan_cache_" <> Integer.to_string(System.unique_integer([:positive])))
+      iex> mode = Hyperscan.mode("HS_MODE_BLOCK")
+      iex> {:ok, db} = Hyperscan.Cache.compile_multi(dir, ["foo", "bar"], [0, 0], [1, 2], mode)
+      iex> {:ok, scratch} = Hyperscan.alloc_scratch(db)
+      iex> _ = File.rm_rf!(dir)
+      iex> Hyperscan.match_multi(db, "bar", scratch)
+      {:ok, [2]}
+  """
+  def compile_multi(dir, expression_list, flags_list, id_list, mode, platform \\ nil) do
+    path = path(dir, expression_list, flags_list, id_list, mode, platform)
+
+    case load(path, id_list, platform) do
+      {:ok, db} ->
+        {:ok, db}
+
+      :error ->
+        with {:ok, db} <- Hyperscan.compile_multi(expression_list, flags_list, id_list, mode, platform) do
+          store(path, db)
+          {:ok, db}
+        end
+    end
+  end
+
+  @doc """
+  Returns the path compile_multi/6 uses for the given arguments.
+  """
+  def path(dir, expression_list, flags_list, id_list, mode, platform \\ nil) do
+    Path.join(dir, key(expression_list, flags_list, id_list, mode, platform) <> @extension)
+  end
+
+  defp key(expression_list, flags_list, id_list, mode, platform) do
+    term = {Hyperscan.version(), expression_list, flags_list, id_list, mode, platform_key(platform)}
+    :crypto.hash(:sha256, :erlang.term_to_binary(term, [:deterministic]))
+    |> Base.encode16(case: :lower)
+  end
+
+  defp platform_key(nil) do
+    {:ok, platform} = Hyperscan.populate_platform()
+    platform_key(platform)
+  end
+
+  defp platform_key(platform) do
+    platform |> Hyperscan.platform_info_to_map() |> Enum.sort()
+  end
+
+  # Loaded with the IDs it was compiled with, so that a cached database
+  # behaves the same as a freshly compiled one.
+  defp load(path, id_list, platform) do
+    with {:ok, binary} <- File.read(path),
+         {:ok, info} <- Hyperscan.serialized_database_info(binary),
+         true <- compatible?(info, platform),
+         {:ok, db} <- Hyperscan.deserialize_database(binary, id_list) do
+      {:ok, db}
+    else
+      _ -> :error
+    end
+  end
+
+  # Info looks like "Version: 5.4.0 Features: AVX2 Mode: BLOCK". The file
+  # must come from this version, and use no CPU features beyond those of the
+  # platform it was compiled for.
+  defp compatible?(info, platform) do
+    [version | _] = String.split(Hyperscan.version(), " ")
+
+    with "Version: " <> rest <- info,
+         [^version, rest] <- String.split(rest, " ", parts: 2),
+         "Features:" <> rest <- rest,
+         [features, _mode] <- String.split(rest, "Mode:", parts: 2),
+         {:ok, used} <- feature_bits(String.split(features)) do
+      allowed = Keyword.fetch!(platform_key(platform), :cpu_features)
+      (used &&& allowed) == used
+    else
+      _ -> false
+    end
+  end
+
+  defp feature_bits(names) do
+    Enum.reduce_while(names, {:ok, 0}, fn name, {:ok, bits} ->
+      case name do
+        name when name in ["AVX2", "AVX512", "AVX512VBMI"] ->
+          {:cont, {:ok, bits ||| Hyperscan.cpu_feature("HS_CPU_FEATURES_" <> name)}}
+
+        _ ->
+          {:halt, :error}
+      end
+    end)
+  end
+
+  defp store(path, db) do
+    tmp_path = "#{path}.#{System.unique_integer([:positive])}.tmp"
+
+    with {:ok, binary} <- Hyperscan.serialize_database(db),
+         :ok <- File.mkdir_p(Path.dirname(path)),
+         :ok <- File.write(tmp_path, binary),
+         :ok <- File.rename(tmp_path, path) do
+      :ok
+    else
+      error ->
+        File.rm(tmp_path)
+        Logger.warning("Hyperscan.Cache could not write #{path}: #{inspect(error)}")
+        error
+    end
+  end
+end
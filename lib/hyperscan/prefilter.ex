@@ -0,0 +1,234 @@
+defmodule Hyperscan.Prefilter do
+  @moduledoc """
+  Scans with expressions that Hyperscan cannot match exactly.
+
+  Hyperscan rejects some PCRE constructs, such as backreferences. compile/4
+  compiles those expressions with HS_FLAG_PREFILTER instead. Hyperscan then
+  reports a superset of their matches, and scan/3 checks each of those
+  candidates with `:re`. Every other expression is matched by Hyperscan
+  alone, so a set where few expressions need checking scans at close to
+  Hyperscan's speed.
+
+  A candidate is checked by looking for a match of the expression that ends
+  where the candidate ends. The search starts no earlier than the widest
+  possible match before that point, when Hyperscan can bound it, and
+  otherwise no earlier than the `:lookback` option of compile/4. Lookaheads
+  at the end of a match cannot see past it.
+
+  Checking a candidate costs up to the square of the region searched, as
+  `:re` tries each start in it. The cost of a scan is therefore about the
+  number of candidates times that, independent of the length of the input,
+  unless `lookback: :infinity` is given. Matches of unbounded expressions
+  that are longer than the lookback are missed.
+
+  # Example
+
+      iex> alias Hyperscan.Prefilter
+      iex> {:ok, prefilter} = Prefilter.compile(["foo", "(a+)b\\\\1"], [0, 0], [1, 2])
+      iex> Prefilter.prefiltered_ids(prefilter)
+      [2]
+      iex> {:ok, scratch} = Hyperscan.alloc_scratch(prefilter.db)
+      iex> Prefilter.scan(prefilter, "foo aba", scratch)
+      {:ok, [{1, 0, 3}, {2, 4, 7}]}
+      iex> Prefilter.scan(prefilter, "aabxa", scratch)
+      {:ok, []}
+  """
+
+  import Bitwise
+
+  defstruct [:db, :ids, :verifiers]
+
+  # Hyperscan reports this max_width for expressions with no upper bound.
+  @unbounded 0xFFFFFFFF
+
+  @default_lookback 4096
+
+  @doc """
+  Compile expressions, falling back to prefiltering for those that need it.
+
+  Takes the same first three arguments as Hyperscan.compile_multi/4. Returns
+  `{:ok, prefilter}`, or the error for the first expression that cannot be
+  compiled even as a prefilter, or whose prefiltered form `:re` cannot
+  compile.
+
+  The database is always compiled in block mode, as scan/3 scans blocks.
+
+  Options:
+
+    * `:lookback` - how many bytes before the end of a candidate to search
+      when checking an expression whose matches have no maximum width.
+      Defaults to #{@default_lookback}. `:infinity` searches from the start
+      of the input, which finds every match at the cost of reading the input
+      up to each candidate.
+
+  The database is compiled with each expression's position in the list as
+  its ID. scan/3 maps them back.
+  """
+  def compile(expression_list, flags_list, id_list, opts \\ []) do
+    mode = Hyperscan.mode("HS_MODE_BLOCK")
+    lookback = Keyword.get(opts, :lookback, @default_lookback)
+    expressions = List.to_tuple(expression_list)
+    flags = List.to_tuple(flags_list)
+
+    with {:ok, prefiltered} <- find_prefiltered(expression_list, flags_list),
+         {:ok, db, prefiltered} <- compile_db(expressions, flags, mode, prefiltered),
+         {:ok, verifiers} <- compile_verifiers(expressions, flags, prefiltered, lookback) do
+      {:ok, %__MODULE__{db: db, ids: List.to_tuple(id_list), verifiers: verifiers}}
+    end
+  end
+
+  @doc """
+  Returns the IDs of the expressions whose matches scan/3 checks with `:re`.
+  """
+  def prefiltered_ids(%__MODULE__{ids: ids, verifiers: verifiers}) do
+    verifiers |> Map.keys() |> Enum.sort() |> Enum.map(&elem(ids, &1))
+  end
+
+  @doc """
+  Scan a string, returning `{:ok, matches}`.
+
+  `matches` is a list of `{id, from, to}` tuples, as from Hyperscan.scan/4
+  with `result: :tuples`. `from` is always given for prefiltered
+  expressions, and otherwise only with HS_FLAG_SOM_LEFTMOST. A prefiltered
+  expression with HS_FLAG_SINGLEMATCH reports its first verified match only.
+  `scratch` is a scratch or pool for `prefilter.db`.
+  """
+  def scan(%__MODULE__{db: db, ids: ids, verifiers: verifiers}, string, scratch) do
+    with {:ok, candidates} <- Hyperscan.scan(db, string, scratch, result: :tuples) do
+      {matches, _matched} =
+        Enum.flat_map_reduce(candidates, %{}, fn {index, from, to}, matched ->
+          case verifiers do
+            %{^index => %{single: true}} when is_map_key(matched, index) ->
+              {[], matched}
+
+            %{^index => verifier} ->
+              case verify(verifier, string, to) do
+                {:ok, from} -> {[{elem(ids, index), from, to}], Map.put(matched, index, true)}
+                :error -> {[], matched}
+              end
+
+            _ ->
+              {[{elem(ids, index), from, to}], matched}
+          end
+        end)
+
+      {:ok, matches}
+    end
+  end
+
+  defp verify(%{regex: regex, window: window, unicode: unicode}, string, to) do
+    start = if window == :infinity, do: 0, else: max(to - window, 0)
+    # PCRE rejects a start offset inside a UTF-8 character.
+    start = if unicode, do: char_start(string, start), else: start
+
+    case :re.run(binary_part(string, 0, to), regex, offset: start, capture: :first) do
+      {:match, [{from, _length}]} -> {:ok, from}
+      :nomatch -> :error
+    end
+  end
+
+  defp char_start(string, start) when start > 0 and start < byte_size(string) do
+    if (:binary.at(string, start) &&& 0xC0) == 0x80,
+      do: char_start(string, start - 1),
+      else: start
+  end
+
+  defp char_start(_string, start), do: start
+
+  # Returns a map of index to max_width for the expressions that only compile
+  # as prefilters.
+  defp find_prefiltered(expression_list, flags_list) do
+    Enum.zip(expression_list, flags_list)
+    |> Enum.with_index()
+    |> Enum.reduce_while({:ok, %{}}, fn {{expression, flags}, index}, {:ok, acc} ->
+      case Hyperscan.expression_info(expression, flags) do
+        {:ok, _} ->
+          {:cont, {:ok, acc}}
+
+        {:error, {message, _}} ->
+          case prefilter_info(expression, flags) do
+            {:ok, info} -> {:cont, {:ok, Map.put(acc, index, info.max_width)}}
+            {:error, _} -> {:halt, {:error, {message, index}}}
+          end
+      end
+    end)
+  end
+
+  defp prefilter_info(expression, flags) do
+    Hyperscan.expression_info(expression, prefilter_flags(flags))
+  end
+
+  # Prefiltering does not support start of match, which verification finds
+  # anyway. Single match is applied after verification instead, since the
+  # first candidate may be a false positive that hides a later true match.
+  defp prefilter_flags(flags) do
+    cleared = Hyperscan.flag("HS_FLAG_SOM_LEFTMOST") ||| Hyperscan.flag("HS_FLAG_SINGLEMATCH")
+    (flags &&& ~~~cleared) ||| Hyperscan.flag("HS_FLAG_PREFILTER")
+  end
+
+  # Some expressions pass expression_info/2 but fail in the full compile, for
+  # example by exceeding a resource limit. Those are retried as prefilters.
+  defp compile_db(expressions, flags, mode, prefiltered) do
+    count = tuple_size(expressions)
+
+    flags_list =
+      for index <- 0..(count - 1)//1 do
+        flags = elem(flags, index)
+        if Map.has_key?(prefiltered, index), do: prefilter_flags(flags), else: flags
+      end
+
+    case Hyperscan.compile_multi(Tuple.to_list(expressions), flags_list, Enum.to_list(0..(count - 1)//1), mode) do
+      {:ok, db} ->
+        {:ok, db, prefiltered}
+
+      {:error, {message, index}} when index >= 0 ->
+        with false <- Map.has_key?(prefiltered, index),
+             {:ok, info} <- prefilter_info(elem(expressions, index), elem(flags, index)) do
+          compile_db(expressions, flags, mode, Map.put(prefiltered, index, info.max_width))
+        else
+          _ -> {:error, {message, index}}
+        end
+
+      error ->
+        error
+    end
+  end
+
+  defp compile_verifiers(expressions, flags, prefiltered, lookback) do
+    single = Hyperscan.flag("HS_FLAG_SINGLEMATCH")
+    utf8 = Hyperscan.flag("HS_FLAG_UTF8")
+
+    Enum.reduce_while(prefiltered, {:ok, %{}}, fn {index, max_width}, {:ok, acc} ->
+      # Anchored at the end, so that a match must end where the candidate does.
+      source = "(?:" <> elem(expressions, index) <> ")\\z"
+      window = if max_width == @unbounded, do: lookback, else: max_width
+
+      case :re.compile(source, re_options(elem(flags, index))) do
+        {:ok, regex} ->
+          verifier = %{
+            regex: regex,
+            window: window,
+            single: (elem(flags, index) &&& single) != 0,
+            unicode: (elem(flags, index) &&& utf8) != 0
+          }
+
+          {:cont, {:ok, Map.put(acc, index, verifier)}}
+
+        {:error, {message, _position}} ->
+          {:halt, {:error, {List.to_string(message), index}}}
+      end
+    end)
+  end
+
+  defp re_options(flags) do
+    [
+      {"HS_FLAG_CASELESS", :caseless},
+      {"HS_FLAG_DOTALL", :dotall},
+      {"HS_FLAG_MULTILINE", :multiline},
+      {"HS_FLAG_UTF8", :unicode},
+      {"HS_FLAG_UCP", :ucp}
+    ]
+    |> Enum.filter(fn {name, _} -> (flags &&& Hyperscan.flag(name)) != 0 end)
+    |> Enum.map(&elem(&1, 1))
+  end
+end
@@ -0,0 +1,111 @@
+defmodule Hyperscan.Variants do
+  @moduledoc """
+  Builds a database for each kind of host, and loads the best one for this host.
+
+  Hyperscan picks its kernels when a database is compiled, from the platform
+  it targets. A database built for AVX-512 cannot be scanned on a host
+  without AVX-512. A database built for a baseline platform runs anywhere,
+  but leaves wider vector units idle. build/5 compiles a rule set ahead of
+  time, once for each target platform, and serializes each result. load/1
+  picks the variant that uses the most of this host's CPU features and
+  deserializes it, so hosts start without compiling.
+
+  A variant is a map with the `:tune` and `:cpu_features` of its target and
+  the serialized `:database`. A list of variants can be stored as one file
+  with `:erlang.term_to_binary/1`. Include a target with no CPU features so
+  that every host has a variant to load.
+
+  # Example
+
+      iex> alias Hyperscan.Variants
+      iex> avx2 = Hyperscan.cpu_feature("HS_CPU_FEATURES_AVX2")
+      iex> avx512 = Hyperscan.cpu_feature("HS_CPU_FEATURES_AVX512")
+      iex> targets = [
+      ...>   {Hyperscan.tune("HS_TUNE_FAMILY_GENERIC"), 0},
+      ...>   {Hyperscan.tune("HS_TUNE_FAMILY_HSW"), avx2},
+      ...>   {Hyperscan.tune("HS_TUNE_FAMILY_SKX"), Bitwise.bor(avx2, avx512)}
+      ...> ]
+      iex> {:ok, variants} = Variants.build(["foo"], [0], [1], Hyperscan.mode("HS_MODE_BLOCK"), targets)
+      iex> {:ok, db} = Variants.load(variants)
+      iex> {:ok, scratch} = Hyperscan.alloc_scratch(db)
+      iex> Hyperscan.match_multi(db, "foo", scratch)
+      {:ok, [1]}
+  """
+
+  import Bitwise
+
+  @doc """
+  Compile multiple regular expressions once for each target platform.
+
+  Takes the same arguments as Hyperscan.compile_multi/4, plus `targets`, a
+  list of platforms from Hyperscan.make_platform/2 or `{tune, cpu_features}`
+  tuples. Returns `{:ok, variants}` with one variant per target, in order, or
+  the first error.
+  """
+  def build(expression_list, flags_list, id_list, mode, targets) do
+    Enum.reduce_while(targets, {:ok, []}, fn target, {:ok, variants} ->
+      {tune, cpu_features} = target_key(target)
+      {:ok, platform} = Hyperscan.make_platform(tune, cpu_features)
+
+      with {:ok, db} <- Hyperscan.compile_multi(expression_list, flags_list, id_list, mode, platform),
+           {:ok, database} <- Hyperscan.serialize_database(db) do
+        variant = %{tune: tune, cpu_features: cpu_features, database: database}
+        {:cont, {:ok, [variant | variants]}}
+      else
+        error -> {:halt, error}
+      end
+    end)
+    |> case do
+      {:ok, variants} -> {:ok, Enum.reverse(variants)}
+      error -> error
+    end
+  end
+
+  @doc """
+  Returns `{:ok, variant}` with the best variant for `platform`.
+
+  `platform` defaults to the current host, from Hyperscan.populate_platform/0.
+  A variant can run there if the platform has all of its CPU features. Of
+  those, the variant with the most features wins, then one tuned for the
+  platform's microarchitecture. Returns `{:error, :no_compatible_variant}` if
+  none can run.
+  """
+  def select(variants, platform \\ nil) do
+    {tune, cpu_features} = target_key(platform || local_platform())
+
+    variants
+    |> Enum.filter(&((&1.cpu_features &&& cpu_features) == &1.cpu_features))
+    |> Enum.max_by(&{popcount(&1.cpu_features), &1.tune == tune}, fn -> nil end)
+    |> case do
+      nil -> {:error, :no_compatible_variant}
+      variant -> {:ok, variant}
+    end
+  end
+
+  @doc """
+  Deserialize the best variant for the current host, as chosen by select/2.
+
+  Returns `{:ok, db}`. As with Hyperscan.deserialize_database/1, the database
+  does not know its IDs.
+  """
+  def load(variants) do
+    with {:ok, variant} <- select(variants) do
+      Hyperscan.deserialize_database(variant.database)
+    end
+  end
+
+  defp local_platform do
+    {:ok, platform} = Hyperscan.populate_platform()
+    platform
+  end
+
+  defp target_key({tune, cpu_features}), do: {tune, cpu_features}
+
+  defp target_key(platform) do
+    %{tune: tune, cpu_features: cpu_features} = Hyperscan.platform_info_to_map(platform)
+    {tune, cpu_features}
+  end
+
+  defp popcount(0), do: 0
+  defp popcount(n), do: (n &&& 1) + popcount(n >>> 1)
+end
@@ -11,7 +11,8 @@ defmodule Hyperscan.MixProject do
       compilers: [:elixir_make] ++ Mix.compilers(),
       make_targets: ["nifs"],
       make_clean: ["clean"],
-      deps: deps()
+      deps: deps(),
+      aliases: aliases()
     ]
   end
 
@@ -28,14 +29,22 @@ defmodule Hyperscan.MixProject do
 
   def application do
     [
-      extra_applications: [:logger]
+      extra_applications: [:logger, :crypto]
     ]
   end
 
   defp deps do
     [
       {:elixir_make, ">= 0.0.0", runtime: false},
-      {:ex_doc, ">= 0.0.0", only: :dev, runtime: false}
+      {:ex_doc, ">= 0.0.0", only: :dev, runtime: false},
+      {:benchee, "~> 1.3", only: :dev},
+      {:benchee_json, "~> 1.0", only: :dev}
+    ]
+  end
+
+  defp aliases do
+    [
+      bench: ["run bench/run.exs"]
     ]
   end
 end
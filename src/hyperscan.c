@@ -1,15 +1,42 @@
-#include <assert.h>
 #include <erl_nif.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <hs/hs.h>
+#ifdef HYPERSCAN_CHIMERA
+#include <hs/ch.h>
+#endif
+#include <limits.h>
 #include <math.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 ERL_NIF_TERM ok_atom;
 ERL_NIF_TERM error_atom;
 ERL_NIF_TERM nil_atom;
 ERL_NIF_TERM false_atom;
 ERL_NIF_TERM true_atom;
+ERL_NIF_TERM result_atom;
+ERL_NIF_TERM ids_atom;
+ERL_NIF_TERM tuples_atom;
+ERL_NIF_TERM packed_atom;
+ERL_NIF_TERM unique_atom;
+ERL_NIF_TERM stop_on_atom;
+ERL_NIF_TERM all_atom;
+ERL_NIF_TERM binary_atom;
+ERL_NIF_TERM iodata_atom;
+ERL_NIF_TERM mask_atom;
+ERL_NIF_TERM overlap_atom;
+ERL_NIF_TERM leftmost_longest_atom;
+ERL_NIF_TERM priority_atom;
+ERL_NIF_TERM min_offset_atom;
+ERL_NIF_TERM max_offset_atom;
+ERL_NIF_TERM min_length_atom;
+ERL_NIF_TERM edit_distance_atom;
+ERL_NIF_TERM hamming_distance_atom;
 
 void init_atoms(ErlNifEnv * env) {
   ok_atom = enif_make_atom(env, "ok");
@@ -17,6 +44,24 @@ void init_atoms(ErlNifEnv * env) {
   nil_atom = enif_make_atom(env, "nil");
   false_atom = enif_make_atom(env, "false");
   true_atom = enif_make_atom(env, "true");
+  result_atom = enif_make_atom(env, "result");
+  ids_atom = enif_make_atom(env, "ids");
+  tuples_atom = enif_make_atom(env, "tuples");
+  packed_atom = enif_make_atom(env, "packed");
+  unique_atom = enif_make_atom(env, "unique");
+  stop_on_atom = enif_make_atom(env, "stop_on");
+  all_atom = enif_make_atom(env, "all");
+  binary_atom = enif_make_atom(env, "binary");
+  iodata_atom = enif_make_atom(env, "iodata");
+  mask_atom = enif_make_atom(env, "mask");
+  overlap_atom = enif_make_atom(env, "overlap");
+  leftmost_longest_atom = enif_make_atom(env, "leftmost_longest");
+  priority_atom = enif_make_atom(env, "priority");
+  min_offset_atom = enif_make_atom(env, "min_offset");
+  max_offset_atom = enif_make_atom(env, "max_offset");
+  min_length_atom = enif_make_atom(env, "min_length");
+  edit_distance_atom = enif_make_atom(env, "edit_distance");
+  hamming_distance_atom = enif_make_atom(env, "hamming_distance");
 }
 
 ERL_NIF_TERM make_binary_const(ErlNifEnv * env, const char * string) {
@@ -64,6 +109,321 @@ ERL_NIF_TERM error_name_atom(ErlNifEnv * env, hs_error_t error) {
   return enif_make_atom(env, name);
 }
 
+#ifdef HYPERSCAN_CHIMERA
+const char * ch_error_name(ch_error_t error) {
+  switch (error) {
+  case CH_SUCCESS: return "CH_SUCCESS";
+  case CH_INVALID: return "CH_INVALID";
+  case CH_NOMEM: return "CH_NOMEM";
+  case CH_SCAN_TERMINATED: return "CH_SCAN_TERMINATED";
+  case CH_COMPILER_ERROR: return "CH_COMPILER_ERROR";
+  case CH_DB_VERSION_ERROR: return "CH_DB_VERSION_ERROR";
+  case CH_DB_PLATFORM_ERROR: return "CH_DB_PLATFORM_ERROR";
+  case CH_DB_MODE_ERROR: return "CH_DB_MODE_ERROR";
+  case CH_BAD_ALIGN: return "CH_BAD_ALIGN";
+  case CH_BAD_ALLOC: return "CH_BAD_ALLOC";
+  case CH_SCRATCH_IN_USE: return "CH_SCRATCH_IN_USE";
+  case CH_UNKNOWN_HS_ERROR: return "CH_UNKNOWN_HS_ERROR";
+  case CH_FAIL_INTERNAL: return "CH_FAIL_INTERNAL";
+  default: return "UNKNOWN_ERROR";
+  }
+}
+
+ERL_NIF_TERM ch_error_name_atom(ErlNifEnv * env, ch_error_t error) {
+  return enif_make_atom(env, ch_error_name(error));
+}
+#endif
+
+//******************************************************************************
+// scheduling
+//******************************************************************************
+
+// Inputs at least this many bytes long are scanned on a dirty CPU scheduler.
+// Shorter inputs are scanned in place, and a scan of exactly this many bytes
+// is reported to the runtime as one full timeslice.
+atomic_size_t dirty_scan_threshold = 64 * 1024;
+
+int should_schedule_dirty(size_t size) {
+  return size >= atomic_load_explicit(&dirty_scan_threshold, memory_order_relaxed)
+      && enif_thread_type() == ERL_NIF_THR_NORMAL_SCHEDULER;
+}
+
+void consume_timeslice(ErlNifEnv * env, size_t size) {
+  size_t threshold = atomic_load_explicit(&dirty_scan_threshold, memory_order_relaxed);
+  size_t percent = (threshold == 0) ? 100 : size * 100 / threshold;
+
+  if (percent > 0) {
+    enif_consume_timeslice(env, percent > 100 ? 100 : (int) percent);
+  }
+}
+
+// Charges one scanned input of a batch against the timeslice, carrying
+// fractions of a percent over in `pending`. Returns 1 when it is time to
+// yield. Each input also costs a fixed overhead, since batches of tiny inputs
+// are dominated by per-input work rather than scanning.
+#define BATCH_ITEM_COST 256
+
+int consume_batch_timeslice(ErlNifEnv * env, size_t * pending, size_t size) {
+  if (enif_thread_type() != ERL_NIF_THR_NORMAL_SCHEDULER) {
+    return 0;
+  }
+
+  size_t threshold = atomic_load_explicit(&dirty_scan_threshold, memory_order_relaxed);
+  *pending += size + BATCH_ITEM_COST;
+  size_t percent = (threshold == 0) ? 100 : *pending * 100 / threshold;
+
+  if (percent == 0) {
+    return 0;
+  }
+
+  if (percent > 100) {
+    percent = 100;
+  }
+  *pending = (threshold == 0) ? 0 : *pending - percent * threshold / 100;
+  return enif_consume_timeslice(env, percent);
+}
+
+//******************************************************************************
+// scan_vector
+//******************************************************************************
+
+// The binaries of an iolist as segments for hs_scan_vector, in order. The
+// segments point into the binaries themselves, so nothing is copied except
+// byte integers, which are gathered into `bytes`. A run of adjacent byte
+// integers becomes a single segment.
+struct scan_vector {
+  const char ** data;
+  unsigned int * length;
+  unsigned int count;
+  unsigned int capacity;
+  unsigned char * bytes;
+  size_t bytes_size;
+  size_t bytes_capacity;
+  size_t size;
+};
+
+void init_scan_vector(struct scan_vector * vector) {
+  memset(vector, 0, sizeof(* vector));
+}
+
+void free_scan_vector(struct scan_vector * vector) {
+  free(vector->data);
+  free(vector->length);
+  free(vector->bytes);
+  init_scan_vector(vector);
+}
+
+void scan_vector_push_segment(struct scan_vector * vector, const char * data, unsigned int length) {
+  if (vector->count == vector->capacity) {
+    vector->capacity = vector->capacity ? vector->capacity * 2 : 16;
+    vector->data = realloc(vector->data, vector->capacity * sizeof(* vector->data));
+    vector->length = realloc(vector->length, vector->capacity * sizeof(* vector->length));
+  }
+  vector->data[vector->count] = data;
+  vector->length[vector->count] = length;
+  vector->count++;
+}
+
+int scan_vector_push_binary(struct scan_vector * vector, ErlNifBinary * bin) {
+  if (bin->size > UINT_MAX) {
+    return 0;
+  }
+  if (bin->size > 0) {
+    scan_vector_push_segment(vector, (const char *) bin->data, bin->size);
+    vector->size += bin->size;
+  }
+  return 1;
+}
+
+// Byte segments are marked with NULL data until finish_scan_vector, because the
+// bytes buffer may still move.
+void scan_vector_push_byte(struct scan_vector * vector, unsigned char byte) {
+  if (vector->bytes_size == vector->bytes_capacity) {
+    vector->bytes_capacity = vector->bytes_capacity ? vector->bytes_capacity * 2 : 64;
+    vector->bytes = realloc(vector->bytes, vector->bytes_capacity);
+  }
+  vector->bytes[vector->bytes_size++] = byte;
+  vector->size++;
+
+  if (vector->count > 0 && vector->data[vector->count - 1] == NULL) {
+    vector->length[vector->count - 1]++;
+  } else {
+    scan_vector_push_segment(vector, NULL, 1);
+  }
+}
+
+void finish_scan_vector(struct scan_vector * vector) {
+  // Hyperscan rejects a NULL segment array, so empty input needs a segment.
+  if (vector->count == 0) {
+    scan_vector_push_segment(vector, "", 0);
+    return;
+  }
+
+  size_t offset = 0;
+  for (unsigned int i = 0; i < vector->count; i++) {
+    if (vector->data[i] == NULL) {
+      vector->data[i] = (const char *) vector->bytes + offset;
+      offset += vector->length[i];
+    }
+  }
+}
+
+// Walks an iolist without recursion. Returns 0 if it is not valid iodata.
+int get_scan_vector(ErlNifEnv * env, ERL_NIF_TERM iodata, struct scan_vector * vector) {
+  ErlNifBinary bin;
+  init_scan_vector(vector);
+
+  if (enif_inspect_binary(env, iodata, &bin)) {
+    if (!scan_vector_push_binary(vector, &bin)) {
+      return 0;
+    }
+    finish_scan_vector(vector);
+    return 1;
+  }
+
+  if (!enif_is_list(env, iodata)) {
+    return 0;
+  }
+
+  unsigned int depth = 1;
+  unsigned int stack_capacity = 16;
+  ERL_NIF_TERM * stack = malloc(stack_capacity * sizeof(* stack));
+  stack[0] = iodata;
+
+  while (depth > 0) {
+    ERL_NIF_TERM list = stack[--depth];
+    ERL_NIF_TERM head;
+    int byte;
+
+    for (;;) {
+      if (enif_get_list_cell(env, list, &head, &list)) {
+        if (enif_get_int(env, head, &byte) && byte >= 0 && byte <= 255) {
+          scan_vector_push_byte(vector, byte);
+        } else if (enif_inspect_binary(env, head, &bin)) {
+          if (!scan_vector_push_binary(vector, &bin)) goto get_scan_vector_fail;
+        } else if (enif_is_list(env, head)) {
+          // Finish the nested list before the rest of this one.
+          if (depth + 2 > stack_capacity) {
+            stack_capacity *= 2;
+            stack = realloc(stack, stack_capacity * sizeof(* stack));
+          }
+          stack[depth++] = list;
+          stack[depth++] = head;
+          break;
+        } else {
+          goto get_scan_vector_fail;
+        }
+      } else if (enif_is_empty_list(env, list)) {
+        break;
+      } else if (enif_inspect_binary(env, list, &bin)) {
+        // Improper tail.
+        if (!scan_vector_push_binary(vector, &bin)) goto get_scan_vector_fail;
+        break;
+      } else {
+        goto get_scan_vector_fail;
+      }
+    }
+  }
+
+  free(stack);
+  finish_scan_vector(vector);
+  return 1;
+
+get_scan_vector_fail:
+  free(stack);
+  free_scan_vector(vector);
+  return 0;
+}
+
+//******************************************************************************
+// allocators
+//******************************************************************************
+
+// All Hyperscan memory is allocated with enif_alloc, so that it shows up in
+// :erlang.memory/0, and counted by category for memory_stats/0.
+
+enum memory_category {
+  MEMORY_DATABASE,
+  MEMORY_SCRATCH,
+  MEMORY_STREAM,
+  MEMORY_MISC,
+  NUM_MEMORY_CATEGORIES,
+};
+
+struct memory_counter {
+  atomic_size_t bytes;
+  atomic_size_t count;
+};
+
+struct memory_counter memory_counters[NUM_MEMORY_CATEGORIES];
+
+// Hyperscan wants memory aligned for the widest vector type it uses, wider
+// than enif_alloc guarantees. Each block is over-allocated and aligned, with
+// a header just before the aligned pointer recording how to free it.
+#define MEMORY_ALIGNMENT 16
+
+struct memory_header {
+  void * base;
+  size_t size;
+};
+
+void * tracked_alloc(enum memory_category category, size_t size) {
+  size_t padding = sizeof(struct memory_header) + MEMORY_ALIGNMENT;
+  if (size > SIZE_MAX - padding) {
+    return NULL;
+  }
+
+  void * base = enif_alloc(size + padding);
+  if (!base) {
+    return NULL;
+  }
+
+  uintptr_t address = (uintptr_t) base + sizeof(struct memory_header);
+  address = (address + MEMORY_ALIGNMENT - 1) & ~((uintptr_t) MEMORY_ALIGNMENT - 1);
+  struct memory_header * header = (struct memory_header *) address - 1;
+  header->base = base;
+  header->size = size;
+
+  atomic_fetch_add(&memory_counters[category].bytes, size);
+  atomic_fetch_add(&memory_counters[category].count, 1);
+  return (void *) address;
+}
+
+void tracked_free(enum memory_category category, void * ptr) {
+  if (!ptr) {
+    return;
+  }
+
+  struct memory_header * header = (struct memory_header *) ptr - 1;
+  atomic_fetch_sub(&memory_counters[category].bytes, header->size);
+  atomic_fetch_sub(&memory_counters[category].count, 1);
+  enif_free(header->base);
+}
+
+void * database_alloc(size_t size) { return tracked_alloc(MEMORY_DATABASE, size); }
+void database_free(void * ptr) { tracked_free(MEMORY_DATABASE, ptr); }
+void * scratch_alloc(size_t size) { return tracked_alloc(MEMORY_SCRATCH, size); }
+void scratch_free(void * ptr) { tracked_free(MEMORY_SCRATCH, ptr); }
+void * stream_alloc(size_t size) { return tracked_alloc(MEMORY_STREAM, size); }
+void stream_free(void * ptr) { tracked_free(MEMORY_STREAM, ptr); }
+// Frees what Hyperscan returns from hs_serialize_database, hs_database_info
+// and hs_expression_info, among others.
+void * misc_alloc(size_t size) { return tracked_alloc(MEMORY_MISC, size); }
+void misc_free(void * ptr) { tracked_free(MEMORY_MISC, ptr); }
+
+int init_allocators() {
+  return hs_set_database_allocator(database_alloc, database_free) == HS_SUCCESS &&
+         hs_set_scratch_allocator(scratch_alloc, scratch_free) == HS_SUCCESS &&
+         hs_set_stream_allocator(stream_alloc, stream_free) == HS_SUCCESS &&
+         hs_set_misc_allocator(misc_alloc, misc_free) == HS_SUCCESS
+#ifdef HYPERSCAN_CHIMERA
+         && ch_set_database_allocator(database_alloc, database_free) == CH_SUCCESS
+         && ch_set_scratch_allocator(scratch_alloc, scratch_free) == CH_SUCCESS
+         && ch_set_misc_allocator(misc_alloc, misc_free) == CH_SUCCESS
+#endif
+         ;
+}
+
 //******************************************************************************
 // platform_info_resource
 //******************************************************************************
@@ -89,7 +449,9 @@ int open_platform_info_resource_type(ErlNifEnv * env) {
 ERL_NIF_TERM make_platform_info_resource(ErlNifEnv * env, hs_platform_info_t * platform_info) {
   struct platform_info_resource * platform_info_resource = enif_alloc_resource(platform_info_resource_type, sizeof(struct platform_info_resource));
   platform_info_resource->platform_info = platform_info;
-  return enif_make_resource(env, platform_info_resource);
+  ERL_NIF_TERM result = enif_make_resource(env, platform_info_resource);
+  enif_release_resource(platform_info_resource);
+  return result;
 }
 
 int get_platform_info_resource(ErlNifEnv * env, ERL_NIF_TERM arg, hs_platform_info_t ** platform_info) {
@@ -111,20 +473,122 @@ int maybe_get_platform_info_resource(ErlNifEnv * env, ERL_NIF_TERM arg, hs_platf
   return get_platform_info_resource(env, arg, platform_info);
 }
 
+//******************************************************************************
+// database_stats
+//******************************************************************************
+
+// Counters kept for a database once stats are enabled. Scan counters are
+// spread over slots, each used by a few threads, so that schedulers scanning
+// the same database do not contend on one cache line. Scan times are kept
+// in a histogram of power-of-two buckets: bucket i counts scans that took
+// less than 2^i nanoseconds but not less than 2^(i-1).
+
+#define STATS_SLOTS 64
+#define STATS_BUCKETS 40
+
+struct stats_slot {
+  _Alignas(64) atomic_ullong scans;
+  atomic_ullong bytes;
+  atomic_ullong matches;
+  atomic_ullong nanoseconds;
+  atomic_ullong latency[STATS_BUCKETS];
+};
+
+struct database_stats {
+  struct stats_slot slots[STATS_SLOTS];
+  // Matches by position in the database's sorted IDs, or NULL when the IDs
+  // are not known.
+  atomic_ullong * pattern_matches;
+  unsigned int num_patterns;
+};
+
+atomic_uint next_stats_slot;
+_Thread_local unsigned int stats_slot_index = UINT_MAX;
+
+struct stats_slot * current_stats_slot(struct database_stats * stats) {
+  if (stats_slot_index == UINT_MAX) {
+    stats_slot_index = atomic_fetch_add(&next_stats_slot, 1) % STATS_SLOTS;
+  }
+  return &stats->slots[stats_slot_index];
+}
+
+struct database_stats * alloc_database_stats(unsigned int num_patterns) {
+  struct database_stats * stats = aligned_alloc(_Alignof(struct database_stats), sizeof(struct database_stats));
+  memset(stats, 0, sizeof(struct database_stats));
+  if (num_patterns > 0) {
+    stats->pattern_matches = calloc(num_patterns, sizeof(* stats->pattern_matches));
+    stats->num_patterns = num_patterns;
+  }
+  return stats;
+}
+
+void free_database_stats(struct database_stats * stats) {
+  if (stats) {
+    free(stats->pattern_matches);
+    free(stats);
+  }
+}
+
+// Counts that race with a reset may survive it.
+void reset_database_stats(struct database_stats * stats) {
+  for (int i = 0; i < STATS_SLOTS; i++) {
+    struct stats_slot * slot = &stats->slots[i];
+    atomic_store_explicit(&slot->scans, 0, memory_order_relaxed);
+    atomic_store_explicit(&slot->bytes, 0, memory_order_relaxed);
+    atomic_store_explicit(&slot->matches, 0, memory_order_relaxed);
+    atomic_store_explicit(&slot->nanoseconds, 0, memory_order_relaxed);
+    for (int j = 0; j < STATS_BUCKETS; j++) {
+      atomic_store_explicit(&slot->latency[j], 0, memory_order_relaxed);
+    }
+  }
+  for (unsigned int i = 0; i < stats->num_patterns; i++) {
+    atomic_store_explicit(&stats->pattern_matches[i], 0, memory_order_relaxed);
+  }
+}
+
+void record_scan(struct database_stats * stats, size_t bytes, ErlNifTime nanoseconds) {
+  struct stats_slot * slot = current_stats_slot(stats);
+  unsigned long long ns = nanoseconds > 0 ? nanoseconds : 0;
+  int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+  if (bucket >= STATS_BUCKETS) bucket = STATS_BUCKETS - 1;
+
+  atomic_fetch_add_explicit(&slot->scans, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&slot->bytes, bytes, memory_order_relaxed);
+  atomic_fetch_add_explicit(&slot->nanoseconds, ns, memory_order_relaxed);
+  atomic_fetch_add_explicit(&slot->latency[bucket], 1, memory_order_relaxed);
+}
+
 //******************************************************************************
 // database_resource
 //******************************************************************************
 
 struct database_resource {
   hs_database_t * db;
+  // The distinct expression IDs in the database, sorted. NULL when they are
+  // not known, as for a deserialized database.
+  unsigned int * ids;
+  unsigned int num_ids;
+  // Set when the database was deserialized into this resource's own memory,
+  // after the struct, so is freed along with it.
+  int embedded;
+  // Allocated the first time stats are enabled and kept until the database
+  // is freed, so scans never see it go away. Counted only while enabled.
+  _Atomic(struct database_stats *) stats;
+  atomic_int stats_enabled;
 };
 
 ErlNifResourceType * database_resource_type;
 
 void free_database_resource(ErlNifEnv * env, void * obj) {
   struct database_resource * database_resource = (struct database_resource *) obj;
-  hs_free_database(database_resource->db);
+  if (!database_resource->embedded) {
+    hs_free_database(database_resource->db);
+  }
+  free_database_stats(atomic_load(&database_resource->stats));
+  database_resource->stats = NULL;
   database_resource->db = NULL;
+  free(database_resource->ids);
+  database_resource->ids = NULL;
 }
 
 int open_database_resource_type(ErlNifEnv * env) {
@@ -133,10 +597,83 @@ int open_database_resource_type(ErlNifEnv * env) {
   return database_resource_type != NULL;
 }
 
-ERL_NIF_TERM make_database_resource(ErlNifEnv * env, hs_database_t * db) {
+int compare_uint(const void * a, const void * b) {
+  unsigned int x = *(const unsigned int *) a;
+  unsigned int y = *(const unsigned int *) b;
+  return (x > y) - (x < y);
+}
+
+// Pass the IDs the database was compiled with, or NULL if they are unknown.
+// Returns the new resource with the caller's reference.
+struct database_resource * alloc_database_resource(hs_database_t * db, const unsigned int * ids, unsigned int num_ids) {
   struct database_resource * database_resource = enif_alloc_resource(database_resource_type, sizeof(struct database_resource));
   database_resource->db = db;
-  return enif_make_resource(env, database_resource);
+  database_resource->ids = NULL;
+  database_resource->num_ids = 0;
+  database_resource->embedded = 0;
+  atomic_init(&database_resource->stats, NULL);
+  atomic_init(&database_resource->stats_enabled, 0);
+
+  if (ids && num_ids > 0) {
+    unsigned int * sorted = malloc(num_ids * sizeof(* sorted));
+    memcpy(sorted, ids, num_ids * sizeof(* sorted));
+    qsort(sorted, num_ids, sizeof(* sorted), compare_uint);
+
+    unsigned int distinct = 1;
+    for (unsigned int i = 1; i < num_ids; i++) {
+      if (sorted[i] != sorted[distinct - 1]) {
+        sorted[distinct++] = sorted[i];
+      }
+    }
+
+    database_resource->ids = sorted;
+    database_resource->num_ids = distinct;
+  }
+
+  return database_resource;
+}
+
+ERL_NIF_TERM make_database_resource(ErlNifEnv * env, hs_database_t * db, const unsigned int * ids, unsigned int num_ids) {
+  struct database_resource * database_resource = alloc_database_resource(db, ids, num_ids);
+  ERL_NIF_TERM result = enif_make_resource(env, database_resource);
+  enif_release_resource(database_resource);
+  return result;
+}
+
+// Hyperscan needs the database memory aligned to at least 8 bytes.
+#define DATABASE_ALIGNMENT 16
+
+// Deserializes into memory allocated as part of the resource, so the
+// database is a single allocation, freed when the last reference goes.
+hs_error_t make_embedded_database_resource(ErlNifEnv * env, const char * bytes, size_t length, ERL_NIF_TERM * term) {
+  size_t db_size;
+  hs_error_t error = hs_serialized_database_size(bytes, length, &db_size);
+  if (error != HS_SUCCESS) {
+    return error;
+  }
+
+  size_t offset = sizeof(struct database_resource) + DATABASE_ALIGNMENT;
+  struct database_resource * database_resource = enif_alloc_resource(database_resource_type, offset + db_size);
+  uintptr_t address = (uintptr_t) database_resource + sizeof(struct database_resource);
+  address = (address + DATABASE_ALIGNMENT - 1) & ~((uintptr_t) DATABASE_ALIGNMENT - 1);
+
+  database_resource->db = (hs_database_t *) address;
+  database_resource->ids = NULL;
+  database_resource->num_ids = 0;
+  database_resource->embedded = 1;
+  atomic_init(&database_resource->stats, NULL);
+  atomic_init(&database_resource->stats_enabled, 0);
+
+  error = hs_deserialize_database_at(bytes, length, database_resource->db);
+  if (error != HS_SUCCESS) {
+    database_resource->db = NULL;
+    enif_release_resource(database_resource);
+    return error;
+  }
+
+  *term = enif_make_resource(env, database_resource);
+  enif_release_resource(database_resource);
+  return HS_SUCCESS;
 }
 
 int get_database_resource(ErlNifEnv * env, ERL_NIF_TERM arg, hs_database_t ** db) {
@@ -148,6 +685,251 @@ int get_database_resource(ErlNifEnv * env, ERL_NIF_TERM arg, hs_database_t ** db
   return 1;
 }
 
+int get_database_resource_struct(ErlNifEnv * env, ERL_NIF_TERM arg, struct database_resource ** database_resource) {
+  return enif_get_resource(env, arg, database_resource_type, (void **) database_resource);
+}
+
+// Finds the position of an ID among the database's sorted IDs.
+int database_id_index(const struct database_resource * database_resource, unsigned int id, size_t * index) {
+  const unsigned int * ids = database_resource->ids;
+  unsigned int num_ids = database_resource->num_ids;
+
+  if (!ids || id < ids[0] || id > ids[num_ids - 1]) {
+    return 0;
+  }
+
+  // Consecutive IDs, the common case, need no search.
+  if (ids[num_ids - 1] - ids[0] == num_ids - 1) {
+    *index = id - ids[0];
+    return 1;
+  }
+
+  size_t low = 0;
+  size_t high = num_ids;
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    if (ids[mid] < id) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+
+  if (low < num_ids && ids[low] == id) {
+    *index = low;
+    return 1;
+  }
+  return 0;
+}
+
+struct database_stats * active_database_stats(struct database_resource * database_resource) {
+  if (!atomic_load_explicit(&database_resource->stats_enabled, memory_order_relaxed)) {
+    return NULL;
+  }
+  return atomic_load_explicit(&database_resource->stats, memory_order_acquire);
+}
+
+// Sits between Hyperscan and a scan's own callback to count matches.
+struct stats_trampoline {
+  struct database_resource * database_resource;
+  struct database_stats * stats;
+  match_event_handler on_event;
+  void * context;
+};
+
+int stats_trampoline_callback(unsigned int id, unsigned long long from, unsigned long long to, unsigned int flags, void * void_context) {
+  struct stats_trampoline * trampoline = (struct stats_trampoline *) void_context;
+  size_t index;
+
+  atomic_fetch_add_explicit(&current_stats_slot(trampoline->stats)->matches, 1, memory_order_relaxed);
+  if (trampoline->stats->pattern_matches && database_id_index(trampoline->database_resource, id, &index)) {
+    atomic_fetch_add_explicit(&trampoline->stats->pattern_matches[index], 1, memory_order_relaxed);
+  }
+
+  return trampoline->on_event(id, from, to, flags, trampoline->context);
+}
+
+// Returns the callback to hand Hyperscan, routing it through the trampoline
+// when stats are being counted.
+match_event_handler instrument_callback(struct database_resource * database_resource, struct stats_trampoline * trampoline, match_event_handler on_event, void ** context) {
+  trampoline->database_resource = database_resource;
+  trampoline->stats = active_database_stats(database_resource);
+  if (!trampoline->stats || !on_event) {
+    return on_event;
+  }
+
+  trampoline->on_event = on_event;
+  trampoline->context = *context;
+  *context = trampoline;
+  return stats_trampoline_callback;
+}
+
+// hs_scan, counting the scan when stats are enabled for the database.
+hs_error_t instrumented_scan(struct database_resource * database_resource, const char * data, unsigned int length, unsigned int flags, hs_scratch_t * scratch, match_event_handler on_event, void * context) {
+  struct stats_trampoline trampoline;
+  on_event = instrument_callback(database_resource, &trampoline, on_event, &context);
+  if (!trampoline.stats) {
+    return hs_scan(database_resource->db, data, length, flags, scratch, on_event, context);
+  }
+
+  ErlNifTime start = enif_monotonic_time(ERL_NIF_NSEC);
+  hs_error_t error = hs_scan(database_resource->db, data, length, flags, scratch, on_event, context);
+  record_scan(trampoline.stats, length, enif_monotonic_time(ERL_NIF_NSEC) - start);
+  return error;
+}
+
+hs_error_t instrumented_scan_vector(struct database_resource * database_resource, const char * const * data, const unsigned int * length, unsigned int count, size_t size, unsigned int flags, hs_scratch_t * scratch, match_event_handler on_event, void * context) {
+  struct stats_trampoline trampoline;
+  on_event = instrument_callback(database_resource, &trampoline, on_event, &context);
+  if (!trampoline.stats) {
+    return hs_scan_vector(database_resource->db, data, length, count, flags, scratch, on_event, context);
+  }
+
+  ErlNifTime start = enif_monotonic_time(ERL_NIF_NSEC);
+  hs_error_t error = hs_scan_vector(database_resource->db, data, length, count, flags, scratch, on_event, context);
+  record_scan(trampoline.stats, size, enif_monotonic_time(ERL_NIF_NSEC) - start);
+  return error;
+}
+
+hs_error_t instrumented_scan_stream(struct database_resource * database_resource, hs_stream_t * stream, const char * data, unsigned int length, unsigned int flags, hs_scratch_t * scratch, match_event_handler on_event, void * context) {
+  struct stats_trampoline trampoline;
+  on_event = instrument_callback(database_resource, &trampoline, on_event, &context);
+  if (!trampoline.stats) {
+    return hs_scan_stream(stream, data, length, flags, scratch, on_event, context);
+  }
+
+  ErlNifTime start = enif_monotonic_time(ERL_NIF_NSEC);
+  hs_error_t error = hs_scan_stream(stream, data, length, flags, scratch, on_event, context);
+  record_scan(trampoline.stats, length, enif_monotonic_time(ERL_NIF_NSEC) - start);
+  return error;
+}
+
+//******************************************************************************
+// id_set
+//******************************************************************************
+
+// A set of expression IDs. When the database's IDs are known it is a bitset
+// with one bit per ID. Otherwise it is an open-addressed hash table that
+// stores id + 1 so that zero marks an empty slot.
+struct id_set {
+  const struct database_resource * database_resource;
+  uint64_t * words;
+  size_t capacity;
+  size_t count;
+};
+
+void init_id_set(struct id_set * set, const struct database_resource * maybe_database_resource) {
+  set->count = 0;
+
+  if (maybe_database_resource && maybe_database_resource->ids) {
+    set->database_resource = maybe_database_resource;
+    set->capacity = (maybe_database_resource->num_ids + 63) / 64;
+  } else {
+    set->database_resource = NULL;
+    set->capacity = 16;
+  }
+
+  set->words = calloc(set->capacity, sizeof(* set->words));
+}
+
+void free_id_set(struct id_set * set) {
+  free(set->words);
+  set->words = NULL;
+}
+
+uint64_t * id_set_slot(uint64_t * words, size_t capacity, unsigned int id) {
+  size_t i = ((uint64_t) id * 0x9E3779B97F4A7C15ull) >> 32;
+  for (;;) {
+    i &= capacity - 1;
+    if (words[i] == 0 || words[i] == (uint64_t) id + 1) {
+      return &words[i];
+    }
+    i++;
+  }
+}
+
+int id_set_contains(struct id_set * set, unsigned int id) {
+  if (set->database_resource) {
+    size_t index;
+    return database_id_index(set->database_resource, id, &index)
+        && (set->words[index / 64] & (1ull << (index % 64)));
+  }
+
+  return *id_set_slot(set->words, set->capacity, id) != 0;
+}
+
+// Returns 1 if the ID was added, or 0 if it was already present.
+int id_set_insert(struct id_set * set, unsigned int id) {
+  if (set->database_resource) {
+    size_t index;
+    if (!database_id_index(set->database_resource, id, &index)) {
+      // Not one of the database's IDs. Should not happen.
+      return 1;
+    }
+    uint64_t bit = 1ull << (index % 64);
+    if (set->words[index / 64] & bit) {
+      return 0;
+    }
+    set->words[index / 64] |= bit;
+    set->count++;
+    return 1;
+  }
+
+  uint64_t * slot = id_set_slot(set->words, set->capacity, id);
+  if (*slot) {
+    return 0;
+  }
+  *slot = (uint64_t) id + 1;
+  set->count++;
+
+  // Keep the load factor at or below one half.
+  if (set->count * 2 > set->capacity) {
+    size_t capacity = set->capacity * 2;
+    uint64_t * words = calloc(capacity, sizeof(* words));
+    for (size_t i = 0; i < set->capacity; i++) {
+      if (set->words[i]) {
+        *id_set_slot(words, capacity, set->words[i] - 1) = set->words[i];
+      }
+    }
+    free(set->words);
+    set->words = words;
+    set->capacity = capacity;
+  }
+  return 1;
+}
+
+//******************************************************************************
+// serialized_resource
+//******************************************************************************
+
+// Owns the buffer from hs_serialize_database, so that it can back a binary
+// without being copied.
+struct serialized_resource {
+  char * data;
+};
+
+ErlNifResourceType * serialized_resource_type;
+
+void free_serialized_resource(ErlNifEnv * env, void * obj) {
+  struct serialized_resource * serialized_resource = (struct serialized_resource *) obj;
+  misc_free(serialized_resource->data);
+  serialized_resource->data = NULL;
+}
+
+int open_serialized_resource_type(ErlNifEnv * env) {
+  ErlNifResourceFlags tried;
+  serialized_resource_type = enif_open_resource_type(env, NULL, "serialized", free_serialized_resource, ERL_NIF_RT_CREATE, &tried);
+  return serialized_resource_type != NULL;
+}
+
+ERL_NIF_TERM make_serialized_binary(ErlNifEnv * env, char * data, size_t size) {
+  struct serialized_resource * serialized_resource = enif_alloc_resource(serialized_resource_type, sizeof(struct serialized_resource));
+  serialized_resource->data = data;
+  ERL_NIF_TERM result = enif_make_resource_binary(env, serialized_resource, data, size);
+  enif_release_resource(serialized_resource);
+  return result;
+}
+
 //******************************************************************************
 // scratch_resource
 //******************************************************************************
@@ -173,7 +955,9 @@ int open_scratch_resource_type(ErlNifEnv * env) {
 ERL_NIF_TERM make_scratch_resource(ErlNifEnv * env, hs_scratch_t * scratch) {
   struct scratch_resource * scratch_resource = enif_alloc_resource(scratch_resource_type, sizeof(struct scratch_resource));
   scratch_resource->scratch = scratch;
-  return enif_make_resource(env, scratch_resource);
+  ERL_NIF_TERM result = enif_make_resource(env, scratch_resource);
+  enif_release_resource(scratch_resource);
+  return result;
 }
 
 int get_scratch_resource(ErlNifEnv * env, ERL_NIF_TERM arg, hs_scratch_t ** scratch) {
@@ -185,662 +969,4029 @@ int get_scratch_resource(ErlNifEnv * env, ERL_NIF_TERM arg, hs_scratch_t ** scra
   return 1;
 }
 
+int maybe_get_scratch_resource(ErlNifEnv * env, ERL_NIF_TERM arg, hs_scratch_t ** scratch) {
+  if (arg == nil_atom) {
+    *scratch = NULL;
+    return 1;
+  }
+
+  return get_scratch_resource(env, arg, scratch);
+}
+
 //******************************************************************************
-// NIFs
+// scratch_pool_resource
 //******************************************************************************
 
-static ERL_NIF_TERM populate_platform_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
-  if (argc != 0) {
-    return enif_make_badarg(env);
+// Scratches for one database that any number of processes can scan with at
+// once. A scan borrows a scratch from the free list, allocating a new one if
+// the list is empty, and returns it afterwards. The pool therefore grows to
+// the peak number of concurrent scans and no further.
+struct scratch_pool_resource {
+  struct database_resource * database_resource;
+  ErlNifMutex * mutex;
+  hs_scratch_t ** scratches;
+  unsigned int num_free;
+  unsigned int capacity;
+};
+
+ErlNifResourceType * scratch_pool_resource_type;
+
+void free_scratch_pool_resource(ErlNifEnv * env, void * obj) {
+  struct scratch_pool_resource * scratch_pool_resource = (struct scratch_pool_resource *) obj;
+  for (unsigned int i = 0; i < scratch_pool_resource->num_free; i++) {
+    hs_free_scratch(scratch_pool_resource->scratches[i]);
   }
+  free(scratch_pool_resource->scratches);
+  scratch_pool_resource->scratches = NULL;
+  enif_mutex_destroy(scratch_pool_resource->mutex);
+  enif_release_resource(scratch_pool_resource->database_resource);
+}
 
-  hs_platform_info_t * platform_info = malloc(sizeof(hs_platform_info_t));
+int open_scratch_pool_resource_type(ErlNifEnv * env) {
+  ErlNifResourceFlags tried;
+  scratch_pool_resource_type = enif_open_resource_type(env, NULL, "scratch_pool", free_scratch_pool_resource, ERL_NIF_RT_CREATE, &tried);
+  return scratch_pool_resource_type != NULL;
+}
+
+hs_error_t scratch_pool_take(struct scratch_pool_resource * pool, hs_scratch_t ** scratch) {
+  enif_mutex_lock(pool->mutex);
+  if (pool->num_free > 0) {
+    *scratch = pool->scratches[--pool->num_free];
+    enif_mutex_unlock(pool->mutex);
+    return HS_SUCCESS;
+  }
+  enif_mutex_unlock(pool->mutex);
+
+  *scratch = NULL;
+  return hs_alloc_scratch(pool->database_resource->db, scratch);
+}
+
+void scratch_pool_give(struct scratch_pool_resource * pool, hs_scratch_t * scratch) {
+  enif_mutex_lock(pool->mutex);
+  if (pool->num_free == pool->capacity) {
+    pool->capacity = pool->capacity ? pool->capacity * 2 : 8;
+    pool->scratches = realloc(pool->scratches, pool->capacity * sizeof(* pool->scratches));
+  }
+  pool->scratches[pool->num_free++] = scratch;
+  enif_mutex_unlock(pool->mutex);
+}
+
+// Returns a pool holding `scratch`, with one reference owned by the caller.
+struct scratch_pool_resource * alloc_scratch_pool_resource(struct database_resource * database_resource, hs_scratch_t * scratch) {
+  struct scratch_pool_resource * scratch_pool_resource = enif_alloc_resource(scratch_pool_resource_type, sizeof(struct scratch_pool_resource));
+  scratch_pool_resource->database_resource = database_resource;
+  enif_keep_resource(database_resource);
+  scratch_pool_resource->mutex = enif_mutex_create("hyperscan_scratch_pool");
+  scratch_pool_resource->scratches = NULL;
+  scratch_pool_resource->num_free = 0;
+  scratch_pool_resource->capacity = 0;
+  scratch_pool_give(scratch_pool_resource, scratch);
+  return scratch_pool_resource;
+}
+
+ERL_NIF_TERM make_scratch_pool_resource(ErlNifEnv * env, struct database_resource * database_resource, hs_scratch_t * scratch) {
+  struct scratch_pool_resource * scratch_pool_resource = alloc_scratch_pool_resource(database_resource, scratch);
+  ERL_NIF_TERM result = enif_make_resource(env, scratch_pool_resource);
+  enif_release_resource(scratch_pool_resource);
+  return result;
+}
+
+// What scanning NIFs accept as a scratch: a scratch, or a pool to borrow one
+// from for the duration of the scan.
+struct scratch_arg {
+  hs_scratch_t * scratch;
+  struct scratch_pool_resource * pool;
+};
+
+int get_scratch_arg(ErlNifEnv * env, ERL_NIF_TERM arg, struct scratch_arg * scratch_arg) {
+  scratch_arg->scratch = NULL;
+  scratch_arg->pool = NULL;
+  return get_scratch_resource(env, arg, &scratch_arg->scratch)
+      || enif_get_resource(env, arg, scratch_pool_resource_type, (void **) &scratch_arg->pool);
+}
+
+int maybe_get_scratch_arg(ErlNifEnv * env, ERL_NIF_TERM arg, struct scratch_arg * scratch_arg) {
+  if (arg == nil_atom) {
+    scratch_arg->scratch = NULL;
+    scratch_arg->pool = NULL;
+    return 1;
+  }
+
+  return get_scratch_arg(env, arg, scratch_arg);
+}
+
+// Every successful acquire_scratch must be paired with release_scratch.
+hs_error_t acquire_scratch(struct scratch_arg * scratch_arg, hs_scratch_t ** scratch) {
+  if (scratch_arg->pool) {
+    return scratch_pool_take(scratch_arg->pool, scratch);
+  }
+
+  *scratch = scratch_arg->scratch;
+  return HS_SUCCESS;
+}
+
+void release_scratch(struct scratch_arg * scratch_arg, hs_scratch_t * scratch) {
+  if (scratch_arg->pool) {
+    scratch_pool_give(scratch_arg->pool, scratch);
+  }
+}
+
+//******************************************************************************
+// ruleset_resource
+//******************************************************************************
+
+// A database that can be replaced while in use. Each database swapped in is
+// a new generation with its own scratch pool, so a scan never pairs the
+// database of one generation with scratch sized for another. Scans pin a
+// generation by holding the terms for its database and pool, which stay
+// alive until the last scan using them lets go.
+struct ruleset_resource {
+  ErlNifRWLock * lock;
+  // The current generation's pool, which holds its database.
+  struct scratch_pool_resource * pool;
+  unsigned long generation;
+};
+
+ErlNifResourceType * ruleset_resource_type;
+
+void free_ruleset_resource(ErlNifEnv * env, void * obj) {
+  struct ruleset_resource * ruleset_resource = (struct ruleset_resource *) obj;
+  enif_release_resource(ruleset_resource->pool);
+  ruleset_resource->pool = NULL;
+  enif_rwlock_destroy(ruleset_resource->lock);
+}
+
+int open_ruleset_resource_type(ErlNifEnv * env) {
+  ErlNifResourceFlags tried;
+  ruleset_resource_type = enif_open_resource_type(env, NULL, "ruleset", free_ruleset_resource, ERL_NIF_RT_CREATE, &tried);
+  return ruleset_resource_type != NULL;
+}
+
+int get_ruleset_resource(ErlNifEnv * env, ERL_NIF_TERM arg, struct ruleset_resource ** ruleset_resource) {
+  return enif_get_resource(env, arg, ruleset_resource_type, (void **) ruleset_resource);
+}
+
+// Allocates the first scratch for a new generation's pool up front, so that
+// a database that cannot be scanned is never swapped in.
+hs_error_t alloc_generation_pool(struct database_resource * database_resource, struct scratch_pool_resource ** pool) {
+  hs_scratch_t * scratch = NULL;
+  hs_error_t error = hs_alloc_scratch(database_resource->db, &scratch);
+  if (error == HS_SUCCESS) {
+    *pool = alloc_scratch_pool_resource(database_resource, scratch);
+  }
+  return error;
+}
+
+//******************************************************************************
+// stream_resource
+//******************************************************************************
+
+struct stream_resource {
+  hs_stream_t * stream;
+  // Keeps the database alive for as long as the stream refers to it.
+  struct database_resource * database_resource;
+  // Set while a NIF is operating on the stream. Streams are not thread safe.
+  atomic_flag in_use;
+};
+
+ErlNifResourceType * stream_resource_type;
+
+void free_stream_resource(ErlNifEnv * env, void * obj) {
+  struct stream_resource * stream_resource = (struct stream_resource *) obj;
+  if (stream_resource->stream) {
+    hs_close_stream(stream_resource->stream, NULL, NULL, NULL);
+    stream_resource->stream = NULL;
+  }
+  enif_release_resource(stream_resource->database_resource);
+  stream_resource->database_resource = NULL;
+}
+
+int open_stream_resource_type(ErlNifEnv * env) {
+  ErlNifResourceFlags tried;
+  stream_resource_type = enif_open_resource_type(env, NULL, "stream", free_stream_resource, ERL_NIF_RT_CREATE, &tried);
+  return stream_resource_type != NULL;
+}
+
+ERL_NIF_TERM make_stream_resource(ErlNifEnv * env, hs_stream_t * stream, struct database_resource * database_resource) {
+  struct stream_resource * stream_resource = enif_alloc_resource(stream_resource_type, sizeof(struct stream_resource));
+  stream_resource->stream = stream;
+  stream_resource->database_resource = database_resource;
+  enif_keep_resource(database_resource);
+  atomic_flag_clear(&stream_resource->in_use);
+  ERL_NIF_TERM result = enif_make_resource(env, stream_resource);
+  enif_release_resource(stream_resource);
+  return result;
+}
+
+int get_stream_resource(ErlNifEnv * env, ERL_NIF_TERM arg, struct stream_resource ** stream_resource) {
+  return enif_get_resource(env, arg, stream_resource_type, (void **) stream_resource);
+}
+
+// Claims the stream for the calling NIF. Returns 0 if another NIF holds it.
+int lock_stream_resource(struct stream_resource * stream_resource) {
+  return !atomic_flag_test_and_set(&stream_resource->in_use);
+}
+
+void unlock_stream_resource(struct stream_resource * stream_resource) {
+  atomic_flag_clear(&stream_resource->in_use);
+}
+
+//******************************************************************************
+// workers
+//******************************************************************************
+
+// Native threads shared by all NIFs for work that runs off the schedulers.
+// They are started on first use, one per online CPU, and stopped at unload.
+
+struct worker_task {
+  void (* run)(void * arg, unsigned int worker);
+  void * arg;
+  struct worker_task * next;
+};
+
+struct workers {
+  ErlNifMutex * mutex;
+  ErlNifCond * cond;
+  ErlNifTid * threads;
+  unsigned int num_threads;
+  struct worker_task * head;
+  struct worker_task * tail;
+  int stopping;
+};
+
+struct workers workers;
+
+struct worker_start {
+  unsigned int index;
+};
+
+void * worker_main(void * arg) {
+  unsigned int index = ((struct worker_start *) arg)->index;
+  free(arg);
+
+  for (;;) {
+    enif_mutex_lock(workers.mutex);
+    while (!workers.head && !workers.stopping) {
+      enif_cond_wait(workers.cond, workers.mutex);
+    }
+    struct worker_task * task = workers.head;
+    if (!task) {
+      enif_mutex_unlock(workers.mutex);
+      return NULL;
+    }
+    workers.head = task->next;
+    if (!workers.head) {
+      workers.tail = NULL;
+    }
+    enif_mutex_unlock(workers.mutex);
+
+    task->run(task->arg, index);
+    free(task);
+  }
+}
+
+int init_workers(void) {
+  workers.mutex = enif_mutex_create("hyperscan_workers");
+  workers.cond = enif_cond_create("hyperscan_workers");
+  workers.threads = NULL;
+  workers.num_threads = 0;
+  workers.head = NULL;
+  workers.tail = NULL;
+  workers.stopping = 0;
+  return workers.mutex != NULL && workers.cond != NULL;
+}
+
+// Returns the number of worker threads, starting them if needed, or 0 if
+// none could be started.
+unsigned int start_workers(void) {
+  enif_mutex_lock(workers.mutex);
+
+  if (workers.num_threads == 0) {
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int num_threads = num_cpus > 0 ? num_cpus : 1;
+    workers.threads = calloc(num_threads, sizeof(* workers.threads));
+
+    for (unsigned int i = 0; i < num_threads; i++) {
+      struct worker_start * start = malloc(sizeof(* start));
+      start->index = i;
+      if (enif_thread_create("hyperscan_worker", &workers.threads[i], worker_main, start, NULL) != 0) {
+        free(start);
+        break;
+      }
+      workers.num_threads++;
+    }
+  }
+
+  unsigned int num_threads = workers.num_threads;
+  enif_mutex_unlock(workers.mutex);
+  return num_threads;
+}
+
+void stop_workers(void) {
+  enif_mutex_lock(workers.mutex);
+  workers.stopping = 1;
+  enif_cond_broadcast(workers.cond);
+  enif_mutex_unlock(workers.mutex);
+
+  for (unsigned int i = 0; i < workers.num_threads; i++) {
+    enif_thread_join(workers.threads[i], NULL);
+  }
+
+  free(workers.threads);
+  enif_cond_destroy(workers.cond);
+  enif_mutex_destroy(workers.mutex);
+}
+
+void submit_worker_task(void (* run)(void * arg, unsigned int worker), void * arg) {
+  struct worker_task * task = malloc(sizeof(* task));
+  task->run = run;
+  task->arg = arg;
+  task->next = NULL;
+
+  enif_mutex_lock(workers.mutex);
+  if (workers.tail) {
+    workers.tail->next = task;
+  } else {
+    workers.head = task;
+  }
+  workers.tail = task;
+  enif_cond_signal(workers.cond);
+  enif_mutex_unlock(workers.mutex);
+}
+
+//******************************************************************************
+// batch_pool_resource
+//******************************************************************************
+
+// A database plus one scratch per worker thread, for parallel batch scans.
+struct batch_pool_resource {
+  struct database_resource * database_resource;
+  hs_scratch_t ** scratches;
+  unsigned int num_scratches;
+};
+
+ErlNifResourceType * batch_pool_resource_type;
+
+// May run on a worker thread when the last job holding the pool finishes.
+void free_batch_pool_resource(ErlNifEnv * env, void * obj) {
+  struct batch_pool_resource * batch_pool_resource = (struct batch_pool_resource *) obj;
+  for (unsigned int i = 0; i < batch_pool_resource->num_scratches; i++) {
+    hs_free_scratch(batch_pool_resource->scratches[i]);
+  }
+  free(batch_pool_resource->scratches);
+  batch_pool_resource->scratches = NULL;
+  enif_release_resource(batch_pool_resource->database_resource);
+  batch_pool_resource->database_resource = NULL;
+}
+
+int open_batch_pool_resource_type(ErlNifEnv * env) {
+  ErlNifResourceFlags tried;
+  batch_pool_resource_type = enif_open_resource_type(env, NULL, "batch_pool", free_batch_pool_resource, ERL_NIF_RT_CREATE, &tried);
+  return batch_pool_resource_type != NULL;
+}
+
+int get_batch_pool_resource(ErlNifEnv * env, ERL_NIF_TERM arg, struct batch_pool_resource ** batch_pool_resource) {
+  return enif_get_resource(env, arg, batch_pool_resource_type, (void **) batch_pool_resource);
+}
+
+//******************************************************************************
+// sharded_database_resource
+//******************************************************************************
+
+// A rule set split into shards that are compiled in parallel and scanned
+// together. Expressions go to a shard by ID, so editing
+// a rule changes the fingerprint of its shard alone, and a recompile leaves
+// every other shard's database in place.
+struct shard {
+  // NULL while no expression maps to the shard.
+  struct database_resource * database_resource;
+  uint64_t fingerprint;
+};
+
+struct sharded_scratch {
+  hs_scratch_t * scratch;
+  // The generation whose shards the scratch was last grown for.
+  unsigned long generation;
+};
+
+struct sharded_database_resource {
+  ErlNifRWLock * lock;
+  struct shard * shards;
+  unsigned int num_shards;
+  unsigned int mode;
+  // Bumped whenever a shard is replaced.
+  unsigned long generation;
+  // Held for the whole of a recompile, so that two recompiles never diff
+  // against the same fingerprints.
+  ErlNifMutex * update_mutex;
+  // Idle scratches. Each one is grown over every shard of its generation,
+  // which makes it big enough for the largest.
+  ErlNifMutex * scratch_mutex;
+  struct sharded_scratch * scratches;
+  unsigned int num_scratches;
+  unsigned int scratch_capacity;
+};
+
+ErlNifResourceType * sharded_database_resource_type;
+
+void free_sharded_database_resource(ErlNifEnv * env, void * obj) {
+  struct sharded_database_resource * sharded_database_resource = (struct sharded_database_resource *) obj;
+  for (unsigned int i = 0; i < sharded_database_resource->num_shards; i++) {
+    if (sharded_database_resource->shards[i].database_resource) {
+      enif_release_resource(sharded_database_resource->shards[i].database_resource);
+    }
+  }
+  free(sharded_database_resource->shards);
+  sharded_database_resource->shards = NULL;
+  for (unsigned int i = 0; i < sharded_database_resource->num_scratches; i++) {
+    hs_free_scratch(sharded_database_resource->scratches[i].scratch);
+  }
+  free(sharded_database_resource->scratches);
+  sharded_database_resource->scratches = NULL;
+  enif_mutex_destroy(sharded_database_resource->scratch_mutex);
+  enif_mutex_destroy(sharded_database_resource->update_mutex);
+  enif_rwlock_destroy(sharded_database_resource->lock);
+}
+
+int open_sharded_database_resource_type(ErlNifEnv * env) {
+  ErlNifResourceFlags tried;
+  sharded_database_resource_type = enif_open_resource_type(env, NULL, "sharded_database", free_sharded_database_resource, ERL_NIF_RT_CREATE, &tried);
+  return sharded_database_resource_type != NULL;
+}
+
+int get_sharded_database_resource(ErlNifEnv * env, ERL_NIF_TERM arg, struct sharded_database_resource ** sharded_database_resource) {
+  return enif_get_resource(env, arg, sharded_database_resource_type, (void **) sharded_database_resource);
+}
+
+// Multiplicative hashing, so that runs of consecutive IDs spread evenly.
+unsigned int shard_of(unsigned int id, unsigned int num_shards) {
+  uint32_t hash = (uint32_t) id * 2654435761u;
+  return (unsigned int) (((uint64_t) hash * num_shards) >> 32);
+}
+
+#define FINGERPRINT_BASIS 14695981039346656037ULL
+#define FINGERPRINT_PRIME 1099511628211ULL
+
+// FNV-1a, which is plenty to tell whether a shard's rules changed.
+uint64_t fingerprint_update(uint64_t fingerprint, const void * data, size_t length) {
+  const unsigned char * bytes = (const unsigned char *) data;
+  for (size_t i = 0; i < length; i++) {
+    fingerprint = (fingerprint ^ bytes[i]) * FINGERPRINT_PRIME;
+  }
+  return fingerprint;
+}
+
+// The shard databases of one generation, each kept until unpinned.
+struct shard_pin {
+  struct database_resource ** databases;
+  unsigned int num_databases;
+  unsigned long generation;
+};
+
+void pin_shards(struct sharded_database_resource * sharded_database_resource, struct shard_pin * pin) {
+  pin->databases = malloc(sharded_database_resource->num_shards * sizeof(* pin->databases));
+  pin->num_databases = 0;
+
+  enif_rwlock_rlock(sharded_database_resource->lock);
+  for (unsigned int i = 0; i < sharded_database_resource->num_shards; i++) {
+    struct database_resource * database_resource = sharded_database_resource->shards[i].database_resource;
+    if (database_resource) {
+      enif_keep_resource(database_resource);
+      pin->databases[pin->num_databases++] = database_resource;
+    }
+  }
+  pin->generation = sharded_database_resource->generation;
+  enif_rwlock_runlock(sharded_database_resource->lock);
+}
+
+void unpin_shards(struct shard_pin * pin) {
+  for (unsigned int i = 0; i < pin->num_databases; i++) {
+    enif_release_resource(pin->databases[i]);
+  }
+  free(pin->databases);
+}
+
+hs_error_t acquire_sharded_scratch(struct sharded_database_resource * sharded_database_resource, struct shard_pin * pin, hs_scratch_t ** scratch) {
+  struct sharded_scratch entry = {NULL, 0};
+
+  enif_mutex_lock(sharded_database_resource->scratch_mutex);
+  if (sharded_database_resource->num_scratches > 0) {
+    entry = sharded_database_resource->scratches[--sharded_database_resource->num_scratches];
+  }
+  enif_mutex_unlock(sharded_database_resource->scratch_mutex);
+
+  // Allocating against a database only ever grows the scratch, so growing
+  // it against every shard leaves it fit for all of them.
+  if (entry.generation != pin->generation) {
+    for (unsigned int i = 0; i < pin->num_databases; i++) {
+      hs_error_t error = hs_alloc_scratch(pin->databases[i]->db, &entry.scratch);
+      if (error != HS_SUCCESS) {
+        if (entry.scratch) {
+          hs_free_scratch(entry.scratch);
+        }
+        return error;
+      }
+    }
+  }
+
+  *scratch = entry.scratch;
+  return HS_SUCCESS;
+}
+
+void release_sharded_scratch(struct sharded_database_resource * sharded_database_resource, struct shard_pin * pin, hs_scratch_t * scratch) {
+  if (!scratch) {
+    return;
+  }
+
+  enif_mutex_lock(sharded_database_resource->scratch_mutex);
+  if (sharded_database_resource->num_scratches == sharded_database_resource->scratch_capacity) {
+    sharded_database_resource->scratch_capacity = sharded_database_resource->scratch_capacity ? sharded_database_resource->scratch_capacity * 2 : 4;
+    sharded_database_resource->scratches = realloc(sharded_database_resource->scratches, sharded_database_resource->scratch_capacity * sizeof(* sharded_database_resource->scratches));
+  }
+  struct sharded_scratch * entry = &sharded_database_resource->scratches[sharded_database_resource->num_scratches++];
+  entry->scratch = scratch;
+  entry->generation = pin->generation;
+  enif_mutex_unlock(sharded_database_resource->scratch_mutex);
+}
+
+struct shard_compile {
+  unsigned int shard;
+  unsigned int mode;
+  unsigned int count;
+  const char ** expressions;
+  unsigned int * flags;
+  unsigned int * ids;
+  // Where each expression sits in the caller's list, for compile errors.
+  unsigned int * positions;
+  uint64_t fingerprint;
+  hs_database_t * db;
+  hs_error_t error;
+  char * message;
+  int expression;
+};
+
+void compile_shard(struct shard_compile * compile) {
+  hs_compile_error_t * compile_error = NULL;
+  compile->error = hs_compile_multi(compile->expressions, compile->flags, compile->ids, compile->count, compile->mode, NULL, &compile->db, &compile_error);
+
+  if (compile->error == HS_COMPILER_ERROR) {
+    compile->message = strdup(compile_error->message);
+    compile->expression = compile_error->expression >= 0 ? (int) compile->positions[compile_error->expression] : compile_error->expression;
+    hs_free_compile_error(compile_error);
+  }
+}
+
+// Shard compiles run on threads of their own rather than on the shared
+// workers, so that a long recompile never holds up batch scans queued there.
+// Each thread takes the next shard left until none remain.
+struct shard_build {
+  struct shard_compile * compiles;
+  unsigned int num_compiles;
+  atomic_uint next;
+};
+
+void * shard_build_main(void * arg) {
+  struct shard_build * build = (struct shard_build *) arg;
+  for (;;) {
+    unsigned int c = atomic_fetch_add(&build->next, 1);
+    if (c >= build->num_compiles) {
+      return NULL;
+    }
+    if (build->compiles[c].count > 0) {
+      compile_shard(&build->compiles[c]);
+    }
+  }
+}
+
+// Compiles the shards on up to one thread per online CPU, while the calling
+// NIF waits on a dirty IO scheduler. Only if no thread can be started does
+// the calling thread compile them itself.
+void build_shards(struct shard_compile * compiles, unsigned int num_compiles) {
+  struct shard_build build;
+  build.compiles = compiles;
+  build.num_compiles = num_compiles;
+  atomic_init(&build.next, 0);
+
+  unsigned int pending = 0;
+  for (unsigned int c = 0; c < num_compiles; c++) {
+    if (compiles[c].count > 0) {
+      pending++;
+    }
+  }
+
+  long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  unsigned int num_threads = num_cpus > 0 ? num_cpus : 1;
+  if (num_threads > pending) {
+    num_threads = pending;
+  }
+
+  ErlNifTid * threads = calloc(num_threads ? num_threads : 1, sizeof(* threads));
+  unsigned int started = 0;
+  while (started < num_threads &&
+         enif_thread_create("hyperscan_shard_build", &threads[started], shard_build_main, &build, NULL) == 0) {
+    started++;
+  }
+
+  if (started == 0) {
+    shard_build_main(&build);
+  }
+
+  for (unsigned int i = 0; i < started; i++) {
+    enif_thread_join(threads[i], NULL);
+  }
+  free(threads);
+}
+
+#ifdef HYPERSCAN_CHIMERA
+//******************************************************************************
+// ch_database_resource
+//******************************************************************************
+
+// Chimera databases pair Hyperscan with PCRE, for expressions that need
+// capture groups or other PCRE semantics.
+struct ch_database_resource {
+  ch_database_t * db;
+};
+
+ErlNifResourceType * ch_database_resource_type;
+
+void free_ch_database_resource(ErlNifEnv * env, void * obj) {
+  struct ch_database_resource * ch_database_resource = (struct ch_database_resource *) obj;
+  ch_free_database(ch_database_resource->db);
+  ch_database_resource->db = NULL;
+}
+
+int open_ch_database_resource_type(ErlNifEnv * env) {
+  ErlNifResourceFlags tried;
+  ch_database_resource_type = enif_open_resource_type(env, NULL, "ch_database", free_ch_database_resource, ERL_NIF_RT_CREATE, &tried);
+  return ch_database_resource_type != NULL;
+}
+
+ERL_NIF_TERM make_ch_database_resource(ErlNifEnv * env, ch_database_t * db) {
+  struct ch_database_resource * ch_database_resource = enif_alloc_resource(ch_database_resource_type, sizeof(struct ch_database_resource));
+  ch_database_resource->db = db;
+  ERL_NIF_TERM result = enif_make_resource(env, ch_database_resource);
+  enif_release_resource(ch_database_resource);
+  return result;
+}
+
+int get_ch_database_resource(ErlNifEnv * env, ERL_NIF_TERM arg, ch_database_t ** db) {
+  struct ch_database_resource * ch_database_resource;
+  if (!enif_get_resource(env, arg, ch_database_resource_type, (void **) &ch_database_resource)) {
+    return 0;
+  }
+  *db = ch_database_resource->db;
+  return 1;
+}
+
+//******************************************************************************
+// ch_scratch_resource
+//******************************************************************************
+
+struct ch_scratch_resource {
+  ch_scratch_t * scratch;
+};
+
+ErlNifResourceType * ch_scratch_resource_type;
+
+void free_ch_scratch_resource(ErlNifEnv * env, void * obj) {
+  struct ch_scratch_resource * ch_scratch_resource = (struct ch_scratch_resource *) obj;
+  ch_free_scratch(ch_scratch_resource->scratch);
+  ch_scratch_resource->scratch = NULL;
+}
+
+int open_ch_scratch_resource_type(ErlNifEnv * env) {
+  ErlNifResourceFlags tried;
+  ch_scratch_resource_type = enif_open_resource_type(env, NULL, "ch_scratch", free_ch_scratch_resource, ERL_NIF_RT_CREATE, &tried);
+  return ch_scratch_resource_type != NULL;
+}
+
+ERL_NIF_TERM make_ch_scratch_resource(ErlNifEnv * env, ch_scratch_t * scratch) {
+  struct ch_scratch_resource * ch_scratch_resource = enif_alloc_resource(ch_scratch_resource_type, sizeof(struct ch_scratch_resource));
+  ch_scratch_resource->scratch = scratch;
+  ERL_NIF_TERM result = enif_make_resource(env, ch_scratch_resource);
+  enif_release_resource(ch_scratch_resource);
+  return result;
+}
+
+int get_ch_scratch_resource(ErlNifEnv * env, ERL_NIF_TERM arg, ch_scratch_t ** scratch) {
+  struct ch_scratch_resource * ch_scratch_resource;
+  if (!enif_get_resource(env, arg, ch_scratch_resource_type, (void **) &ch_scratch_resource)) {
+    return 0;
+  }
+  *scratch = ch_scratch_resource->scratch;
+  return 1;
+}
+
+int open_ch_resource_types(ErlNifEnv * env) {
+  return open_ch_database_resource_type(env) &&
+         open_ch_scratch_resource_type(env);
+}
+#endif
+
+//******************************************************************************
+// NIFs
+//******************************************************************************
+
+static ERL_NIF_TERM populate_platform_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  if (argc != 0) {
+    return enif_make_badarg(env);
+  }
+
+  hs_platform_info_t * platform_info = malloc(sizeof(hs_platform_info_t));
   hs_error_t error = hs_populate_platform(platform_info);
   if (error != HS_SUCCESS) {
+    free(platform_info);
     return enif_make_tuple2(env, error_atom, error_name_atom(env, error));
   }
-  ERL_NIF_TERM result = make_platform_info_resource(env, platform_info);
-  return enif_make_tuple2(env, ok_atom, result);
+  ERL_NIF_TERM result = make_platform_info_resource(env, platform_info);
+  return enif_make_tuple2(env, ok_atom, result);
+}
+
+static ERL_NIF_TERM platform_info_to_map_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  hs_platform_info_t * platform_info;
+
+  if (argc != 1 ||
+      !get_platform_info_resource(env, argv[0], &platform_info)) {
+    return enif_make_badarg(env);
+  }
+
+  ERL_NIF_TERM keys[4] = {
+    enif_make_atom(env, "tune"),
+    enif_make_atom(env, "cpu_features"),
+    enif_make_atom(env, "reserved1"),
+    enif_make_atom(env, "reserved2")
+  };
+
+  ERL_NIF_TERM values[4] = {
+    enif_make_int(env, platform_info->tune),
+    enif_make_int64(env, platform_info->cpu_features),
+    enif_make_int64(env, platform_info->reserved1),
+    enif_make_int64(env, platform_info->reserved2)
+  };
+
+  ERL_NIF_TERM result;
+
+  if (!enif_make_map_from_arrays(env, keys, values, 4, &result)) {
+    return enif_make_badarg(env);
+  }
+
+  return result;
+}
+
+// Builds a platform to compile for, which need not be the current host's.
+static ERL_NIF_TERM make_platform_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  unsigned int tune;
+  ErlNifUInt64 cpu_features;
+
+  if (argc != 2 ||
+      !enif_get_uint(env, argv[0], &tune) ||
+      !enif_get_uint64(env, argv[1], &cpu_features)) {
+    return enif_make_badarg(env);
+  }
+
+  hs_platform_info_t * platform_info = calloc(1, sizeof(hs_platform_info_t));
+  platform_info->tune = tune;
+  platform_info->cpu_features = cpu_features;
+  ERL_NIF_TERM result = make_platform_info_resource(env, platform_info);
+  return enif_make_tuple2(env, ok_atom, result);
+}
+
+static ERL_NIF_TERM valid_platform_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  if (argc != 0) {
+    return enif_make_badarg(env);
+  }
+
+  hs_error_t error = hs_valid_platform();
+
+  switch (error) {
+  case HS_SUCCESS:
+    return enif_make_tuple2(env, ok_atom, true_atom);
+
+  case HS_ARCH_ERROR:
+    return enif_make_tuple2(env, ok_atom, false_atom);
+
+  default:
+    return enif_make_tuple2(env, error_atom, error_name_atom(env, error));
+  }
+}
+
+static ERL_NIF_TERM version_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  if (argc != 0) {
+    return enif_make_badarg(env);
+  }
+
+  const char * version = hs_version();
+  return make_binary_const(env, version);
+}
+
+static ERL_NIF_TERM dirty_scan_threshold_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  if (argc != 0) {
+    return enif_make_badarg(env);
+  }
+
+  return enif_make_uint64(env, atomic_load(&dirty_scan_threshold));
+}
+
+static ERL_NIF_TERM set_dirty_scan_threshold_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  ErlNifUInt64 threshold;
+
+  if (argc != 1 ||
+      !enif_get_uint64(env, argv[0], &threshold)) {
+    return enif_make_badarg(env);
+  }
+
+  atomic_store(&dirty_scan_threshold, threshold);
+  return ok_atom;
+}
+
+static ERL_NIF_TERM memory_stats_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  if (argc != 0) {
+    return enif_make_badarg(env);
+  }
+
+  const char * names[NUM_MEMORY_CATEGORIES] = {"database", "scratch", "stream", "misc"};
+  ERL_NIF_TERM keys[NUM_MEMORY_CATEGORIES];
+  ERL_NIF_TERM values[NUM_MEMORY_CATEGORIES];
+  ERL_NIF_TERM counter_keys[2] = {
+    enif_make_atom(env, "bytes"),
+    enif_make_atom(env, "count"),
+  };
+
+  for (int i = 0; i < NUM_MEMORY_CATEGORIES; i++) {
+    ERL_NIF_TERM counter_values[2] = {
+      enif_make_uint64(env, atomic_load(&memory_counters[i].bytes)),
+      enif_make_uint64(env, atomic_load(&memory_counters[i].count)),
+    };
+    keys[i] = enif_make_atom(env, names[i]);
+    enif_make_map_from_arrays(env, counter_keys, counter_values, 2, &values[i]);
+  }
+
+  ERL_NIF_TERM result;
+  enif_make_map_from_arrays(env, keys, values, NUM_MEMORY_CATEGORIES, &result);
+  return result;
+}
+
+int bin_equals_string(ErlNifBinary name_bin, const char * string) {
+  return (strlen(string) == name_bin.size)
+      && (0 == memcmp(string, name_bin.data, name_bin.size));
+}
+
+static ERL_NIF_TERM flag_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  ErlNifBinary name_bin;
+
+  if (argc != 1 ||
+      !enif_inspect_binary(env, argv[0], &name_bin)) {
+    return enif_make_badarg(env);
+  }
+
+  if (bin_equals_string(name_bin, "HS_FLAG_CASELESS")) return enif_make_int(env, HS_FLAG_CASELESS);
+  if (bin_equals_string(name_bin, "HS_FLAG_DOTALL")) return enif_make_int(env, HS_FLAG_DOTALL);
+  if (bin_equals_string(name_bin, "HS_FLAG_MULTILINE")) return enif_make_int(env, HS_FLAG_MULTILINE);
+  if (bin_equals_string(name_bin, "HS_FLAG_SINGLEMATCH")) return enif_make_int(env, HS_FLAG_SINGLEMATCH);
+  if (bin_equals_string(name_bin, "HS_FLAG_ALLOWEMPTY")) return enif_make_int(env, HS_FLAG_ALLOWEMPTY);
+  if (bin_equals_string(name_bin, "HS_FLAG_UTF8")) return enif_make_int(env, HS_FLAG_UTF8);
+  if (bin_equals_string(name_bin, "HS_FLAG_UCP")) return enif_make_int(env, HS_FLAG_UCP);
+  if (bin_equals_string(name_bin, "HS_FLAG_PREFILTER")) return enif_make_int(env, HS_FLAG_PREFILTER);
+  if (bin_equals_string(name_bin, "HS_FLAG_SOM_LEFTMOST")) return enif_make_int(env, HS_FLAG_SOM_LEFTMOST);
+  if (bin_equals_string(name_bin, "HS_FLAG_COMBINATION")) return enif_make_int(env, HS_FLAG_COMBINATION);
+  if (bin_equals_string(name_bin, "HS_FLAG_QUIET")) return enif_make_int(env, HS_FLAG_QUIET);
+#ifdef HYPERSCAN_CHIMERA
+  if (bin_equals_string(name_bin, "CH_FLAG_CASELESS")) return enif_make_int(env, CH_FLAG_CASELESS);
+  if (bin_equals_string(name_bin, "CH_FLAG_DOTALL")) return enif_make_int(env, CH_FLAG_DOTALL);
+  if (bin_equals_string(name_bin, "CH_FLAG_MULTILINE")) return enif_make_int(env, CH_FLAG_MULTILINE);
+  if (bin_equals_string(name_bin, "CH_FLAG_SINGLEMATCH")) return enif_make_int(env, CH_FLAG_SINGLEMATCH);
+  if (bin_equals_string(name_bin, "CH_FLAG_UTF8")) return enif_make_int(env, CH_FLAG_UTF8);
+  if (bin_equals_string(name_bin, "CH_FLAG_UCP")) return enif_make_int(env, CH_FLAG_UCP);
+#endif
+  return enif_make_badarg(env);
+}
+
+static ERL_NIF_TERM mode_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  ErlNifBinary name_bin;
+
+  if (argc != 1 ||
+      !enif_inspect_binary(env, argv[0], &name_bin)) {
+    return enif_make_badarg(env);
+  }
+
+  if (bin_equals_string(name_bin, "HS_MODE_BLOCK")) return enif_make_int(env, HS_MODE_BLOCK);
+  if (bin_equals_string(name_bin, "HS_MODE_NOSTREAM")) return enif_make_int(env, HS_MODE_NOSTREAM);
+  if (bin_equals_string(name_bin, "HS_MODE_STREAM")) return enif_make_int(env, HS_MODE_STREAM);
+  if (bin_equals_string(name_bin, "HS_MODE_VECTORED")) return enif_make_int(env, HS_MODE_VECTORED);
+  if (bin_equals_string(name_bin, "HS_MODE_SOM_HORIZON_LARGE")) return enif_make_int(env, HS_MODE_SOM_HORIZON_LARGE);
+  if (bin_equals_string(name_bin, "HS_MODE_SOM_HORIZON_MEDIUM")) return enif_make_int(env, HS_MODE_SOM_HORIZON_MEDIUM);
+  if (bin_equals_string(name_bin, "HS_MODE_SOM_HORIZON_SMALL")) return enif_make_int(env, HS_MODE_SOM_HORIZON_SMALL);
+#ifdef HYPERSCAN_CHIMERA
+  if (bin_equals_string(name_bin, "CH_MODE_NOGROUPS")) return enif_make_int(env, CH_MODE_NOGROUPS);
+  if (bin_equals_string(name_bin, "CH_MODE_GROUPS")) return enif_make_int(env, CH_MODE_GROUPS);
+#endif
+  return enif_make_badarg(env);
+}
+
+static ERL_NIF_TERM tune_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  ErlNifBinary name_bin;
+
+  if (argc != 1 ||
+      !enif_inspect_binary(env, argv[0], &name_bin)) {
+    return enif_make_badarg(env);
+  }
+
+  if (bin_equals_string(name_bin, "HS_TUNE_FAMILY_GENERIC")) return enif_make_int(env, HS_TUNE_FAMILY_GENERIC);
+  if (bin_equals_string(name_bin, "HS_TUNE_FAMILY_SNB")) return enif_make_int(env, HS_TUNE_FAMILY_SNB);
+  if (bin_equals_string(name_bin, "HS_TUNE_FAMILY_IVB")) return enif_make_int(env, HS_TUNE_FAMILY_IVB);
+  if (bin_equals_string(name_bin, "HS_TUNE_FAMILY_HSW")) return enif_make_int(env, HS_TUNE_FAMILY_HSW);
+  if (bin_equals_string(name_bin, "HS_TUNE_FAMILY_SLM")) return enif_make_int(env, HS_TUNE_FAMILY_SLM);
+  if (bin_equals_string(name_bin, "HS_TUNE_FAMILY_BDW")) return enif_make_int(env, HS_TUNE_FAMILY_BDW);
+  if (bin_equals_string(name_bin, "HS_TUNE_FAMILY_SKL")) return enif_make_int(env, HS_TUNE_FAMILY_SKL);
+  if (bin_equals_string(name_bin, "HS_TUNE_FAMILY_SKX")) return enif_make_int(env, HS_TUNE_FAMILY_SKX);
+  if (bin_equals_string(name_bin, "HS_TUNE_FAMILY_GLM")) return enif_make_int(env, HS_TUNE_FAMILY_GLM);
+  if (bin_equals_string(name_bin, "HS_TUNE_FAMILY_ICL")) return enif_make_int(env, HS_TUNE_FAMILY_ICL);
+  if (bin_equals_string(name_bin, "HS_TUNE_FAMILY_ICX")) return enif_make_int(env, HS_TUNE_FAMILY_ICX);
+  return enif_make_badarg(env);
+}
+
+static ERL_NIF_TERM cpu_feature_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  ErlNifBinary name_bin;
+
+  if (argc != 1 ||
+      !enif_inspect_binary(env, argv[0], &name_bin)) {
+    return enif_make_badarg(env);
+  }
+
+  if (bin_equals_string(name_bin, "HS_CPU_FEATURES_AVX2")) return enif_make_uint64(env, HS_CPU_FEATURES_AVX2);
+  if (bin_equals_string(name_bin, "HS_CPU_FEATURES_AVX512")) return enif_make_uint64(env, HS_CPU_FEATURES_AVX512);
+  if (bin_equals_string(name_bin, "HS_CPU_FEATURES_AVX512VBMI")) return enif_make_uint64(env, HS_CPU_FEATURES_AVX512VBMI);
+  return enif_make_badarg(env);
+}
+
+ERL_NIF_TERM compile_error_to_term(ErlNifEnv * env, hs_compile_error_t * compile_error) {
+  ERL_NIF_TERM message = make_binary_const(env, compile_error->message);
+  ERL_NIF_TERM expression_id = enif_make_int(env, compile_error->expression);
+  hs_error_t error = hs_free_compile_error(compile_error);
+
+  switch (error) {
+  case HS_SUCCESS:
+    break;
+
+  default:
+    printf("hs_free_compile_error failed with %s\r\n", error_name(error));
+    break;
+  }
+
+  return enif_make_tuple2(env, error_atom, enif_make_tuple2(env, message, expression_id));
+}
+
+static ERL_NIF_TERM compile_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  ErlNifBinary expression_bin;
+  unsigned int flags;
+  unsigned int mode;
+  hs_platform_info_t * maybe_platform_info;
+
+  if (argc != 4 ||
+      !enif_inspect_binary(env, argv[0], &expression_bin) ||
+      !enif_get_uint(env, argv[1], &flags) ||
+      !enif_get_uint(env, argv[2], &mode) ||
+      !maybe_get_platform_info_resource(env, argv[3], &maybe_platform_info)) {
+    return enif_make_badarg(env);
+  }
+
+  // Expression must be null terminated.
+  char * expression = malloc(expression_bin.size + 1);
+  memcpy(expression, expression_bin.data, expression_bin.size);
+  expression[expression_bin.size] = 0;
+
+  // printf("expression: %s\r\n", expression);
+  // printf("flags: %i\r\n", flags);
+  // printf("mode: %i\r\n", mode);
+  // printf("platform_info: %p\r\n", platform_info);
+
+  hs_database_t * db;
+  hs_compile_error_t * compile_error;
+  hs_error_t error = hs_compile(expression, flags, mode, maybe_platform_info, &db, &compile_error);
+  free(expression);
+
+  // hs_compile reports every match with ID zero.
+  unsigned int id = 0;
+
+  switch (error) {
+  case HS_SUCCESS:
+    return enif_make_tuple2(env, ok_atom, make_database_resource(env, db, &id, 1));
+
+  case HS_COMPILER_ERROR:
+    return compile_error_to_term(env, compile_error);
+
+  default:
+    return enif_make_tuple2(env, error_atom, error_name_atom(env, error));
+  }
+}
+
+static ERL_NIF_TERM compile_multi_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  ERL_NIF_TERM result;
+
+  unsigned int num_expressions;
+  unsigned int num_flags;
+  unsigned int num_ids;
+  unsigned int mode;
+  hs_platform_info_t * maybe_platform_info;
+
+  if (argc != 5 ||
+      !enif_get_list_length(env, argv[0], &num_expressions) ||
+      !enif_get_list_length(env, argv[1], &num_flags) ||
+      !enif_get_list_length(env, argv[2], &num_ids) ||
+      num_expressions != num_flags ||
+      num_expressions != num_ids ||
+      !enif_get_uint(env, argv[3], &mode) ||
+      !maybe_get_platform_info_resource(env, argv[4], &maybe_platform_info)) {
+    result = enif_make_badarg(env);
+    goto compile_multi_nif_return;
+  }
+
+  ErlNifBinary expression_bin;
+  char ** expression_array = calloc(num_expressions, sizeof(* expression_array));
+  unsigned int * flags_array = calloc(num_flags, sizeof(* flags_array));
+  unsigned int * id_array = calloc(num_ids, sizeof(* id_array));
+
+  ERL_NIF_TERM expression_head, expression_tail = argv[0];
+  ERL_NIF_TERM flags_head, flags_tail = argv[1];
+  ERL_NIF_TERM ids_head, ids_tail = argv[2];
+
+  for (int i = 0; i < num_expressions; i++) {
+    if (!enif_get_list_cell(env, expression_tail, &expression_head, &expression_tail) ||
+        !enif_get_list_cell(env, flags_tail, &flags_head, &flags_tail) ||
+        !enif_get_list_cell(env, ids_tail, &ids_head, &ids_tail) ||
+        !enif_inspect_binary(env, expression_head, &expression_bin) ||
+        !enif_get_uint(env, flags_head, &flags_array[i]) ||
+        !enif_get_uint(env, ids_head, &id_array[i])) {
+      result = enif_make_badarg(env);
+      goto compile_multi_nif_free_and_return;
+    }
+    expression_array[i] = null_terminate(expression_bin);
+  }
+
+  // Sanity check.
+  if (!enif_is_empty_list(env, expression_tail) ||
+      !enif_is_empty_list(env, flags_tail) ||
+      !enif_is_empty_list(env, ids_tail)) {
+    result = enif_make_badarg(env);
+    goto compile_multi_nif_free_and_return;
+  }
+
+  hs_database_t * db;
+  hs_compile_error_t * compile_error;
+  hs_error_t error = hs_compile_multi((const char *const *) expression_array, flags_array, id_array, num_expressions, mode, maybe_platform_info, &db, &compile_error);
+
+  switch (error) {
+  case HS_SUCCESS:
+    result = enif_make_tuple2(env, ok_atom, make_database_resource(env, db, id_array, num_ids));
+    break;
+
+  case HS_COMPILER_ERROR:
+    result = compile_error_to_term(env, compile_error);
+    break;
+
+  default:
+    result = enif_make_tuple2(env, error_atom, error_name_atom(env, error));
+    break;
+  }
+
+compile_multi_nif_free_and_return:
+  for (int i = 0; i < num_expressions; i++) {
+    if (expression_array[i])
+      free(expression_array[i]);
+  }
+  free(expression_array);
+  free(flags_array);
+  free(id_array);
+
+compile_multi_nif_return:
+  return result;
+}
+
+// Reads a map of extended parameters, such as %{max_offset: 4096}, setting
+// the matching HS_EXT_FLAG_* for each key present.
+int get_expr_ext(ErlNifEnv * env, ERL_NIF_TERM map, hs_expr_ext_t * ext) {
+  memset(ext, 0, sizeof(* ext));
+
+  if (!enif_is_map(env, map)) {
+    return 0;
+  }
+
+  int ok = 1;
+  ErlNifMapIterator iter;
+  ERL_NIF_TERM key, value;
+  ErlNifUInt64 uint64;
+  unsigned int uint;
+
+  enif_map_iterator_create(env, map, &iter, ERL_NIF_MAP_ITERATOR_FIRST);
+  while (ok && enif_map_iterator_get_pair(env, &iter, &key, &value)) {
+    if (key == min_offset_atom && enif_get_uint64(env, value, &uint64)) {
+      ext->flags |= HS_EXT_FLAG_MIN_OFFSET;
+      ext->min_offset = uint64;
+    } else if (key == max_offset_atom && enif_get_uint64(env, value, &uint64)) {
+      ext->flags |= HS_EXT_FLAG_MAX_OFFSET;
+      ext->max_offset = uint64;
+    } else if (key == min_length_atom && enif_get_uint64(env, value, &uint64)) {
+      ext->flags |= HS_EXT_FLAG_MIN_LENGTH;
+      ext->min_length = uint64;
+    } else if (key == edit_distance_atom && enif_get_uint(env, value, &uint)) {
+      ext->flags |= HS_EXT_FLAG_EDIT_DISTANCE;
+      ext->edit_distance = uint;
+    } else if (key == hamming_distance_atom && enif_get_uint(env, value, &uint)) {
+      ext->flags |= HS_EXT_FLAG_HAMMING_DISTANCE;
+      ext->hamming_distance = uint;
+    } else {
+      ok = 0;
+    }
+    enif_map_iterator_next(env, &iter);
+  }
+  enif_map_iterator_destroy(env, &iter);
+
+  return ok;
+}
+
+static ERL_NIF_TERM compile_ext_multi_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  ERL_NIF_TERM result;
+
+  unsigned int num_expressions;
+  unsigned int num_flags;
+  unsigned int num_ids;
+  unsigned int num_exts;
+  unsigned int mode;
+  hs_platform_info_t * maybe_platform_info;
+
+  if (argc != 6 ||
+      !enif_get_list_length(env, argv[0], &num_expressions) ||
+      !enif_get_list_length(env, argv[1], &num_flags) ||
+      !enif_get_list_length(env, argv[2], &num_ids) ||
+      !enif_get_list_length(env, argv[3], &num_exts) ||
+      num_expressions != num_flags ||
+      num_expressions != num_ids ||
+      num_expressions != num_exts ||
+      !enif_get_uint(env, argv[4], &mode) ||
+      !maybe_get_platform_info_resource(env, argv[5], &maybe_platform_info)) {
+    result = enif_make_badarg(env);
+    goto compile_ext_multi_nif_return;
+  }
+
+  ErlNifBinary expression_bin;
+  char ** expression_array = calloc(num_expressions, sizeof(* expression_array));
+  unsigned int * flags_array = calloc(num_flags, sizeof(* flags_array));
+  unsigned int * id_array = calloc(num_ids, sizeof(* id_array));
+  hs_expr_ext_t * ext_array = calloc(num_exts, sizeof(* ext_array));
+  const hs_expr_ext_t ** ext_pointer_array = calloc(num_exts, sizeof(* ext_pointer_array));
+
+  ERL_NIF_TERM expression_head, expression_tail = argv[0];
+  ERL_NIF_TERM flags_head, flags_tail = argv[1];
+  ERL_NIF_TERM ids_head, ids_tail = argv[2];
+  ERL_NIF_TERM exts_head, exts_tail = argv[3];
+
+  for (int i = 0; i < num_expressions; i++) {
+    if (!enif_get_list_cell(env, expression_tail, &expression_head, &expression_tail) ||
+        !enif_get_list_cell(env, flags_tail, &flags_head, &flags_tail) ||
+        !enif_get_list_cell(env, ids_tail, &ids_head, &ids_tail) ||
+        !enif_get_list_cell(env, exts_tail, &exts_head, &exts_tail) ||
+        !enif_inspect_binary(env, expression_head, &expression_bin) ||
+        !enif_get_uint(env, flags_head, &flags_array[i]) ||
+        !enif_get_uint(env, ids_head, &id_array[i])) {
+      result = enif_make_badarg(env);
+      goto compile_ext_multi_nif_free_and_return;
+    }
+
+    // A nil extension compiles the expression as compile_multi/4 would.
+    if (exts_head != nil_atom) {
+      if (!get_expr_ext(env, exts_head, &ext_array[i])) {
+        result = enif_make_badarg(env);
+        goto compile_ext_multi_nif_free_and_return;
+      }
+      ext_pointer_array[i] = &ext_array[i];
+    }
+
+    expression_array[i] = null_terminate(expression_bin);
+  }
+
+  hs_database_t * db;
+  hs_compile_error_t * compile_error;
+  hs_error_t error = hs_compile_ext_multi((const char *const *) expression_array, flags_array, id_array, ext_pointer_array, num_expressions, mode, maybe_platform_info, &db, &compile_error);
+
+  switch (error) {
+  case HS_SUCCESS:
+    result = enif_make_tuple2(env, ok_atom, make_database_resource(env, db, id_array, num_ids));
+    break;
+
+  case HS_COMPILER_ERROR:
+    result = compile_error_to_term(env, compile_error);
+    break;
+
+  default:
+    result = enif_make_tuple2(env, error_atom, error_name_atom(env, error));
+    break;
+  }
+
+compile_ext_multi_nif_free_and_return:
+  for (int i = 0; i < num_expressions; i++) {
+    if (expression_array[i])
+      free(expression_array[i]);
+  }
+  free(expression_array);
+  free(flags_array);
+  free(id_array);
+  free(ext_array);
+  free(ext_pointer_array);
+
+compile_ext_multi_nif_return:
+  return result;
+}
+
+// Literals for hs_compile_lit_multi, which takes explicit lengths, so
+// literals may contain NUL bytes and are never copied.
+struct literal_set {
+  const char ** literals;
+  size_t * lengths;
+  unsigned int count;
+};
+
+void free_literal_set(struct literal_set * set) {
+  free(set->literals);
+  free(set->lengths);
+}
+
+// Reads a binary of literals, each prefixed by its length as a 32-bit
+// big-endian integer. The literals point into the binary.
+int get_packed_literal_set(ErlNifBinary * packed, struct literal_set * set) {
+  size_t offset = 0;
+  unsigned int count = 0;
+
+  while (offset < packed->size) {
+    if (packed->size - offset < 4 || count == UINT_MAX) return 0;
+    const unsigned char * prefix = packed->data + offset;
+    size_t length = ((size_t) prefix[0] << 24) | (prefix[1] << 16) | (prefix[2] << 8) | prefix[3];
+    if (packed->size - offset - 4 < length) return 0;
+    offset += 4 + length;
+    count++;
+  }
+
+  set->count = count;
+  set->literals = calloc(count ? count : 1, sizeof(* set->literals));
+  set->lengths = calloc(count ? count : 1, sizeof(* set->lengths));
+
+  offset = 0;
+  for (unsigned int i = 0; i < count; i++) {
+    const unsigned char * prefix = packed->data + offset;
+    set->lengths[i] = ((size_t) prefix[0] << 24) | (prefix[1] << 16) | (prefix[2] << 8) | prefix[3];
+    set->literals[i] = (const char *) prefix + 4;
+    offset += 4 + set->lengths[i];
+  }
+
+  return 1;
+}
+
+// Reads a list of binaries or a packed binary. The literals point into the
+// terms, so are valid for as long as `env` is.
+int get_literal_set(ErlNifEnv * env, ERL_NIF_TERM term, struct literal_set * set) {
+  ErlNifBinary bin;
+  set->literals = NULL;
+  set->lengths = NULL;
+  set->count = 0;
+
+  if (enif_inspect_binary(env, term, &bin)) {
+    return get_packed_literal_set(&bin, set);
+  }
+
+  unsigned int count;
+  if (!enif_get_list_length(env, term, &count)) {
+    return 0;
+  }
+
+  set->count = count;
+  set->literals = calloc(count ? count : 1, sizeof(* set->literals));
+  set->lengths = calloc(count ? count : 1, sizeof(* set->lengths));
+
+  ERL_NIF_TERM head;
+  for (unsigned int i = 0; i < count; i++) {
+    if (!enif_get_list_cell(env, term, &head, &term) ||
+        !enif_inspect_binary(env, head, &bin)) {
+      return 0;
+    }
+    set->literals[i] = (const char *) bin.data;
+    set->lengths[i] = bin.size;
+  }
+
+  return 1;
+}
+
+// Reads either one integer applying to all `count` elements, or a list of
+// `count` integers. Allocates the array returned in `values`.
+int get_uint_array(ErlNifEnv * env, ERL_NIF_TERM term, unsigned int count, unsigned int ** values) {
+  unsigned int value;
+  unsigned int length;
+  ERL_NIF_TERM head;
+
+  *values = calloc(count ? count : 1, sizeof(** values));
+
+  if (enif_get_uint(env, term, &value)) {
+    for (unsigned int i = 0; i < count; i++) (*values)[i] = value;
+    return 1;
+  }
+
+  if (!enif_get_list_length(env, term, &length) || length != count) {
+    return 0;
+  }
+
+  for (unsigned int i = 0; i < count; i++) {
+    if (!enif_get_list_cell(env, term, &head, &term) ||
+        !enif_get_uint(env, head, &(*values)[i])) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+static ERL_NIF_TERM compile_literals_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  ERL_NIF_TERM result;
+
+  struct literal_set set = {NULL, NULL, 0};
+  unsigned int * flags_array = NULL;
+  unsigned int * id_array = NULL;
+  unsigned int mode;
+  hs_platform_info_t * maybe_platform_info;
+
+  if (argc != 5 ||
+      !get_literal_set(env, argv[0], &set) ||
+      !get_uint_array(env, argv[1], set.count, &flags_array) ||
+      !enif_get_uint(env, argv[3], &mode) ||
+      !maybe_get_platform_info_resource(env, argv[4], &maybe_platform_info)) {
+    result = enif_make_badarg(env);
+    goto compile_literals_nif_return;
+  }
+
+  // A nil ID list numbers the literals from zero.
+  if (argv[2] == nil_atom) {
+    id_array = calloc(set.count ? set.count : 1, sizeof(* id_array));
+    for (unsigned int i = 0; i < set.count; i++) id_array[i] = i;
+  } else if (enif_is_list(env, argv[2])) {
+    if (!get_uint_array(env, argv[2], set.count, &id_array)) {
+      result = enif_make_badarg(env);
+      goto compile_literals_nif_return;
+    }
+  } else {
+    result = enif_make_badarg(env);
+    goto compile_literals_nif_return;
+  }
+
+  hs_database_t * db;
+  hs_compile_error_t * compile_error;
+  hs_error_t error = hs_compile_lit_multi(set.literals, flags_array, id_array, set.lengths, set.count, mode, maybe_platform_info, &db, &compile_error);
+
+  switch (error) {
+  case HS_SUCCESS:
+    result = enif_make_tuple2(env, ok_atom, make_database_resource(env, db, id_array, set.count));
+    break;
+
+  case HS_COMPILER_ERROR:
+    result = compile_error_to_term(env, compile_error);
+    break;
+
+  default:
+    result = enif_make_tuple2(env, error_atom, error_name_atom(env, error));
+    break;
+  }
+
+compile_literals_nif_return:
+  free_literal_set(&set);
+  free(flags_array);
+  free(id_array);
+  return result;
+}
+
+ERL_NIF_TERM expr_info_to_map(ErlNifEnv * env, hs_expr_info_t * expr_info) {
+  ERL_NIF_TERM keys[5] = {
+    enif_make_atom(env, "min_width"),
+    enif_make_atom(env, "max_width"),
+    enif_make_atom(env, "unordered_matches"),
+    enif_make_atom(env, "matches_at_eod"),
+    enif_make_atom(env, "matches_only_at_eod"),
+  };
+
+  ERL_NIF_TERM values[5] = {
+    enif_make_uint(env, expr_info->min_width),
+    enif_make_uint(env, expr_info->max_width),
+    expr_info->unordered_matches ? true_atom : false_atom,
+    expr_info->matches_at_eod ? true_atom : false_atom,
+    expr_info->matches_only_at_eod ? true_atom : false_atom,
+  };
+
+  ERL_NIF_TERM result;
+
+  if (!enif_make_map_from_arrays(env, keys, values, 5, &result)) {
+    return enif_make_badarg(env);
+  }
+
+  return result;
+}
+
+static ERL_NIF_TERM expression_info_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  ErlNifBinary expression_bin;
+  unsigned int flags;
+
+  if (argc != 2 ||
+      !enif_inspect_binary(env, argv[0], &expression_bin) ||
+      !enif_get_uint(env, argv[1], &flags)) {
+    return enif_make_badarg(env);
+  }
+
+  // Expression must be null terminated.
+  char * expression = null_terminate(expression_bin);
+
+  hs_expr_info_t * expr_info;
+  hs_compile_error_t * compile_error;
+  hs_error_t error = hs_expression_info(expression, flags, &expr_info, &compile_error);
+  free(expression);
+
+  switch (error) {
+  case HS_SUCCESS: {
+    ERL_NIF_TERM result = enif_make_tuple2(env, ok_atom, expr_info_to_map(env, expr_info));
+    misc_free(expr_info);
+    return result;
+  }
+
+  case HS_COMPILER_ERROR:
+    return compile_error_to_term(env, compile_error);
+
+  default:
+    return enif_make_tuple2(env, error_atom, error_name_atom(env, error));
+  }
+}
+
+static ERL_NIF_TERM database_info_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  hs_database_t * db;
+
+  if (argc != 1 ||
+      !get_database_resource(env, argv[0], &db)) {
+    return enif_make_badarg(env);
+  }
+
+  char * info;
+  hs_error_t error = hs_database_info(db, &info);
+
+  switch (error) {
+  case HS_SUCCESS:
+    break;
+
+  default:
+    return enif_make_tuple2(env, error_atom, error_name_atom(env, error));
+  }
+
+  ERL_NIF_TERM result = enif_make_tuple2(env, ok_atom, make_binary_const(env, info));
+  misc_free(info);
+  return result;
+}
+
+static ERL_NIF_TERM database_size_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  hs_database_t * db;
+
+  if (argc != 1 ||
+      !get_database_resource(env, argv[0], &db)) {
+    return enif_make_badarg(env);
+  }
+
+  size_t database_size;
+  hs_error_t error = hs_database_size(db, &database_size);
+
+  switch (error) {
+  case HS_SUCCESS:
+    return enif_make_tuple2(env, ok_atom, enif_make_uint64(env, database_size));
+
+  default:
+    return enif_make_tuple2(env, error_atom, error_name_atom(env, error));
+  }
+}
+
+static ERL_NIF_TERM serialize_database_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  hs_database_t * db;
+
+  if (argc != 1 ||
+      !get_database_resource(env, argv[0], &db)) {
+    return enif_make_badarg(env);
+  }
+
+  char * data;
+  size_t size;
+  hs_error_t error = hs_serialize_database(db, &data, &size);
+
+  switch (error) {
+  case HS_SUCCESS:
+    return enif_make_tuple2(env, ok_atom, make_serialized_binary(env, data, size));
+
+  default:
+    return enif_make_tuple2(env, error_atom, error_name_atom(env, error));
+  }
+}
+
+// The serialized form does not record expression IDs. Callers that know
+// them, such as Hyperscan.Cache, pass them as a second argument, so the
+// database behaves as it did when compiled.
+static ERL_NIF_TERM deserialize_database_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  ErlNifBinary binary;
+  unsigned int num_ids = 0;
+
+  if ((argc != 1 && argc != 2) ||
+      !enif_inspect_binary(env, argv[0], &binary) ||
+      (argc == 2 && !enif_get_list_length(env, argv[1], &num_ids))) {
+    return enif_make_badarg(env);
+  }
+
+  if (should_schedule_dirty(binary.size)) {
+    return enif_schedule_nif(env, "deserialize_database", ERL_NIF_DIRTY_JOB_CPU_BOUND, deserialize_database_nif, argc, argv);
+  }
+
+  unsigned int * id_array = NULL;
+  if (argc == 2 && !get_uint_array(env, argv[1], num_ids, &id_array)) {
+    free(id_array);
+    return enif_make_badarg(env);
+  }
+
+  ERL_NIF_TERM result;
+  hs_database_t * db;
+  hs_error_t error = hs_deserialize_database((char *) binary.data, binary.size, &db);
+
+  switch (error) {
+  case HS_SUCCESS:
+    result = enif_make_tuple2(env, ok_atom, make_database_resource(env, db, id_array, num_ids));
+    break;
+
+  default:
+    result = enif_make_tuple2(env, error_atom, error_name_atom(env, error));
+    break;
+  }
+
+  free(id_array);
+  return result;
+}
+
+static ERL_NIF_TERM deserialize_database_at_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  ErlNifBinary binary;
+
+  if (argc != 1 ||
+      !enif_inspect_binary(env, argv[0], &binary)) {
+    return enif_make_badarg(env);
+  }
+
+  if (should_schedule_dirty(binary.size)) {
+    return enif_schedule_nif(env, "deserialize_database_at", ERL_NIF_DIRTY_JOB_CPU_BOUND, deserialize_database_at_nif, argc, argv);
+  }
+
+  ERL_NIF_TERM result;
+  hs_error_t error = make_embedded_database_resource(env, (char *) binary.data, binary.size, &result);
+
+  switch (error) {
+  case HS_SUCCESS:
+    return enif_make_tuple2(env, ok_atom, result);
+
+  default:
+    return enif_make_tuple2(env, error_atom, error_name_atom(env, error));
+  }
+}
+
+// Names errno values the way Erlang's file module does.
+ERL_NIF_TERM errno_atom(ErlNifEnv * env, int error) {
+  switch (error) {
+  case EACCES: return enif_make_atom(env, "eacces");
+  case EISDIR: return enif_make_atom(env, "eisdir");
+  case ELOOP: return enif_make_atom(env, "eloop");
+  case EMFILE: return enif_make_atom(env, "emfile");
+  case ENAMETOOLONG: return enif_make_atom(env, "enametoolong");
+  case ENFILE: return enif_make_atom(env, "enfile");
+  case ENODEV: return enif_make_atom(env, "enodev");
+  case ENOENT: return enif_make_atom(env, "enoent");
+  case ENOMEM: return enif_make_atom(env, "enomem");
+  case ENOTDIR: return enif_make_atom(env, "enotdir");
+  case EINVAL: return enif_make_atom(env, "einval");
+  default: return enif_make_atom(env, "eio");
+  }
+}
+
+// Maps the file read-only and deserializes straight from the mapping into
+// the database resource, so the file never becomes a binary. The mapping
+// only lives for the call, and its pages come from the page cache that
+// other readers of the file share.
+static ERL_NIF_TERM deserialize_database_file_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  ErlNifBinary path_bin;
+
+  if (argc != 1 ||
+      !enif_inspect_binary(env, argv[0], &path_bin) ||
+      memchr(path_bin.data, 0, path_bin.size)) {
+    return enif_make_badarg(env);
+  }
+
+  char * path = null_terminate(path_bin);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  free(path);
+  if (fd < 0) {
+    return enif_make_tuple2(env, error_atom, errno_atom(env, errno));
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    int error = errno;
+    close(fd);
+    return enif_make_tuple2(env, error_atom, errno_atom(env, error));
+  }
+
+  if (!S_ISREG(st.st_mode) || st.st_size == 0) {
+    close(fd);
+    return enif_make_tuple2(env, error_atom, error_name_atom(env, HS_INVALID));
+  }
+
+  size_t length = st.st_size;
+  void * data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    int error = errno;
+    close(fd);
+    return enif_make_tuple2(env, error_atom, errno_atom(env, error));
+  }
+  close(fd);
+  madvise(data, length, MADV_SEQUENTIAL);
+
+  ERL_NIF_TERM result;
+  hs_error_t error = make_embedded_database_resource(env, (const char *) data, length, &result);
+  munmap(data, length);
+
+  switch (error) {
+  case HS_SUCCESS:
+    return enif_make_tuple2(env, ok_atom, result);
+
+  default:
+    return enif_make_tuple2(env, error_atom, error_name_atom(env, error));
+  }
+}
+
+static ERL_NIF_TERM serialized_database_size_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  ErlNifBinary binary;
+
+  if (argc != 1 ||
+      !enif_inspect_binary(env, argv[0], &binary)) {
+    return enif_make_badarg(env);
+  }
+
+  size_t size;
+  hs_error_t error = hs_serialized_database_size((char *) binary.data, binary.size, &size);
+
+  switch (error) {
+  case HS_SUCCESS:
+    return enif_make_tuple2(env, ok_atom, enif_make_uint64(env, size));
+
+  default:
+    return enif_make_tuple2(env, error_atom, error_name_atom(env, error));
+  }
+}
+
+static ERL_NIF_TERM serialized_database_info_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  ErlNifBinary binary;
+
+  if (argc != 1 ||
+      !enif_inspect_binary(env, argv[0], &binary)) {
+    return enif_make_badarg(env);
+  }
+
+  char * info;
+  hs_error_t error = hs_serialized_database_info((char *) binary.data, binary.size, &info);
+
+  switch (error) {
+  case HS_SUCCESS:
+    break;
+
+  default:
+    return enif_make_tuple2(env, error_atom, error_name_atom(env, error));
+  }
+
+  ERL_NIF_TERM result = enif_make_tuple2(env, ok_atom, make_binary_const(env, info));
+  misc_free(info);
+  return result;
+}
+
+static ERL_NIF_TERM set_database_stats_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  struct database_resource * database_resource;
+
+  if (argc != 2 ||
+      !get_database_resource_struct(env, argv[0], &database_resource) ||
+      (argv[1] != true_atom && argv[1] != false_atom)) {
+    return enif_make_badarg(env);
+  }
+
+  if (argv[1] == true_atom && !atomic_load(&database_resource->stats)) {
+    struct database_stats * expected = NULL;
+    struct database_stats * stats = alloc_database_stats(database_resource->num_ids);
+    if (!atomic_compare_exchange_strong(&database_resource->stats, &expected, stats)) {
+      // Another process enabled stats first.
+      free_database_stats(stats);
+    }
+  }
+
+  atomic_store(&database_resource->stats_enabled, argv[1] == true_atom);
+  return ok_atom;
+}
+
+static ERL_NIF_TERM reset_database_stats_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  struct database_resource * database_resource;
+
+  if (argc != 1 ||
+      !get_database_resource_struct(env, argv[0], &database_resource)) {
+    return enif_make_badarg(env);
+  }
+
+  struct database_stats * stats = atomic_load(&database_resource->stats);
+  if (stats) {
+    reset_database_stats(stats);
+  }
+  return ok_atom;
+}
+
+static ERL_NIF_TERM database_stats_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  struct database_resource * database_resource;
+
+  if (argc != 1 ||
+      !get_database_resource_struct(env, argv[0], &database_resource)) {
+    return enif_make_badarg(env);
+  }
+
+  struct database_stats * stats = atomic_load(&database_resource->stats);
+  if (!stats) {
+    return enif_make_tuple2(env, error_atom, enif_make_atom(env, "stats_not_enabled"));
+  }
+
+  unsigned long long scans = 0;
+  unsigned long long bytes = 0;
+  unsigned long long matches = 0;
+  unsigned long long nanoseconds = 0;
+  unsigned long long latency[STATS_BUCKETS] = {0};
+
+  for (int i = 0; i < STATS_SLOTS; i++) {
+    struct stats_slot * slot = &stats->slots[i];
+    scans += atomic_load_explicit(&slot->scans, memory_order_relaxed);
+    bytes += atomic_load_explicit(&slot->bytes, memory_order_relaxed);
+    matches += atomic_load_explicit(&slot->matches, memory_order_relaxed);
+    nanoseconds += atomic_load_explicit(&slot->nanoseconds, memory_order_relaxed);
+    for (int j = 0; j < STATS_BUCKETS; j++) {
+      latency[j] += atomic_load_explicit(&slot->latency[j], memory_order_relaxed);
+    }
+  }
+
+  // Only buckets that have counts, as {upper bound in ns, count}.
+  ERL_NIF_TERM latency_list = enif_make_list(env, 0);
+  for (int j = STATS_BUCKETS; j > 0; j--) {
+    if (latency[j - 1]) {
+      ERL_NIF_TERM bucket = enif_make_tuple2(env, enif_make_uint64(env, 1ULL << (j - 1)), enif_make_uint64(env, latency[j - 1]));
+      latency_list = enif_make_list_cell(env, bucket, latency_list);
+    }
+  }
+
+  // Only patterns that have matched, as ID => count.
+  ERL_NIF_TERM * pattern_keys = malloc((stats->num_patterns + 1) * sizeof(ERL_NIF_TERM));
+  ERL_NIF_TERM * pattern_values = malloc((stats->num_patterns + 1) * sizeof(ERL_NIF_TERM));
+  size_t num_matched = 0;
+  for (unsigned int i = 0; i < stats->num_patterns; i++) {
+    unsigned long long count = atomic_load_explicit(&stats->pattern_matches[i], memory_order_relaxed);
+    if (count) {
+      pattern_keys[num_matched] = enif_make_uint(env, database_resource->ids[i]);
+      pattern_values[num_matched] = enif_make_uint64(env, count);
+      num_matched++;
+    }
+  }
+  ERL_NIF_TERM patterns;
+  enif_make_map_from_arrays(env, pattern_keys, pattern_values, num_matched, &patterns);
+  free(pattern_keys);
+  free(pattern_values);
+
+  ERL_NIF_TERM keys[7] = {
+    enif_make_atom(env, "enabled"),
+    enif_make_atom(env, "scans"),
+    enif_make_atom(env, "bytes"),
+    enif_make_atom(env, "matches"),
+    enif_make_atom(env, "scan_ns"),
+    enif_make_atom(env, "latency_ns"),
+    enif_make_atom(env, "patterns"),
+  };
+
+  ERL_NIF_TERM values[7] = {
+    atomic_load(&database_resource->stats_enabled) ? true_atom : false_atom,
+    enif_make_uint64(env, scans),
+    enif_make_uint64(env, bytes),
+    enif_make_uint64(env, matches),
+    enif_make_uint64(env, nanoseconds),
+    latency_list,
+    patterns,
+  };
+
+  ERL_NIF_TERM result;
+  enif_make_map_from_arrays(env, keys, values, 7, &result);
+  return enif_make_tuple2(env, ok_atom, result);
+}
+
+static ERL_NIF_TERM alloc_scratch_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  hs_database_t * db;
+
+  if (argc != 1 ||
+      !get_database_resource(env, argv[0], &db)) {
+    return enif_make_badarg(env);
+  }
+
+  hs_scratch_t * scratch = NULL;
+
+  hs_error_t error = hs_alloc_scratch(db, &scratch);
+
+  switch (error) {
+  case HS_SUCCESS:
+    return enif_make_tuple2(env, ok_atom, make_scratch_resource(env, scratch));
+
+  default:
+    return enif_make_tuple2(env, error_atom, error_name_atom(env, error));
+  }
+}
+
+static ERL_NIF_TERM alloc_scratch_pool_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  struct database_resource * database_resource;
+
+  if (argc != 1 ||
+      !get_database_resource_struct(env, argv[0], &database_resource)) {
+    return enif_make_badarg(env);
+  }
+
+  // Allocate one scratch up front, so that errors surface here rather than
+  // on the first scan.
+  hs_scratch_t * scratch = NULL;
+  hs_error_t error = hs_alloc_scratch(database_resource->db, &scratch);
+
+  switch (error) {
+  case HS_SUCCESS:
+    break;
+
+  default:
+    return enif_make_tuple2(env, error_atom, error_name_atom(env, error));
+  }
+
+  return enif_make_tuple2(env, ok_atom, make_scratch_pool_resource(env, database_resource, scratch));
+}
+
+static ERL_NIF_TERM new_ruleset_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  struct database_resource * database_resource;
+
+  if (argc != 1 ||
+      !get_database_resource_struct(env, argv[0], &database_resource)) {
+    return enif_make_badarg(env);
+  }
+
+  struct scratch_pool_resource * pool;
+  hs_error_t error = alloc_generation_pool(database_resource, &pool);
+
+  switch (error) {
+  case HS_SUCCESS:
+    break;
+
+  default:
+    return enif_make_tuple2(env, error_atom, error_name_atom(env, error));
+  }
+
+  struct ruleset_resource * ruleset_resource = enif_alloc_resource(ruleset_resource_type, sizeof(struct ruleset_resource));
+  ruleset_resource->lock = enif_rwlock_create("hyperscan_ruleset");
+  ruleset_resource->pool = pool;
+  ruleset_resource->generation = 1;
+  ERL_NIF_TERM result = enif_make_resource(env, ruleset_resource);
+  enif_release_resource(ruleset_resource);
+  return enif_make_tuple2(env, ok_atom, result);
+}
+
+static ERL_NIF_TERM swap_ruleset_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  struct ruleset_resource * ruleset_resource;
+  struct database_resource * database_resource;
+
+  if (argc != 2 ||
+      !get_ruleset_resource(env, argv[0], &ruleset_resource) ||
+      !get_database_resource_struct(env, argv[1], &database_resource)) {
+    return enif_make_badarg(env);
+  }
+
+  struct scratch_pool_resource * pool;
+  hs_error_t error = alloc_generation_pool(database_resource, &pool);
+
+  switch (error) {
+  case HS_SUCCESS:
+    break;
+
+  default:
+    return enif_make_tuple2(env, error_atom, error_name_atom(env, error));
+  }
+
+  enif_rwlock_rwlock(ruleset_resource->lock);
+  struct scratch_pool_resource * old_pool = ruleset_resource->pool;
+  ruleset_resource->pool = pool;
+  unsigned long generation = ++ruleset_resource->generation;
+  enif_rwlock_rwunlock(ruleset_resource->lock);
+
+  // The old generation goes once no scan holds it.
+  enif_release_resource(old_pool);
+  return enif_make_tuple2(env, ok_atom, enif_make_ulong(env, generation));
+}
+
+static ERL_NIF_TERM pin_ruleset_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  struct ruleset_resource * ruleset_resource;
+
+  if (argc != 1 ||
+      !get_ruleset_resource(env, argv[0], &ruleset_resource)) {
+    return enif_make_badarg(env);
+  }
+
+  // Making the terms takes references of their own, which keep the
+  // generation alive after the lock is released.
+  enif_rwlock_rlock(ruleset_resource->lock);
+  struct scratch_pool_resource * pool = ruleset_resource->pool;
+  ERL_NIF_TERM pool_term = enif_make_resource(env, pool);
+  ERL_NIF_TERM db_term = enif_make_resource(env, pool->database_resource);
+  unsigned long generation = ruleset_resource->generation;
+  enif_rwlock_runlock(ruleset_resource->lock);
+
+  return enif_make_tuple3(env, enif_make_ulong(env, generation), db_term, pool_term);
+}
+
+static ERL_NIF_TERM realloc_scratch_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  hs_database_t * db;
+  hs_scratch_t * scratch;
+
+  if (argc != 2 ||
+      !get_database_resource(env, argv[0], &db) ||
+      !get_scratch_resource(env, argv[1], &scratch)) {
+    return enif_make_badarg(env);
+  }
+
+  hs_error_t error = hs_alloc_scratch(db, &scratch);
+
+  switch (error) {
+  case HS_SUCCESS:
+    return ok_atom;
+
+  default:
+    return enif_make_tuple2(env, error_atom, error_name_atom(env, error));
+  }
+}
+
+static ERL_NIF_TERM clone_scratch_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  hs_scratch_t * scratch;
+
+  if (argc != 1 ||
+      !get_scratch_resource(env, argv[0], &scratch)) {
+    return enif_make_badarg(env);
+  }
+
+  hs_scratch_t * scratch2;
+  hs_error_t error = hs_clone_scratch(scratch, &scratch2);
+
+  switch (error) {
+  case HS_SUCCESS:
+    return enif_make_tuple2(env, ok_atom, make_scratch_resource(env, scratch2));
+
+  default:
+    return enif_make_tuple2(env, error_atom, error_name_atom(env, error));
+  }
+}
+
+static ERL_NIF_TERM scratch_size_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  hs_scratch_t * scratch;
+
+  if (argc != 1 ||
+      !get_scratch_resource(env, argv[0], &scratch)) {
+    return enif_make_badarg(env);
+  }
+
+  size_t scratch_size;
+  hs_error_t error = hs_scratch_size(scratch, &scratch_size);
+
+  switch (error) {
+  case HS_SUCCESS:
+    return enif_make_tuple2(env, ok_atom, enif_make_uint64(env, scratch_size));
+
+  default:
+    return enif_make_tuple2(env, error_atom, error_name_atom(env, error));
+  }
+}
+
+int match_callback(unsigned int id, unsigned long long from, unsigned long long to, unsigned int flags, void *context) {
+  return 1;
+}
+
+static ERL_NIF_TERM match_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  struct database_resource * database_resource;
+  ErlNifBinary string;
+  struct scratch_arg scratch_arg;
+
+  if (argc != 3 ||
+      !get_database_resource_struct(env, argv[0], &database_resource) ||
+      !enif_inspect_binary(env, argv[1], &string) ||
+      !get_scratch_arg(env, argv[2], &scratch_arg)) {
+    return enif_make_badarg(env);
+  }
+
+  if (should_schedule_dirty(string.size)) {
+    return enif_schedule_nif(env, "match", ERL_NIF_DIRTY_JOB_CPU_BOUND, match_nif, argc, argv);
+  }
+
+  int flags = 0;
+  void * context = NULL;
+  hs_scratch_t * scratch;
+  hs_error_t error = acquire_scratch(&scratch_arg, &scratch);
+  if (error == HS_SUCCESS) {
+    error = instrumented_scan(database_resource, (char *) string.data, string.size, flags, scratch, match_callback, context);
+    release_scratch(&scratch_arg, scratch);
+  }
+  consume_timeslice(env, string.size);
+
+  switch (error) {
+  case HS_SUCCESS:
+    return enif_make_tuple2(env, ok_atom, false_atom);
+
+  case HS_SCAN_TERMINATED:
+    return enif_make_tuple2(env, ok_atom, true_atom);
+
+  default:
+    return enif_make_tuple2(env, error_atom, error_name_atom(env, error));
+  }
+}
+
+struct match_multi_context {
+  ErlNifEnv * env;
+  ERL_NIF_TERM result;
+};
+
+int match_multi_callback(unsigned int id, unsigned long long from, unsigned long long to, unsigned int flags, void * void_context) {
+  struct match_multi_context * context = (struct match_multi_context *) void_context;
+  ERL_NIF_TERM id_term = enif_make_uint(context->env, id);
+  context->result = enif_make_list_cell(context->env, id_term, context->result);
+  return 0;
+}
+
+static ERL_NIF_TERM match_multi_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  struct database_resource * database_resource;
+  ErlNifBinary string;
+  struct scratch_arg scratch_arg;
+
+  if (argc != 3 ||
+      !get_database_resource_struct(env, argv[0], &database_resource) ||
+      !enif_inspect_binary(env, argv[1], &string) ||
+      !get_scratch_arg(env, argv[2], &scratch_arg)) {
+    return enif_make_badarg(env);
+  }
+
+  if (should_schedule_dirty(string.size)) {
+    return enif_schedule_nif(env, "match_multi", ERL_NIF_DIRTY_JOB_CPU_BOUND, match_multi_nif, argc, argv);
+  }
+
+  struct match_multi_context context;
+  context.env = env;
+  context.result = enif_make_list(env, 0);
+  void * void_context = &context;
+
+  int flags = 0;
+  hs_scratch_t * scratch;
+  hs_error_t error = acquire_scratch(&scratch_arg, &scratch);
+  if (error == HS_SUCCESS) {
+    error = instrumented_scan(database_resource, (char *) string.data, string.size, flags, scratch, match_multi_callback, void_context);
+    release_scratch(&scratch_arg, scratch);
+  }
+  consume_timeslice(env, string.size);
+
+  switch (error) {
+  case HS_SUCCESS:
+    return enif_make_tuple2(env, ok_atom, context.result);
+
+  default:
+    return enif_make_tuple2(env, error_atom, error_name_atom(env, error));
+  }
+}
+
+enum scan_result {
+  SCAN_RESULT_IDS,
+  SCAN_RESULT_TUPLES,
+  SCAN_RESULT_PACKED,
+};
+
+struct scan_options {
+  enum scan_result result;
+  // Report each ID at most once.
+  int unique;
+  // Stop once every ID in the database has matched.
+  int stop_on_all;
+  // Stop once any ID in this list has matched, or 0 for none.
+  ERL_NIF_TERM stop_on;
+};
+
+// Size of one match in a packed result: u32 id, u64 from, u64 to.
+#define PACKED_MATCH_SIZE 20
+
+int get_scan_options(ErlNifEnv * env, ERL_NIF_TERM list, struct scan_options * options) {
+  options->result = SCAN_RESULT_IDS;
+  options->unique = 0;
+  options->stop_on_all = 0;
+  options->stop_on = 0;
+
+  ERL_NIF_TERM head;
+  const ERL_NIF_TERM * pair;
+  int arity;
+
+  while (enif_get_list_cell(env, list, &head, &list)) {
+    if (!enif_get_tuple(env, head, &arity, &pair) || arity != 2) {
+      return 0;
+    }
+
+    if (pair[0] == result_atom) {
+      if (pair[1] == ids_atom) options->result = SCAN_RESULT_IDS;
+      else if (pair[1] == tuples_atom) options->result = SCAN_RESULT_TUPLES;
+      else if (pair[1] == packed_atom) options->result = SCAN_RESULT_PACKED;
+      else return 0;
+    } else if (pair[0] == unique_atom) {
+      if (pair[1] == true_atom) options->unique = 1;
+      else if (pair[1] == false_atom) options->unique = 0;
+      else return 0;
+    } else if (pair[0] == stop_on_atom) {
+      if (pair[1] == all_atom) {
+        options->stop_on_all = 1;
+        options->stop_on = 0;
+      } else {
+        ERL_NIF_TERM id_head, id_tail = pair[1];
+        unsigned int id;
+        while (enif_get_list_cell(env, id_tail, &id_head, &id_tail)) {
+          if (!enif_get_uint(env, id_head, &id)) return 0;
+        }
+        if (!enif_is_empty_list(env, id_tail)) return 0;
+        options->stop_on_all = 0;
+        options->stop_on = pair[1];
+      }
+    } else {
+      return 0;
+    }
+  }
+
+  return enif_is_empty_list(env, list);
+}
+
+struct scan_context {
+  ErlNifEnv * env;
+  struct scan_options * options;
+  const struct database_resource * database_resource;
+  ERL_NIF_TERM result;
+  ErlNifBinary packed;
+  size_t packed_size;
+  int owns_packed;
+  // Set when the packed result could not grow.
+  int nomem;
+  int track_seen;
+  struct id_set seen;
+  int has_stop;
+  struct id_set stop;
+};
+
+int scan_callback(unsigned int id, unsigned long long from, unsigned long long to, unsigned int flags, void * void_context) {
+  struct scan_context * context = (struct scan_context *) void_context;
+  struct scan_options * options = context->options;
+  ErlNifEnv * env = context->env;
+
+  if (context->track_seen && !id_set_insert(&context->seen, id) && options->unique) {
+    return 0;
+  }
+
+  switch (options->result) {
+  case SCAN_RESULT_IDS:
+    context->result = enif_make_list_cell(env, enif_make_uint(env, id), context->result);
+    break;
+
+  case SCAN_RESULT_TUPLES:
+    context->result = enif_make_list_cell(env, enif_make_tuple3(env, enif_make_uint(env, id), enif_make_uint64(env, from), enif_make_uint64(env, to)), context->result);
+    break;
+
+  case SCAN_RESULT_PACKED:
+    if (context->packed_size + PACKED_MATCH_SIZE > context->packed.size &&
+        !enif_realloc_binary(&context->packed, context->packed.size * 2)) {
+      context->nomem = 1;
+      return 1;
+    }
+    uint32_t id32 = id;
+    uint64_t from64 = from;
+    uint64_t to64 = to;
+    unsigned char * record = context->packed.data + context->packed_size;
+    memcpy(record, &id32, 4);
+    memcpy(record + 4, &from64, 8);
+    memcpy(record + 12, &to64, 8);
+    context->packed_size += PACKED_MATCH_SIZE;
+    break;
+  }
+
+  if (options->stop_on_all && context->seen.count == context->database_resource->num_ids) {
+    return 1;
+  }
+
+  if (context->has_stop && id_set_contains(&context->stop, id)) {
+    return 1;
+  }
+
+  return 0;
+}
+
+int init_scan_context(ErlNifEnv * env, struct scan_options * options, const struct database_resource * database_resource, struct scan_context * context) {
+  context->env = env;
+  context->options = options;
+  context->database_resource = database_resource;
+  context->result = enif_make_list(env, 0);
+  context->packed_size = 0;
+  context->owns_packed = 0;
+  context->nomem = 0;
+
+  // Stopping on all IDs needs to know what they are. Without them, the scan
+  // simply runs to the end.
+  if (options->stop_on_all && !database_resource->ids) {
+    options->stop_on_all = 0;
+  }
+
+  context->track_seen = options->unique || options->stop_on_all;
+  if (context->track_seen) {
+    init_id_set(&context->seen, database_resource);
+  }
+
+  context->has_stop = options->stop_on != 0;
+  if (context->has_stop) {
+    ERL_NIF_TERM head, tail = options->stop_on;
+    unsigned int id;
+    init_id_set(&context->stop, NULL);
+    while (enif_get_list_cell(env, tail, &head, &tail) && enif_get_uint(env, head, &id)) {
+      id_set_insert(&context->stop, id);
+    }
+  }
+
+  if (options->result == SCAN_RESULT_PACKED) {
+    context->owns_packed = enif_alloc_binary(64 * PACKED_MATCH_SIZE, &context->packed);
+    if (!context->owns_packed) {
+      context->nomem = 1;
+      return 0;
+    }
+  }
+  return 1;
+}
+
+void free_scan_context(struct scan_context * context) {
+  if (context->owns_packed) {
+    enif_release_binary(&context->packed);
+    context->owns_packed = 0;
+  }
+  if (context->track_seen) {
+    free_id_set(&context->seen);
+    context->track_seen = 0;
+  }
+  if (context->has_stop) {
+    free_id_set(&context->stop);
+    context->has_stop = 0;
+  }
+}
+
+ERL_NIF_TERM scan_context_result(struct scan_context * context) {
+  ERL_NIF_TERM result;
+
+  switch (context->options->result) {
+  case SCAN_RESULT_PACKED:
+    enif_realloc_binary(&context->packed, context->packed_size);
+    context->owns_packed = 0;
+    return enif_make_binary(context->env, &context->packed);
+
+  default:
+    enif_make_reverse_list(context->env, context->result, &result);
+    return result;
+  }
+}
+
+// Turns the outcome of a scan into the NIF's return value and frees the
+// context.
+ERL_NIF_TERM scan_context_return(struct scan_context * context, hs_error_t error) {
+  ErlNifEnv * env = context->env;
+  ERL_NIF_TERM result;
+
+  if (error == HS_SCAN_TERMINATED && !context->nomem) {
+    // Stopped early by request.
+    error = HS_SUCCESS;
+  } else if (context->nomem) {
+    error = HS_NOMEM;
+  }
+
+  switch (error) {
+  case HS_SUCCESS:
+    result = enif_make_tuple2(env, ok_atom, scan_context_result(context));
+    break;
+
+  default:
+    result = enif_make_tuple2(env, error_atom, error_name_atom(env, error));
+    break;
+  }
+
+  free_scan_context(context);
+  return result;
+}
+
+static ERL_NIF_TERM scan_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  struct database_resource * database_resource;
+  ErlNifBinary string;
+  struct scratch_arg scratch_arg;
+  struct scan_options options;
+
+  if (argc != 4 ||
+      !get_database_resource_struct(env, argv[0], &database_resource) ||
+      !enif_inspect_binary(env, argv[1], &string) ||
+      !get_scratch_arg(env, argv[2], &scratch_arg) ||
+      !get_scan_options(env, argv[3], &options)) {
+    return enif_make_badarg(env);
+  }
+
+  if (should_schedule_dirty(string.size)) {
+    return enif_schedule_nif(env, "scan", ERL_NIF_DIRTY_JOB_CPU_BOUND, scan_nif, argc, argv);
+  }
+
+  struct scan_context context;
+  if (!init_scan_context(env, &options, database_resource, &context)) {
+    return scan_context_return(&context, HS_NOMEM);
+  }
+
+  int flags = 0;
+  hs_scratch_t * scratch;
+  hs_error_t error = acquire_scratch(&scratch_arg, &scratch);
+  if (error == HS_SUCCESS) {
+    error = instrumented_scan(database_resource, (char *) string.data, string.size, flags, scratch, scan_callback, &context);
+    release_scratch(&scratch_arg, scratch);
+  }
+  consume_timeslice(env, string.size);
+  return scan_context_return(&context, error);
+}
+
+// Arguments: db, remaining inputs, scratch, results so far in reverse.
+static ERL_NIF_TERM match_multi_batch_continue(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  struct database_resource * database_resource;
+  struct scratch_arg scratch_arg;
+
+  if (argc != 4 ||
+      !get_database_resource_struct(env, argv[0], &database_resource) ||
+      !get_scratch_arg(env, argv[2], &scratch_arg)) {
+    return enif_make_badarg(env);
+  }
+
+  ERL_NIF_TERM head;
+  ERL_NIF_TERM tail = argv[1];
+  ERL_NIF_TERM acc = argv[3];
+  ErlNifBinary string;
+  size_t pending = 0;
+
+  while (enif_get_list_cell(env, tail, &head, &tail)) {
+    if (!enif_inspect_binary(env, head, &string)) {
+      return enif_make_badarg(env);
+    }
+
+    if (should_schedule_dirty(string.size)) {
+      ERL_NIF_TERM args[4] = {argv[0], enif_make_list_cell(env, head, tail), argv[2], acc};
+      return enif_schedule_nif(env, "match_multi_batch", ERL_NIF_DIRTY_JOB_CPU_BOUND, match_multi_batch_continue, 4, args);
+    }
+
+    struct match_multi_context context;
+    context.env = env;
+    context.result = enif_make_list(env, 0);
+
+    int flags = 0;
+    hs_scratch_t * scratch;
+    hs_error_t error = acquire_scratch(&scratch_arg, &scratch);
+    if (error == HS_SUCCESS) {
+      error = instrumented_scan(database_resource, (char *) string.data, string.size, flags, scratch, match_multi_callback, &context);
+      release_scratch(&scratch_arg, scratch);
+    }
+
+    if (error != HS_SUCCESS) {
+      return enif_make_tuple2(env, error_atom, error_name_atom(env, error));
+    }
+
+    acc = enif_make_list_cell(env, context.result, acc);
+
+    if (consume_batch_timeslice(env, &pending, string.size) && !enif_is_empty_list(env, tail)) {
+      ERL_NIF_TERM args[4] = {argv[0], tail, argv[2], acc};
+      return enif_schedule_nif(env, "match_multi_batch", 0, match_multi_batch_continue, 4, args);
+    }
+  }
+
+  if (!enif_is_empty_list(env, tail)) {
+    return enif_make_badarg(env);
+  }
+
+  ERL_NIF_TERM result;
+  enif_make_reverse_list(env, acc, &result);
+  return enif_make_tuple2(env, ok_atom, result);
+}
+
+static ERL_NIF_TERM match_multi_batch_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  if (argc != 3 ||
+      !enif_is_list(env, argv[1])) {
+    return enif_make_badarg(env);
+  }
+
+  ERL_NIF_TERM args[4] = {argv[0], argv[1], argv[2], enif_make_list(env, 0)};
+  return match_multi_batch_continue(env, 4, args);
+}
+
+static ERL_NIF_TERM alloc_batch_pool_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  struct database_resource * database_resource;
+
+  if (argc != 1 ||
+      !get_database_resource_struct(env, argv[0], &database_resource)) {
+    return enif_make_badarg(env);
+  }
+
+  unsigned int num_workers = start_workers();
+  if (num_workers == 0) {
+    return enif_make_tuple2(env, error_atom, enif_make_atom(env, "no_workers"));
+  }
+
+  hs_scratch_t * prototype = NULL;
+  hs_error_t error = hs_alloc_scratch(database_resource->db, &prototype);
+  if (error != HS_SUCCESS) {
+    return enif_make_tuple2(env, error_atom, error_name_atom(env, error));
+  }
+
+  hs_scratch_t ** scratches = calloc(num_workers, sizeof(* scratches));
+  scratches[0] = prototype;
+  for (unsigned int i = 1; i < num_workers; i++) {
+    error = hs_clone_scratch(prototype, &scratches[i]);
+    if (error != HS_SUCCESS) {
+      for (unsigned int j = 0; j < i; j++) {
+        hs_free_scratch(scratches[j]);
+      }
+      free(scratches);
+      return enif_make_tuple2(env, error_atom, error_name_atom(env, error));
+    }
+  }
+
+  struct batch_pool_resource * batch_pool_resource = enif_alloc_resource(batch_pool_resource_type, sizeof(struct batch_pool_resource));
+  batch_pool_resource->database_resource = database_resource;
+  enif_keep_resource(database_resource);
+  batch_pool_resource->scratches = scratches;
+  batch_pool_resource->num_scratches = num_workers;
+  ERL_NIF_TERM result = enif_make_resource(env, batch_pool_resource);
+  enif_release_resource(batch_pool_resource);
+  return enif_make_tuple2(env, ok_atom, result);
+}
+
+// Matches found in one input, in the order Hyperscan reported them.
+struct id_buffer {
+  unsigned int * ids;
+  unsigned int count;
+  unsigned int capacity;
+};
+
+int id_buffer_callback(unsigned int id, unsigned long long from, unsigned long long to, unsigned int flags, void * void_context) {
+  struct id_buffer * buffer = (struct id_buffer *) void_context;
+  if (buffer->count == buffer->capacity) {
+    buffer->capacity = buffer->capacity ? buffer->capacity * 2 : 4;
+    buffer->ids = realloc(buffer->ids, buffer->capacity * sizeof(* buffer->ids));
+  }
+  buffer->ids[buffer->count++] = id;
+  return 0;
+}
+
+struct batch_job;
+
+struct batch_task {
+  struct batch_job * job;
+  size_t start;
+  size_t end;
+};
+
+struct batch_job {
+  // Kept until the job finishes.
+  struct batch_pool_resource * batch_pool_resource;
+  // Holds the inputs and the reply.
+  ErlNifEnv * env;
+  ErlNifPid pid;
+  ERL_NIF_TERM ref;
+  size_t count;
+  const char ** data;
+  unsigned int * length;
+  struct id_buffer * results;
+  struct batch_task * tasks;
+  atomic_size_t pending_tasks;
+  atomic_int error;
+};
+
+void free_batch_job(struct batch_job * job) {
+  if (job->results) {
+    for (size_t i = 0; i < job->count; i++) {
+      free(job->results[i].ids);
+    }
+    free(job->results);
+  }
+  free(job->data);
+  free(job->length);
+  free(job->tasks);
+  enif_free_env(job->env);
+  enif_release_resource(job->batch_pool_resource);
+  free(job);
+}
+
+// Sends the reply. `caller_env` is NULL on a worker thread.
+void finish_batch_job(ErlNifEnv * caller_env, struct batch_job * job) {
+  ErlNifEnv * env = job->env;
+  hs_error_t error = atomic_load(&job->error);
+  ERL_NIF_TERM result;
+
+  if (error == HS_SUCCESS) {
+    result = enif_make_list(env, 0);
+    for (size_t i = job->count; i > 0; i--) {
+      struct id_buffer * buffer = &job->results[i - 1];
+      // Same order as match_multi/3.
+      ERL_NIF_TERM ids = enif_make_list(env, 0);
+      for (unsigned int j = 0; j < buffer->count; j++) {
+        ids = enif_make_list_cell(env, enif_make_uint(env, buffer->ids[j]), ids);
+      }
+      result = enif_make_list_cell(env, ids, result);
+    }
+    result = enif_make_tuple2(env, ok_atom, result);
+  } else {
+    result = enif_make_tuple2(env, error_atom, error_name_atom(env, error));
+  }
+
+  ERL_NIF_TERM message = enif_make_tuple3(env, enif_make_atom(env, "hyperscan_batch"), job->ref, result);
+  enif_send(caller_env, &job->pid, env, message);
+  free_batch_job(job);
+}
+
+void run_batch_task(void * arg, unsigned int worker) {
+  struct batch_task * task = (struct batch_task *) arg;
+  struct batch_job * job = task->job;
+  struct database_resource * database_resource = job->batch_pool_resource->database_resource;
+  hs_scratch_t * scratch = job->batch_pool_resource->scratches[worker];
+
+  for (size_t i = task->start; i < task->end && atomic_load(&job->error) == HS_SUCCESS; i++) {
+    int flags = 0;
+    hs_error_t error = instrumented_scan(database_resource, job->data[i], job->length[i], flags, scratch, id_buffer_callback, &job->results[i]);
+    if (error != HS_SUCCESS) {
+      int expected = HS_SUCCESS;
+      atomic_compare_exchange_strong(&job->error, &expected, error);
+    }
+  }
+
+  if (atomic_fetch_sub(&job->pending_tasks, 1) == 1) {
+    finish_batch_job(NULL, job);
+  }
+}
+
+// Collects the inputs of a job from a list of binaries, or from a binary of
+// newline-separated records. Returns 0 if the input is neither.
+int get_batch_job_inputs(struct batch_job * job, ERL_NIF_TERM input) {
+  ErlNifEnv * env = job->env;
+  ErlNifBinary bin;
+  size_t capacity;
+
+  if (enif_inspect_binary(env, input, &bin)) {
+    capacity = 16;
+    job->data = malloc(capacity * sizeof(* job->data));
+    job->length = malloc(capacity * sizeof(* job->length));
+
+    size_t start = 0;
+    while (start < bin.size) {
+      const unsigned char * newline = memchr(bin.data + start, '\n', bin.size - start);
+      size_t end = newline ? (size_t) (newline - bin.data) : bin.size;
+      if (end - start > UINT_MAX) {
+        return 0;
+      }
+      if (job->count == capacity) {
+        capacity *= 2;
+        job->data = realloc(job->data, capacity * sizeof(* job->data));
+        job->length = realloc(job->length, capacity * sizeof(* job->length));
+      }
+      job->data[job->count] = (const char *) bin.data + start;
+      job->length[job->count] = end - start;
+      job->count++;
+      start = end + 1;
+    }
+    return 1;
+  }
+
+  unsigned int length;
+  if (!enif_get_list_length(env, input, &length)) {
+    return 0;
+  }
+
+  capacity = length ? length : 1;
+  job->data = malloc(capacity * sizeof(* job->data));
+  job->length = malloc(capacity * sizeof(* job->length));
+
+  ERL_NIF_TERM head, tail = input;
+  while (enif_get_list_cell(env, tail, &head, &tail)) {
+    if (!enif_inspect_binary(env, head, &bin) || bin.size > UINT_MAX) {
+      return 0;
+    }
+    job->data[job->count] = (const char *) bin.data;
+    job->length[job->count] = bin.size;
+    job->count++;
+  }
+  return 1;
+}
+
+static ERL_NIF_TERM match_multi_parallel_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  struct batch_pool_resource * batch_pool_resource;
+
+  if (argc != 2 ||
+      !get_batch_pool_resource(env, argv[0], &batch_pool_resource)) {
+    return enif_make_badarg(env);
+  }
+
+  struct batch_job * job = calloc(1, sizeof(* job));
+  job->batch_pool_resource = batch_pool_resource;
+  enif_keep_resource(batch_pool_resource);
+  job->env = enif_alloc_env();
+  atomic_init(&job->error, HS_SUCCESS);
+
+  // Copying shares refc binaries rather than their bytes.
+  if (!get_batch_job_inputs(job, enif_make_copy(job->env, argv[1]))) {
+    free_batch_job(job);
+    return enif_make_badarg(env);
+  }
+
+  ERL_NIF_TERM ref = enif_make_ref(env);
+  job->ref = enif_make_copy(job->env, ref);
+  enif_self(env, &job->pid);
+  job->results = calloc(job->count ? job->count : 1, sizeof(* job->results));
+
+  if (job->count == 0) {
+    finish_batch_job(env, job);
+    return enif_make_tuple2(env, ok_atom, ref);
+  }
+
+  // Several tasks per worker, so that uneven inputs still balance.
+  size_t num_workers = batch_pool_resource->num_scratches;
+  size_t task_size = (job->count + num_workers * 4 - 1) / (num_workers * 4);
+  size_t num_tasks = (job->count + task_size - 1) / task_size;
+  job->tasks = calloc(num_tasks, sizeof(* job->tasks));
+  atomic_init(&job->pending_tasks, num_tasks);
+
+  for (size_t i = 0; i < num_tasks; i++) {
+    job->tasks[i].job = job;
+    job->tasks[i].start = i * task_size;
+    job->tasks[i].end = (i + 1) * task_size < job->count ? (i + 1) * task_size : job->count;
+  }
+
+  for (size_t i = 0; i < num_tasks; i++) {
+    submit_worker_task(run_batch_task, &job->tasks[i]);
+  }
+
+  return enif_make_tuple2(env, ok_atom, ref);
+}
+
+// Compiles the shards whose rules differ from what the sharded database
+// holds, and swaps them in together. Returns 1 with {:ok, changed_shards}
+// in result, or 0 with an error term, leaving the database untouched.
+int update_shards(ErlNifEnv * env, struct sharded_database_resource * sharded_database_resource, ERL_NIF_TERM expressions, ERL_NIF_TERM flags, ERL_NIF_TERM ids, ERL_NIF_TERM * result) {
+  unsigned int num_expressions, num_flags, num_ids;
+
+  if (!enif_get_list_length(env, expressions, &num_expressions) ||
+      !enif_get_list_length(env, flags, &num_flags) ||
+      !enif_get_list_length(env, ids, &num_ids) ||
+      num_expressions != num_flags ||
+      num_expressions != num_ids) {
+    *result = enif_make_badarg(env);
+    return 0;
+  }
+
+  int swapped = 0;
+  unsigned int num_shards = sharded_database_resource->num_shards;
+  ErlNifBinary * expression_array = calloc(num_expressions ? num_expressions : 1, sizeof(* expression_array));
+  char ** terminated_array = calloc(num_expressions ? num_expressions : 1, sizeof(* terminated_array));
+  unsigned int * flags_array = calloc(num_expressions ? num_expressions : 1, sizeof(* flags_array));
+  unsigned int * id_array = calloc(num_expressions ? num_expressions : 1, sizeof(* id_array));
+  unsigned int * counts = calloc(num_shards, sizeof(* counts));
+  uint64_t * fingerprints = malloc(num_shards * sizeof(* fingerprints));
+  struct shard_compile * compiles = calloc(num_shards, sizeof(* compiles));
+  unsigned int num_compiles = 0;
+
+  ERL_NIF_TERM expression_head, expression_tail = expressions;
+  ERL_NIF_TERM flags_head, flags_tail = flags;
+  ERL_NIF_TERM ids_head, ids_tail = ids;
+
+  for (unsigned int i = 0; i < num_expressions; i++) {
+    if (!enif_get_list_cell(env, expression_tail, &expression_head, &expression_tail) ||
+        !enif_get_list_cell(env, flags_tail, &flags_head, &flags_tail) ||
+        !enif_get_list_cell(env, ids_tail, &ids_head, &ids_tail) ||
+        !enif_inspect_binary(env, expression_head, &expression_array[i]) ||
+        !enif_get_uint(env, flags_head, &flags_array[i]) ||
+        !enif_get_uint(env, ids_head, &id_array[i])) {
+      *result = enif_make_badarg(env);
+      goto update_shards_free_and_return;
+    }
+    terminated_array[i] = null_terminate(expression_array[i]);
+  }
+
+  enif_mutex_lock(sharded_database_resource->update_mutex);
+
+  for (unsigned int s = 0; s < num_shards; s++) {
+    fingerprints[s] = FINGERPRINT_BASIS;
+  }
+
+  for (unsigned int i = 0; i < num_expressions; i++) {
+    unsigned int s = shard_of(id_array[i], num_shards);
+    uint64_t length = expression_array[i].size;
+    counts[s]++;
+    fingerprints[s] = fingerprint_update(fingerprints[s], &id_array[i], sizeof(id_array[i]));
+    fingerprints[s] = fingerprint_update(fingerprints[s], &flags_array[i], sizeof(flags_array[i]));
+    fingerprints[s] = fingerprint_update(fingerprints[s], &length, sizeof(length));
+    fingerprints[s] = fingerprint_update(fingerprints[s], expression_array[i].data, expression_array[i].size);
+  }
+
+  // Only this function writes fingerprints, and it holds the update mutex,
+  // so they can be read without the lock.
+  int * compile_of = malloc(num_shards * sizeof(* compile_of));
+  for (unsigned int s = 0; s < num_shards; s++) {
+    compile_of[s] = -1;
+    if (fingerprints[s] == sharded_database_resource->shards[s].fingerprint) {
+      continue;
+    }
+
+    struct shard_compile * compile = &compiles[num_compiles];
+    compile_of[s] = num_compiles++;
+    compile->shard = s;
+    compile->mode = sharded_database_resource->mode;
+    compile->fingerprint = fingerprints[s];
+    compile->expressions = calloc(counts[s] ? counts[s] : 1, sizeof(* compile->expressions));
+    compile->flags = calloc(counts[s] ? counts[s] : 1, sizeof(* compile->flags));
+    compile->ids = calloc(counts[s] ? counts[s] : 1, sizeof(* compile->ids));
+    compile->positions = calloc(counts[s] ? counts[s] : 1, sizeof(* compile->positions));
+    compile->error = HS_SUCCESS;
+  }
+
+  for (unsigned int i = 0; i < num_expressions; i++) {
+    int c = compile_of[shard_of(id_array[i], num_shards)];
+    if (c >= 0) {
+      struct shard_compile * compile = &compiles[c];
+      compile->expressions[compile->count] = terminated_array[i];
+      compile->flags[compile->count] = flags_array[i];
+      compile->ids[compile->count] = id_array[i];
+      compile->positions[compile->count] = i;
+      compile->count++;
+    }
+  }
+  free(compile_of);
+
+  // A shard left with no rules is simply dropped.
+  build_shards(compiles, num_compiles);
+
+  struct shard_compile * failed = NULL;
+  for (unsigned int c = 0; c < num_compiles && !failed; c++) {
+    if (compiles[c].error != HS_SUCCESS) {
+      failed = &compiles[c];
+    }
+  }
+
+  if (failed) {
+    if (failed->error == HS_COMPILER_ERROR) {
+      *result = enif_make_tuple2(env, error_atom, enif_make_tuple2(env, make_binary_const(env, failed->message), enif_make_int(env, failed->expression)));
+    } else {
+      *result = enif_make_tuple2(env, error_atom, error_name_atom(env, failed->error));
+    }
+    for (unsigned int c = 0; c < num_compiles; c++) {
+      if (compiles[c].db) {
+        hs_free_database(compiles[c].db);
+      }
+    }
+    enif_mutex_unlock(sharded_database_resource->update_mutex);
+    goto update_shards_free_and_return;
+  }
+
+  struct database_resource ** replaced = calloc(num_compiles ? num_compiles : 1, sizeof(* replaced));
+  struct database_resource ** created = calloc(num_compiles ? num_compiles : 1, sizeof(* created));
+  for (unsigned int c = 0; c < num_compiles; c++) {
+    if (compiles[c].db) {
+      created[c] = alloc_database_resource(compiles[c].db, compiles[c].ids, compiles[c].count);
+    }
+  }
+
+  enif_rwlock_rwlock(sharded_database_resource->lock);
+  for (unsigned int c = 0; c < num_compiles; c++) {
+    struct shard * shard = &sharded_database_resource->shards[compiles[c].shard];
+    replaced[c] = shard->database_resource;
+    shard->database_resource = created[c];
+    shard->fingerprint = compiles[c].fingerprint;
+  }
+  if (num_compiles > 0) {
+    sharded_database_resource->generation++;
+  }
+  enif_rwlock_rwunlock(sharded_database_resource->lock);
+  enif_mutex_unlock(sharded_database_resource->update_mutex);
+
+  // Scans that pinned a replaced shard keep it until they finish.
+  ERL_NIF_TERM changed = enif_make_list(env, 0);
+  for (unsigned int c = num_compiles; c > 0; c--) {
+    if (replaced[c - 1]) {
+      enif_release_resource(replaced[c - 1]);
+    }
+    changed = enif_make_list_cell(env, enif_make_uint(env, compiles[c - 1].shard), changed);
+  }
+  free(replaced);
+  free(created);
+  *result = enif_make_tuple2(env, ok_atom, changed);
+  swapped = 1;
+
+update_shards_free_and_return:
+  for (unsigned int c = 0; c < num_compiles; c++) {
+    free(compiles[c].expressions);
+    free(compiles[c].flags);
+    free(compiles[c].ids);
+    free(compiles[c].positions);
+    free(compiles[c].message);
+  }
+  for (unsigned int i = 0; i < num_expressions; i++) {
+    if (terminated_array[i])
+      free(terminated_array[i]);
+  }
+  free(compiles);
+  free(fingerprints);
+  free(counts);
+  free(id_array);
+  free(flags_array);
+  free(terminated_array);
+  free(expression_array);
+  return swapped;
+}
+
+static ERL_NIF_TERM compile_sharded_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  unsigned int mode;
+  unsigned int num_shards;
+
+  if (argc != 5 ||
+      !enif_get_uint(env, argv[3], &mode) ||
+      !enif_get_uint(env, argv[4], &num_shards) ||
+      num_shards == 0) {
+    return enif_make_badarg(env);
+  }
+
+  struct sharded_database_resource * sharded_database_resource = enif_alloc_resource(sharded_database_resource_type, sizeof(struct sharded_database_resource));
+  sharded_database_resource->lock = enif_rwlock_create("hyperscan_sharded_database");
+  sharded_database_resource->shards = calloc(num_shards, sizeof(* sharded_database_resource->shards));
+  sharded_database_resource->num_shards = num_shards;
+  sharded_database_resource->mode = mode;
+  sharded_database_resource->generation = 1;
+  sharded_database_resource->update_mutex = enif_mutex_create("hyperscan_sharded_database_update");
+  sharded_database_resource->scratch_mutex = enif_mutex_create("hyperscan_sharded_database_scratch");
+  sharded_database_resource->scratches = NULL;
+  sharded_database_resource->num_scratches = 0;
+  sharded_database_resource->scratch_capacity = 0;
+
+  // An empty shard has the fingerprint of no rules, so only shards that get
+  // rules are compiled.
+  for (unsigned int s = 0; s < num_shards; s++) {
+    sharded_database_resource->shards[s].fingerprint = FINGERPRINT_BASIS;
+  }
+
+  ERL_NIF_TERM result;
+  if (update_shards(env, sharded_database_resource, argv[0], argv[1], argv[2], &result)) {
+    result = enif_make_tuple2(env, ok_atom, enif_make_resource(env, sharded_database_resource));
+  }
+  enif_release_resource(sharded_database_resource);
+  return result;
+}
+
+static ERL_NIF_TERM recompile_sharded_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  struct sharded_database_resource * sharded_database_resource;
+
+  if (argc != 4 ||
+      !get_sharded_database_resource(env, argv[0], &sharded_database_resource)) {
+    return enif_make_badarg(env);
+  }
+
+  ERL_NIF_TERM result;
+  update_shards(env, sharded_database_resource, argv[1], argv[2], argv[3], &result);
+  return result;
+}
+
+static ERL_NIF_TERM pin_sharded_database_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  struct sharded_database_resource * sharded_database_resource;
+
+  if (argc != 1 ||
+      !get_sharded_database_resource(env, argv[0], &sharded_database_resource)) {
+    return enif_make_badarg(env);
+  }
+
+  ERL_NIF_TERM databases = enif_make_list(env, 0);
+
+  enif_rwlock_rlock(sharded_database_resource->lock);
+  for (unsigned int s = sharded_database_resource->num_shards; s > 0; s--) {
+    struct database_resource * database_resource = sharded_database_resource->shards[s - 1].database_resource;
+    ERL_NIF_TERM database = database_resource ? enif_make_resource(env, database_resource) : nil_atom;
+    databases = enif_make_list_cell(env, database, databases);
+  }
+  unsigned long generation = sharded_database_resource->generation;
+  enif_rwlock_runlock(sharded_database_resource->lock);
+
+  return enif_make_tuple2(env, enif_make_ulong(env, generation), databases);
+}
+
+static ERL_NIF_TERM match_multi_sharded_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  struct sharded_database_resource * sharded_database_resource;
+  ErlNifBinary string;
+
+  if (argc != 2 ||
+      !get_sharded_database_resource(env, argv[0], &sharded_database_resource) ||
+      !enif_inspect_binary(env, argv[1], &string)) {
+    return enif_make_badarg(env);
+  }
+
+  // Every shard reads the whole string.
+  size_t work = string.size * sharded_database_resource->num_shards;
+  if (should_schedule_dirty(work)) {
+    return enif_schedule_nif(env, "match_multi_sharded", ERL_NIF_DIRTY_JOB_CPU_BOUND, match_multi_sharded_nif, argc, argv);
+  }
+
+  struct match_multi_context context;
+  context.env = env;
+  context.result = enif_make_list(env, 0);
+
+  struct shard_pin pin;
+  pin_shards(sharded_database_resource, &pin);
+
+  int flags = 0;
+  hs_scratch_t * scratch = NULL;
+  hs_error_t error = acquire_sharded_scratch(sharded_database_resource, &pin, &scratch);
+  for (unsigned int i = 0; i < pin.num_databases && error == HS_SUCCESS; i++) {
+    error = instrumented_scan(pin.databases[i], (char *) string.data, string.size, flags, scratch, match_multi_callback, &context);
+  }
+  release_sharded_scratch(sharded_database_resource, &pin, scratch);
+  unpin_shards(&pin);
+  consume_timeslice(env, work);
+
+  switch (error) {
+  case HS_SUCCESS:
+    return enif_make_tuple2(env, ok_atom, context.result);
+
+  default:
+    return enif_make_tuple2(env, error_atom, error_name_atom(env, error));
+  }
+}
+
+// A match found by a replace scan.
+struct span {
+  unsigned int id;
+  unsigned long long from;
+  unsigned long long to;
+};
+
+struct span_buffer {
+  struct span * spans;
+  size_t count;
+  size_t capacity;
+};
+
+int span_buffer_callback(unsigned int id, unsigned long long from, unsigned long long to, unsigned int flags, void * void_context) {
+  struct span_buffer * buffer = (struct span_buffer *) void_context;
+  if (buffer->count == buffer->capacity) {
+    buffer->capacity = buffer->capacity ? buffer->capacity * 2 : 16;
+    buffer->spans = realloc(buffer->spans, buffer->capacity * sizeof(* buffer->spans));
+  }
+  buffer->spans[buffer->count].id = id;
+  buffer->spans[buffer->count].from = from;
+  buffer->spans[buffer->count].to = to;
+  buffer->count++;
+  return 0;
+}
+
+int compare_spans_leftmost_longest(const void * a, const void * b) {
+  const struct span * x = (const struct span *) a;
+  const struct span * y = (const struct span *) b;
+  if (x->from != y->from) return x->from < y->from ? -1 : 1;
+  if (x->to != y->to) return x->to > y->to ? -1 : 1;
+  return (x->id > y->id) - (x->id < y->id);
+}
+
+int compare_spans_priority(const void * a, const void * b) {
+  const struct span * x = (const struct span *) a;
+  const struct span * y = (const struct span *) b;
+  if (x->id != y->id) return x->id < y->id ? -1 : 1;
+  return compare_spans_leftmost_longest(a, b);
+}
+
+// Keeps the leftmost span, preferring the longest where several start at the
+// same offset, then the next span starting at or after its end, and so on.
+void resolve_spans_leftmost_longest(struct span_buffer * buffer) {
+  qsort(buffer->spans, buffer->count, sizeof(* buffer->spans), compare_spans_leftmost_longest);
+
+  size_t kept = 0;
+  unsigned long long last_to = 0;
+  for (size_t i = 0; i < buffer->count; i++) {
+    if (buffer->spans[i].from >= last_to) {
+      last_to = buffer->spans[i].to;
+      buffer->spans[kept++] = buffer->spans[i];
+    }
+  }
+  buffer->count = kept;
+}
+
+// Keeps spans in order of ascending ID, dropping any that overlap a span
+// already kept, so that lower IDs win. Leaves the kept spans in ascending
+// order of offset.
+void resolve_spans_priority(struct span_buffer * buffer) {
+  qsort(buffer->spans, buffer->count, sizeof(* buffer->spans), compare_spans_priority);
+
+  struct span * kept = malloc((buffer->count ? buffer->count : 1) * sizeof(* kept));
+  size_t num_kept = 0;
+
+  for (size_t i = 0; i < buffer->count; i++) {
+    struct span * span = &buffer->spans[i];
+
+    // Find the first kept span starting at or after this one.
+    size_t low = 0;
+    size_t high = num_kept;
+    while (low < high) {
+      size_t mid = low + (high - low) / 2;
+      if (kept[mid].from < span->from) {
+        low = mid + 1;
+      } else {
+        high = mid;
+      }
+    }
+
+    if (low > 0 && kept[low - 1].to > span->from) continue;
+    if (low < num_kept && kept[low].from < span->to) continue;
+    // Two spans at the same offset overlap even if one is empty.
+    if (low < num_kept && kept[low].from == span->from) continue;
+
+    memmove(&kept[low + 1], &kept[low], (num_kept - low) * sizeof(* kept));
+    kept[low] = *span;
+    num_kept++;
+  }
+
+  free(buffer->spans);
+  buffer->spans = kept;
+  buffer->count = num_kept;
+  buffer->capacity = buffer->count ? buffer->count : 1;
+}
+
+// What a span is replaced with: a fixed binary, or a mask of one byte
+// repeated for the length of the span.
+struct replacement {
+  unsigned int id;
+  ErlNifBinary bin;
+  ERL_NIF_TERM term;
+  int is_mask;
+  unsigned char mask;
+};
+
+struct replacement_table {
+  // Sorted by ID.
+  struct replacement * entries;
+  size_t count;
+  // Used for IDs not in `entries`, or NULL to leave them unreplaced.
+  struct replacement * fallback;
+};
+
+int compare_replacements(const void * a, const void * b) {
+  return compare_uint(&((const struct replacement *) a)->id, &((const struct replacement *) b)->id);
+}
+
+const struct replacement * lookup_replacement(const struct replacement_table * table, unsigned int id) {
+  size_t low = 0;
+  size_t high = table->count;
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    if (table->entries[mid].id < id) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+
+  if (low < table->count && table->entries[low].id == id) {
+    return &table->entries[low];
+  }
+  return table->fallback;
+}
+
+int get_replacement(ErlNifEnv * env, ERL_NIF_TERM term, struct replacement * replacement) {
+  const ERL_NIF_TERM * tuple;
+  int arity;
+  unsigned int mask;
+
+  replacement->term = term;
+  replacement->is_mask = 0;
+
+  if (enif_inspect_binary(env, term, &replacement->bin)) {
+    return 1;
+  }
+
+  if (enif_get_tuple(env, term, &arity, &tuple) &&
+      arity == 2 &&
+      tuple[0] == mask_atom &&
+      enif_get_uint(env, tuple[1], &mask) &&
+      mask <= 255) {
+    replacement->is_mask = 1;
+    replacement->mask = mask;
+    return 1;
+  }
+
+  return 0;
 }
 
-static ERL_NIF_TERM platform_info_to_map_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
-  hs_platform_info_t * platform_info;
+// Reads a map of ID to replacement. The caller frees table->entries.
+int get_replacement_table(ErlNifEnv * env, ERL_NIF_TERM map, struct replacement_table * table) {
+  size_t size;
+  table->entries = NULL;
+  table->count = 0;
+  table->fallback = NULL;
 
-  if (argc != 1 ||
-      !get_platform_info_resource(env, argv[0], &platform_info)) {
-    return enif_make_badarg(env);
+  if (!enif_get_map_size(env, map, &size)) {
+    return 0;
   }
 
-  ERL_NIF_TERM keys[4] = {
-    enif_make_atom(env, "tune"),
-    enif_make_atom(env, "cpu_features"),
-    enif_make_atom(env, "reserved1"),
-    enif_make_atom(env, "reserved2")
-  };
-
-  ERL_NIF_TERM values[4] = {
-    enif_make_int(env, platform_info->tune),
-    enif_make_int64(env, platform_info->cpu_features),
-    enif_make_int64(env, platform_info->reserved1),
-    enif_make_int64(env, platform_info->reserved2)
-  };
+  table->entries = malloc((size ? size : 1) * sizeof(* table->entries));
+
+  ErlNifMapIterator iter;
+  ERL_NIF_TERM key, value;
+  enif_map_iterator_create(env, map, &iter, ERL_NIF_MAP_ITERATOR_FIRST);
+  while (enif_map_iterator_get_pair(env, &iter, &key, &value)) {
+    struct replacement * entry = &table->entries[table->count];
+    if (!enif_get_uint(env, key, &entry->id) ||
+        !get_replacement(env, value, entry)) {
+      enif_map_iterator_destroy(env, &iter);
+      return 0;
+    }
+    table->count++;
+    enif_map_iterator_next(env, &iter);
+  }
+  enif_map_iterator_destroy(env, &iter);
 
-  ERL_NIF_TERM result;
+  qsort(table->entries, table->count, sizeof(* table->entries), compare_replacements);
+  return 1;
+}
 
-  if (!enif_make_map_from_arrays(env, keys, values, 4, &result)) {
-    return enif_make_badarg(env);
+// Drops spans whose ID has no replacement.
+void filter_spans(struct span_buffer * buffer, const struct replacement_table * table) {
+  size_t kept = 0;
+  for (size_t i = 0; i < buffer->count; i++) {
+    if (lookup_replacement(table, buffer->spans[i].id)) {
+      buffer->spans[kept++] = buffer->spans[i];
+    }
   }
+  buffer->count = kept;
+}
 
-  return result;
+size_t replacement_size(const struct replacement * replacement, const struct span * span) {
+  return replacement->is_mask ? span->to - span->from : replacement->bin.size;
 }
 
-static ERL_NIF_TERM valid_platform_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
-  if (argc != 0) {
-    return enif_make_badarg(env);
-  }
+enum replace_result {
+  REPLACE_RESULT_BINARY,
+  REPLACE_RESULT_IODATA,
+};
 
-  hs_error_t error = hs_valid_platform();
+enum replace_overlap {
+  REPLACE_OVERLAP_LEFTMOST_LONGEST,
+  REPLACE_OVERLAP_PRIORITY,
+};
 
-  switch (error) {
-  case HS_SUCCESS:
-    return enif_make_tuple2(env, ok_atom, true_atom);
+struct replace_options {
+  enum replace_result result;
+  enum replace_overlap overlap;
+};
 
-  case HS_ARCH_ERROR:
-    return enif_make_tuple2(env, ok_atom, false_atom);
+int get_replace_options(ErlNifEnv * env, ERL_NIF_TERM list, struct replace_options * options) {
+  options->result = REPLACE_RESULT_BINARY;
+  options->overlap = REPLACE_OVERLAP_LEFTMOST_LONGEST;
 
-  default:
-    return enif_make_tuple2(env, error_atom, error_name_atom(env, error));
+  ERL_NIF_TERM head;
+  const ERL_NIF_TERM * pair;
+  int arity;
+
+  while (enif_get_list_cell(env, list, &head, &list)) {
+    if (!enif_get_tuple(env, head, &arity, &pair) || arity != 2) {
+      return 0;
+    }
+
+    if (pair[0] == result_atom) {
+      if (pair[1] == binary_atom) options->result = REPLACE_RESULT_BINARY;
+      else if (pair[1] == iodata_atom) options->result = REPLACE_RESULT_IODATA;
+      else return 0;
+    } else if (pair[0] == overlap_atom) {
+      if (pair[1] == leftmost_longest_atom) options->overlap = REPLACE_OVERLAP_LEFTMOST_LONGEST;
+      else if (pair[1] == priority_atom) options->overlap = REPLACE_OVERLAP_PRIORITY;
+      else return 0;
+    } else {
+      return 0;
+    }
   }
+
+  return enif_is_empty_list(env, list);
 }
 
-static ERL_NIF_TERM version_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
-  if (argc != 0) {
-    return enif_make_badarg(env);
+// Writes the string with each span replaced. The result size is computed
+// first so that the output is written once, straight into its binary.
+ERL_NIF_TERM replace_spans_binary(ErlNifEnv * env, ErlNifBinary * string, struct span_buffer * buffer, const struct replacement_table * table) {
+  size_t size = string->size;
+  for (size_t i = 0; i < buffer->count; i++) {
+    struct span * span = &buffer->spans[i];
+    size = size - (span->to - span->from) + replacement_size(lookup_replacement(table, span->id), span);
   }
 
-  const char * version = hs_version();
-  return make_binary_const(env, version);
-}
+  ERL_NIF_TERM result;
+  unsigned char * out = enif_make_new_binary(env, size, &result);
+  unsigned long long last_to = 0;
+
+  for (size_t i = 0; i < buffer->count; i++) {
+    struct span * span = &buffer->spans[i];
+    const struct replacement * replacement = lookup_replacement(table, span->id);
+    memcpy(out, string->data + last_to, span->from - last_to);
+    out += span->from - last_to;
+    if (replacement->is_mask) {
+      memset(out, replacement->mask, span->to - span->from);
+    } else {
+      memcpy(out, replacement->bin.data, replacement->bin.size);
+    }
+    out += replacement_size(replacement, span);
+    last_to = span->to;
+  }
+  memcpy(out, string->data + last_to, string->size - last_to);
 
-int bin_equals_string(ErlNifBinary name_bin, const char * string) {
-  return (strlen(string) == name_bin.size)
-      && (0 == memcmp(string, name_bin.data, name_bin.size));
+  return result;
 }
 
-static ERL_NIF_TERM flag_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
-  ErlNifBinary name_bin;
-
-  if (argc != 1 ||
-      !enif_inspect_binary(env, argv[0], &name_bin)) {
-    return enif_make_badarg(env);
+// Returns the result as a list of sub-binaries of the string, interleaved
+// with the replacements. Only masks are written out; nothing else is copied.
+ERL_NIF_TERM replace_spans_iodata(ErlNifEnv * env, ERL_NIF_TERM string_term, ErlNifBinary * string, struct span_buffer * buffer, const struct replacement_table * table) {
+  ERL_NIF_TERM result = enif_make_list(env, 0);
+  unsigned long long next_from = string->size;
+
+  // Built back to front.
+  for (size_t i = buffer->count; i > 0; i--) {
+    struct span * span = &buffer->spans[i - 1];
+    const struct replacement * replacement = lookup_replacement(table, span->id);
+    if (next_from > span->to) {
+      result = enif_make_list_cell(env, enif_make_sub_binary(env, string_term, span->to, next_from - span->to), result);
+    }
+    if (replacement->is_mask) {
+      ERL_NIF_TERM mask;
+      memset(enif_make_new_binary(env, span->to - span->from, &mask), replacement->mask, span->to - span->from);
+      result = enif_make_list_cell(env, mask, result);
+    } else {
+      result = enif_make_list_cell(env, replacement->term, result);
+    }
+    next_from = span->from;
+  }
+  if (next_from > 0) {
+    result = enif_make_list_cell(env, enif_make_sub_binary(env, string_term, 0, next_from), result);
   }
 
-  if (bin_equals_string(name_bin, "HS_FLAG_CASELESS")) return enif_make_int(env, HS_FLAG_CASELESS);
-  if (bin_equals_string(name_bin, "HS_FLAG_DOTALL")) return enif_make_int(env, HS_FLAG_DOTALL);
-  if (bin_equals_string(name_bin, "HS_FLAG_MULTILINE")) return enif_make_int(env, HS_FLAG_MULTILINE);
-  if (bin_equals_string(name_bin, "HS_FLAG_SINGLEMATCH")) return enif_make_int(env, HS_FLAG_SINGLEMATCH);
-  if (bin_equals_string(name_bin, "HS_FLAG_ALLOWEMPTY")) return enif_make_int(env, HS_FLAG_ALLOWEMPTY);
-  if (bin_equals_string(name_bin, "HS_FLAG_UTF8")) return enif_make_int(env, HS_FLAG_UTF8);
-  if (bin_equals_string(name_bin, "HS_FLAG_UCP")) return enif_make_int(env, HS_FLAG_UCP);
-  if (bin_equals_string(name_bin, "HS_FLAG_PREFILTER")) return enif_make_int(env, HS_FLAG_PREFILTER);
-  if (bin_equals_string(name_bin, "HS_FLAG_SOM_LEFTMOST")) return enif_make_int(env, HS_FLAG_SOM_LEFTMOST);
-  if (bin_equals_string(name_bin, "HS_FLAG_COMBINATION")) return enif_make_int(env, HS_FLAG_COMBINATION);
-  if (bin_equals_string(name_bin, "HS_FLAG_QUIET")) return enif_make_int(env, HS_FLAG_QUIET);
-  return enif_make_badarg(env);
+  return result;
 }
 
-static ERL_NIF_TERM mode_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
-  ErlNifBinary name_bin;
+// Shared by replace/5 and replace_multi/5 once their arguments are read.
+ERL_NIF_TERM replace_spans(ErlNifEnv * env, struct database_resource * database_resource, ERL_NIF_TERM string_term, ErlNifBinary * string, struct scratch_arg * scratch_arg, const struct replacement_table * table, struct replace_options * options) {
+  struct span_buffer buffer = {NULL, 0, 0};
 
-  if (argc != 1 ||
-      !enif_inspect_binary(env, argv[0], &name_bin)) {
-    return enif_make_badarg(env);
+  int flags = 0;
+  hs_scratch_t * scratch;
+  hs_error_t error = acquire_scratch(scratch_arg, &scratch);
+  if (error == HS_SUCCESS) {
+    error = instrumented_scan(database_resource, (char *) string->data, string->size, flags, scratch, span_buffer_callback, &buffer);
+    release_scratch(scratch_arg, scratch);
   }
+  consume_timeslice(env, string->size);
 
-  if (bin_equals_string(name_bin, "HS_MODE_BLOCK")) return enif_make_int(env, HS_MODE_BLOCK);
-  if (bin_equals_string(name_bin, "HS_MODE_NOSTREAM")) return enif_make_int(env, HS_MODE_NOSTREAM);
-  if (bin_equals_string(name_bin, "HS_MODE_STREAM")) return enif_make_int(env, HS_MODE_STREAM);
-  if (bin_equals_string(name_bin, "HS_MODE_VECTORED")) return enif_make_int(env, HS_MODE_VECTORED);
-  if (bin_equals_string(name_bin, "HS_MODE_SOM_HORIZON_LARGE")) return enif_make_int(env, HS_MODE_SOM_HORIZON_LARGE);
-  if (bin_equals_string(name_bin, "HS_MODE_SOM_HORIZON_MEDIUM")) return enif_make_int(env, HS_MODE_SOM_HORIZON_MEDIUM);
-  if (bin_equals_string(name_bin, "HS_MODE_SOM_HORIZON_SMALL")) return enif_make_int(env, HS_MODE_SOM_HORIZON_SMALL);
-  return enif_make_badarg(env);
-}
-
-ERL_NIF_TERM compile_error_to_term(ErlNifEnv * env, hs_compile_error_t * compile_error) {
-  ERL_NIF_TERM message = make_binary_const(env, compile_error->message);
-  ERL_NIF_TERM expression_id = enif_make_int(env, compile_error->expression);
-  hs_error_t error = hs_free_compile_error(compile_error);
+  ERL_NIF_TERM term;
 
   switch (error) {
   case HS_SUCCESS:
+    filter_spans(&buffer, table);
+    if (options->overlap == REPLACE_OVERLAP_PRIORITY) {
+      resolve_spans_priority(&buffer);
+    } else {
+      resolve_spans_leftmost_longest(&buffer);
+    }
+    if (options->result == REPLACE_RESULT_IODATA) {
+      term = replace_spans_iodata(env, string_term, string, &buffer, table);
+    } else {
+      term = replace_spans_binary(env, string, &buffer, table);
+    }
+    term = enif_make_tuple2(env, ok_atom, term);
     break;
 
   default:
-    printf("hs_free_compile_error failed with %s\r\n", error_name(error));
+    term = enif_make_tuple2(env, error_atom, error_name_atom(env, error));
     break;
   }
 
-  return enif_make_tuple2(env, error_atom, enif_make_tuple2(env, message, expression_id));
+  free(buffer.spans);
+  return term;
 }
 
-static ERL_NIF_TERM compile_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
-  ErlNifBinary expression_bin;
-  unsigned int flags;
-  unsigned int mode;
-  hs_platform_info_t * maybe_platform_info;
+static ERL_NIF_TERM replace_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  struct database_resource * database_resource;
+  ErlNifBinary string;
+  struct replacement replacement;
+  struct scratch_arg scratch_arg;
+  struct replace_options options;
 
-  if (argc != 4 ||
-      !enif_inspect_binary(env, argv[0], &expression_bin) ||
-      !enif_get_uint(env, argv[1], &flags) ||
-      !enif_get_uint(env, argv[2], &mode) ||
-      !maybe_get_platform_info_resource(env, argv[3], &maybe_platform_info)) {
+  if (argc != 5 ||
+      !get_database_resource_struct(env, argv[0], &database_resource) ||
+      !enif_inspect_binary(env, argv[1], &string) ||
+      !enif_inspect_binary(env, argv[2], &replacement.bin) ||
+      !get_scratch_arg(env, argv[3], &scratch_arg) ||
+      !get_replace_options(env, argv[4], &options)) {
     return enif_make_badarg(env);
   }
 
-  // Expression must be null terminated.
-  char * expression = malloc(expression_bin.size + 1);
-  memcpy(expression, expression_bin.data, expression_bin.size);
-  expression[expression_bin.size] = 0;
-
-  // printf("expression: %s\r\n", expression);
-  // printf("flags: %i\r\n", flags);
-  // printf("mode: %i\r\n", mode);
-  // printf("platform_info: %p\r\n", platform_info);
-
-  hs_database_t * db;
-  hs_compile_error_t * compile_error;
-  hs_error_t error = hs_compile(expression, flags, mode, maybe_platform_info, &db, &compile_error);
-  free(expression);
+  if (should_schedule_dirty(string.size)) {
+    return enif_schedule_nif(env, "replace", ERL_NIF_DIRTY_JOB_CPU_BOUND, replace_nif, argc, argv);
+  }
 
-  switch (error) {
-  case HS_SUCCESS:
-    return enif_make_tuple2(env, ok_atom, make_database_resource(env, db));
+  replacement.term = argv[2];
+  replacement.is_mask = 0;
+  struct replacement_table table = {NULL, 0, &replacement};
+  return replace_spans(env, database_resource, argv[1], &string, &scratch_arg, &table, &options);
+}
 
-  case HS_COMPILER_ERROR:
-    return compile_error_to_term(env, compile_error);
+static ERL_NIF_TERM replace_multi_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  struct database_resource * database_resource;
+  ErlNifBinary string;
+  struct replacement_table table;
+  struct scratch_arg scratch_arg;
+  struct replace_options options;
 
-  default:
-    return enif_make_tuple2(env, error_atom, error_name_atom(env, error));
+  if (argc != 5 ||
+      !get_database_resource_struct(env, argv[0], &database_resource) ||
+      !enif_inspect_binary(env, argv[1], &string) ||
+      !get_scratch_arg(env, argv[3], &scratch_arg) ||
+      !get_replace_options(env, argv[4], &options)) {
+    return enif_make_badarg(env);
   }
-}
-
-static ERL_NIF_TERM compile_multi_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
-  ERL_NIF_TERM result;
 
-  unsigned int num_expressions;
-  unsigned int num_flags;
-  unsigned int num_ids;
-  unsigned int mode;
-  hs_platform_info_t * maybe_platform_info;
+  if (!get_replacement_table(env, argv[2], &table)) {
+    free(table.entries);
+    return enif_make_badarg(env);
+  }
 
-  if (argc != 5 ||
-      !enif_get_list_length(env, argv[0], &num_expressions) ||
-      !enif_get_list_length(env, argv[1], &num_flags) ||
-      !enif_get_list_length(env, argv[2], &num_ids) ||
-      num_expressions != num_flags ||
-      num_expressions != num_ids ||
-      !enif_get_uint(env, argv[3], &mode) ||
-      !maybe_get_platform_info_resource(env, argv[4], &maybe_platform_info)) {
-    result = enif_make_badarg(env);
-    goto compile_multi_nif_return;
+  if (should_schedule_dirty(string.size)) {
+    free(table.entries);
+    return enif_schedule_nif(env, "replace_multi", ERL_NIF_DIRTY_JOB_CPU_BOUND, replace_multi_nif, argc, argv);
   }
 
-  ErlNifBinary expression_bin;
-  char ** expression_array = calloc(num_expressions, sizeof(* expression_array));
-  unsigned int * flags_array = calloc(num_flags, sizeof(* flags_array));
-  unsigned int * id_array = calloc(num_ids, sizeof(* id_array));
+  ERL_NIF_TERM result = replace_spans(env, database_resource, argv[1], &string, &scratch_arg, &table, &options);
+  free(table.entries);
+  return result;
+}
 
-  ERL_NIF_TERM expression_head, expression_tail = argv[0];
-  ERL_NIF_TERM flags_head, flags_tail = argv[1];
-  ERL_NIF_TERM ids_head, ids_tail = argv[2];
+static ERL_NIF_TERM match_vectored_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  struct database_resource * database_resource;
+  struct scan_vector vector;
+  struct scratch_arg scratch_arg;
 
-  for (int i = 0; i < num_expressions; i++) {
-    if (!enif_get_list_cell(env, expression_tail, &expression_head, &expression_tail) ||
-        !enif_get_list_cell(env, flags_tail, &flags_head, &flags_tail) ||
-        !enif_get_list_cell(env, ids_tail, &ids_head, &ids_tail) ||
-        !enif_inspect_binary(env, expression_head, &expression_bin) ||
-        !enif_get_uint(env, flags_head, &flags_array[i]) ||
-        !enif_get_uint(env, ids_head, &id_array[i])) {
-      result = enif_make_badarg(env);
-      goto compile_multi_nif_free_and_return;
-    }
-    expression_array[i] = null_terminate(expression_bin);
+  if (argc != 3 ||
+      !get_database_resource_struct(env, argv[0], &database_resource) ||
+      !get_scratch_arg(env, argv[2], &scratch_arg) ||
+      !get_scan_vector(env, argv[1], &vector)) {
+    return enif_make_badarg(env);
   }
 
-  // Sanity check.
-  if (!enif_is_empty_list(env, expression_tail) ||
-      !enif_is_empty_list(env, flags_tail) ||
-      !enif_is_empty_list(env, ids_tail)) {
-    result = enif_make_badarg(env);
-    goto compile_multi_nif_free_and_return;
+  if (should_schedule_dirty(vector.size)) {
+    free_scan_vector(&vector);
+    return enif_schedule_nif(env, "match_vectored", ERL_NIF_DIRTY_JOB_CPU_BOUND, match_vectored_nif, argc, argv);
   }
 
-  hs_database_t * db;
-  hs_compile_error_t * compile_error;
-  hs_error_t error = hs_compile_multi((const char *const *) expression_array, flags_array, id_array, num_expressions, mode, maybe_platform_info, &db, &compile_error);
+  int flags = 0;
+  void * context = NULL;
+  hs_scratch_t * scratch;
+  hs_error_t error = acquire_scratch(&scratch_arg, &scratch);
+  if (error == HS_SUCCESS) {
+    error = instrumented_scan_vector(database_resource, vector.data, vector.length, vector.count, vector.size, flags, scratch, match_callback, context);
+    release_scratch(&scratch_arg, scratch);
+  }
+  consume_timeslice(env, vector.size);
+  free_scan_vector(&vector);
 
   switch (error) {
   case HS_SUCCESS:
-    result = enif_make_tuple2(env, ok_atom, make_database_resource(env, db));
-    break;
+    return enif_make_tuple2(env, ok_atom, false_atom);
 
-  case HS_COMPILER_ERROR:
-    result = compile_error_to_term(env, compile_error);
-    break;
+  case HS_SCAN_TERMINATED:
+    return enif_make_tuple2(env, ok_atom, true_atom);
 
   default:
-    result = enif_make_tuple2(env, error_atom, error_name_atom(env, error));
-    break;
-  }
-
-compile_multi_nif_free_and_return:
-  for (int i = 0; i < num_expressions; i++) {
-    if (expression_array[i])
-      free(expression_array[i]);
+    return enif_make_tuple2(env, error_atom, error_name_atom(env, error));
   }
-  free(expression_array);
-  free(flags_array);
-  free(id_array);
-
-compile_multi_nif_return:
-  return result;
 }
 
-ERL_NIF_TERM expr_info_to_map(ErlNifEnv * env, hs_expr_info_t * expr_info) {
-  ERL_NIF_TERM keys[5] = {
-    enif_make_atom(env, "min_width"),
-    enif_make_atom(env, "max_width"),
-    enif_make_atom(env, "unordered_matches"),
-    enif_make_atom(env, "matches_at_eod"),
-    enif_make_atom(env, "matches_only_at_eod"),
-  };
-
-  ERL_NIF_TERM values[5] = {
-    enif_make_uint(env, expr_info->min_width),
-    enif_make_uint(env, expr_info->max_width),
-    expr_info->unordered_matches ? true_atom : false_atom,
-    expr_info->matches_at_eod ? true_atom : false_atom,
-    expr_info->matches_only_at_eod ? true_atom : false_atom,
-  };
-
+struct match_tuples_context {
+  ErlNifEnv * env;
   ERL_NIF_TERM result;
+};
+
+int match_tuples_callback(unsigned int id, unsigned long long from, unsigned long long to, unsigned int flags, void * void_context) {
+  struct match_tuples_context * context = (struct match_tuples_context *) void_context;
+  ERL_NIF_TERM match = enif_make_tuple3(context->env,
+    enif_make_uint(context->env, id),
+    enif_make_uint64(context->env, from),
+    enif_make_uint64(context->env, to));
+  context->result = enif_make_list_cell(context->env, match, context->result);
+  return 0;
+}
 
-  if (!enif_make_map_from_arrays(env, keys, values, 5, &result)) {
-    return enif_make_badarg(env);
-  }
+void init_match_tuples_context(ErlNifEnv * env, struct match_tuples_context * context) {
+  context->env = env;
+  context->result = enif_make_list(env, 0);
+}
 
+// Returns the collected matches in the order Hyperscan reported them.
+ERL_NIF_TERM match_tuples_result(struct match_tuples_context * context) {
+  ERL_NIF_TERM result;
+  enif_make_reverse_list(context->env, context->result, &result);
   return result;
 }
 
-static ERL_NIF_TERM expression_info_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
-  ErlNifBinary expression_bin;
-  unsigned int flags;
+static ERL_NIF_TERM match_multi_vectored_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  struct database_resource * database_resource;
+  struct scan_vector vector;
+  struct scratch_arg scratch_arg;
 
-  if (argc != 2 ||
-      !enif_inspect_binary(env, argv[0], &expression_bin) ||
-      !enif_get_uint(env, argv[1], &flags)) {
+  if (argc != 3 ||
+      !get_database_resource_struct(env, argv[0], &database_resource) ||
+      !get_scratch_arg(env, argv[2], &scratch_arg) ||
+      !get_scan_vector(env, argv[1], &vector)) {
     return enif_make_badarg(env);
   }
 
-  // Expression must be null terminated.
-  char * expression = null_terminate(expression_bin);
+  if (should_schedule_dirty(vector.size)) {
+    free_scan_vector(&vector);
+    return enif_schedule_nif(env, "match_multi_vectored", ERL_NIF_DIRTY_JOB_CPU_BOUND, match_multi_vectored_nif, argc, argv);
+  }
 
-  hs_expr_info_t * expr_info;
-  hs_compile_error_t * compile_error;
-  hs_error_t error = hs_expression_info(expression, flags, &expr_info, &compile_error);
-  free(expression);
+  struct match_tuples_context context;
+  init_match_tuples_context(env, &context);
+
+  int flags = 0;
+  hs_scratch_t * scratch;
+  hs_error_t error = acquire_scratch(&scratch_arg, &scratch);
+  if (error == HS_SUCCESS) {
+    error = instrumented_scan_vector(database_resource, vector.data, vector.length, vector.count, vector.size, flags, scratch, match_tuples_callback, &context);
+    release_scratch(&scratch_arg, scratch);
+  }
+  consume_timeslice(env, vector.size);
+  free_scan_vector(&vector);
 
   switch (error) {
   case HS_SUCCESS:
-    return enif_make_tuple2(env, ok_atom, expr_info_to_map(env, expr_info));
-
-  case HS_COMPILER_ERROR:
-    return compile_error_to_term(env, compile_error);
+    return enif_make_tuple2(env, ok_atom, match_tuples_result(&context));
 
   default:
     return enif_make_tuple2(env, error_atom, error_name_atom(env, error));
   }
 }
 
-static ERL_NIF_TERM database_info_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
-  hs_database_t * db;
+static ERL_NIF_TERM open_stream_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  struct database_resource * database_resource;
 
   if (argc != 1 ||
-      !get_database_resource(env, argv[0], &db)) {
+      !get_database_resource_struct(env, argv[0], &database_resource)) {
     return enif_make_badarg(env);
   }
 
-  char * info;
-  hs_error_t error = hs_database_info(db, &info);
+  hs_stream_t * stream;
+  int flags = 0;
+  hs_error_t error = hs_open_stream(database_resource->db, flags, &stream);
 
   switch (error) {
   case HS_SUCCESS:
-    break;
+    return enif_make_tuple2(env, ok_atom, make_stream_resource(env, stream, database_resource));
 
   default:
     return enif_make_tuple2(env, error_atom, error_name_atom(env, error));
   }
-
-  ERL_NIF_TERM result = enif_make_tuple2(env, ok_atom, make_binary_const(env, info));
-  free(info);
-  return result;
 }
 
-static ERL_NIF_TERM database_size_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
-  hs_database_t * db;
+static ERL_NIF_TERM scan_stream_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  struct stream_resource * stream_resource;
+  ErlNifBinary string;
+  struct scratch_arg scratch_arg;
 
-  if (argc != 1 ||
-      !get_database_resource(env, argv[0], &db)) {
+  if (argc != 3 ||
+      !get_stream_resource(env, argv[0], &stream_resource) ||
+      !enif_inspect_binary(env, argv[1], &string) ||
+      !get_scratch_arg(env, argv[2], &scratch_arg)) {
     return enif_make_badarg(env);
   }
 
-  size_t database_size;
-  hs_error_t error = hs_database_size(db, &database_size);
+  if (should_schedule_dirty(string.size)) {
+    return enif_schedule_nif(env, "scan_stream", ERL_NIF_DIRTY_JOB_CPU_BOUND, scan_stream_nif, argc, argv);
+  }
+
+  if (!lock_stream_resource(stream_resource)) {
+    return enif_make_tuple2(env, error_atom, enif_make_atom(env, "stream_in_use"));
+  }
+
+  if (!stream_resource->stream) {
+    unlock_stream_resource(stream_resource);
+    return enif_make_tuple2(env, error_atom, enif_make_atom(env, "stream_closed"));
+  }
+
+  struct match_tuples_context context;
+  init_match_tuples_context(env, &context);
+
+  int flags = 0;
+  hs_scratch_t * scratch;
+  hs_error_t error = acquire_scratch(&scratch_arg, &scratch);
+  if (error == HS_SUCCESS) {
+    error = instrumented_scan_stream(stream_resource->database_resource, stream_resource->stream, (char *) string.data, string.size, flags, scratch, match_tuples_callback, &context);
+    release_scratch(&scratch_arg, scratch);
+  }
+  unlock_stream_resource(stream_resource);
+  consume_timeslice(env, string.size);
 
   switch (error) {
   case HS_SUCCESS:
-    return enif_make_tuple2(env, ok_atom, enif_make_uint64(env, database_size));
+    return enif_make_tuple2(env, ok_atom, match_tuples_result(&context));
 
   default:
     return enif_make_tuple2(env, error_atom, error_name_atom(env, error));
   }
 }
 
-static ERL_NIF_TERM serialize_database_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
-  hs_database_t * db;
+static ERL_NIF_TERM reset_stream_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  struct stream_resource * stream_resource;
+  struct scratch_arg scratch_arg;
 
-  if (argc != 1 ||
-      !get_database_resource(env, argv[0], &db)) {
+  if (argc != 2 ||
+      !get_stream_resource(env, argv[0], &stream_resource) ||
+      !maybe_get_scratch_arg(env, argv[1], &scratch_arg)) {
     return enif_make_badarg(env);
   }
 
-  char * data;
-  size_t size;
-  hs_error_t error = hs_serialize_database(db, &data, &size);
-  ERL_NIF_TERM result;
-  unsigned char * data2 = enif_make_new_binary(env, size, &result);
-  memcpy(data2, data, size);
-  free(data);
+  if (!lock_stream_resource(stream_resource)) {
+    return enif_make_tuple2(env, error_atom, enif_make_atom(env, "stream_in_use"));
+  }
+
+  if (!stream_resource->stream) {
+    unlock_stream_resource(stream_resource);
+    return enif_make_tuple2(env, error_atom, enif_make_atom(env, "stream_closed"));
+  }
+
+  struct match_tuples_context context;
+  init_match_tuples_context(env, &context);
+
+  // Without a scratch, end-of-data matches are discarded.
+  int flags = 0;
+  hs_scratch_t * maybe_scratch;
+  hs_error_t error = acquire_scratch(&scratch_arg, &maybe_scratch);
+  if (error == HS_SUCCESS) {
+    struct stats_trampoline trampoline;
+    void * void_context = &context;
+    match_event_handler on_event = instrument_callback(stream_resource->database_resource, &trampoline, maybe_scratch ? match_tuples_callback : NULL, &void_context);
+    error = hs_reset_stream(stream_resource->stream, flags, maybe_scratch, on_event, void_context);
+    release_scratch(&scratch_arg, maybe_scratch);
+  }
+  unlock_stream_resource(stream_resource);
 
   switch (error) {
   case HS_SUCCESS:
-    return enif_make_tuple2(env, ok_atom, result);
+    return enif_make_tuple2(env, ok_atom, match_tuples_result(&context));
 
   default:
     return enif_make_tuple2(env, error_atom, error_name_atom(env, error));
   }
 }
 
-static ERL_NIF_TERM deserialize_database_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
-  ErlNifBinary binary;
+static ERL_NIF_TERM close_stream_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  struct stream_resource * stream_resource;
+  struct scratch_arg scratch_arg;
 
-  if (argc != 1 ||
-      !enif_inspect_binary(env, argv[0], &binary)) {
+  if (argc != 2 ||
+      !get_stream_resource(env, argv[0], &stream_resource) ||
+      !maybe_get_scratch_arg(env, argv[1], &scratch_arg)) {
     return enif_make_badarg(env);
   }
 
-  hs_database_t * db;
-  hs_error_t error = hs_deserialize_database((char *) binary.data, binary.size, &db);
+  if (!lock_stream_resource(stream_resource)) {
+    return enif_make_tuple2(env, error_atom, enif_make_atom(env, "stream_in_use"));
+  }
+
+  if (!stream_resource->stream) {
+    unlock_stream_resource(stream_resource);
+    return enif_make_tuple2(env, error_atom, enif_make_atom(env, "stream_closed"));
+  }
+
+  struct match_tuples_context context;
+  init_match_tuples_context(env, &context);
+
+  // On failure Hyperscan leaves the stream open, e.g. for a bad scratch.
+  hs_scratch_t * maybe_scratch;
+  hs_error_t error = acquire_scratch(&scratch_arg, &maybe_scratch);
+  if (error == HS_SUCCESS) {
+    struct stats_trampoline trampoline;
+    void * void_context = &context;
+    match_event_handler on_event = instrument_callback(stream_resource->database_resource, &trampoline, maybe_scratch ? match_tuples_callback : NULL, &void_context);
+    error = hs_close_stream(stream_resource->stream, maybe_scratch, on_event, void_context);
+    release_scratch(&scratch_arg, maybe_scratch);
+  }
+  if (error == HS_SUCCESS) {
+    stream_resource->stream = NULL;
+  }
+  unlock_stream_resource(stream_resource);
 
   switch (error) {
   case HS_SUCCESS:
-    return enif_make_tuple2(env, ok_atom, make_database_resource(env, db));
+    return enif_make_tuple2(env, ok_atom, match_tuples_result(&context));
 
   default:
     return enif_make_tuple2(env, error_atom, error_name_atom(env, error));
   }
 }
 
-static ERL_NIF_TERM alloc_scratch_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
-  hs_database_t * db;
+static ERL_NIF_TERM compress_stream_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  struct stream_resource * stream_resource;
 
   if (argc != 1 ||
-      !get_database_resource(env, argv[0], &db)) {
+      !get_stream_resource(env, argv[0], &stream_resource)) {
     return enif_make_badarg(env);
   }
 
-  hs_scratch_t * scratch = NULL;
+  if (!lock_stream_resource(stream_resource)) {
+    return enif_make_tuple2(env, error_atom, enif_make_atom(env, "stream_in_use"));
+  }
 
-  hs_error_t error = hs_alloc_scratch(db, &scratch);
+  if (!stream_resource->stream) {
+    unlock_stream_resource(stream_resource);
+    return enif_make_tuple2(env, error_atom, enif_make_atom(env, "stream_closed"));
+  }
+
+  // A first call with no buffer reports the space required.
+  size_t size;
+  hs_error_t error = hs_compress_stream(stream_resource->stream, NULL, 0, &size);
+  if (error != HS_INSUFFICIENT_SPACE) {
+    unlock_stream_resource(stream_resource);
+    return enif_make_tuple2(env, error_atom, error_name_atom(env, error));
+  }
+
+  ERL_NIF_TERM result;
+  unsigned char * data = enif_make_new_binary(env, size, &result);
+  error = hs_compress_stream(stream_resource->stream, (char *) data, size, &size);
+  unlock_stream_resource(stream_resource);
 
   switch (error) {
   case HS_SUCCESS:
-    return enif_make_tuple2(env, ok_atom, make_scratch_resource(env, scratch));
+    return enif_make_tuple2(env, ok_atom, result);
 
   default:
     return enif_make_tuple2(env, error_atom, error_name_atom(env, error));
   }
 }
 
-static ERL_NIF_TERM realloc_scratch_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
-  hs_database_t * db;
-  hs_scratch_t * scratch;
+static ERL_NIF_TERM expand_stream_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  struct database_resource * database_resource;
+  ErlNifBinary binary;
 
   if (argc != 2 ||
-      !get_database_resource(env, argv[0], &db) ||
-      !get_scratch_resource(env, argv[1], &scratch)) {
+      !get_database_resource_struct(env, argv[0], &database_resource) ||
+      !enif_inspect_binary(env, argv[1], &binary)) {
     return enif_make_badarg(env);
   }
 
-  hs_error_t error = hs_alloc_scratch(db, &scratch);
+  hs_stream_t * stream = NULL;
+  hs_error_t error = hs_expand_stream(database_resource->db, &stream, (char *) binary.data, binary.size);
 
   switch (error) {
   case HS_SUCCESS:
-    return ok_atom;
+    return enif_make_tuple2(env, ok_atom, make_stream_resource(env, stream, database_resource));
 
   default:
     return enif_make_tuple2(env, error_atom, error_name_atom(env, error));
   }
 }
 
-static ERL_NIF_TERM clone_scratch_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
-  hs_scratch_t * scratch;
+static ERL_NIF_TERM reset_and_expand_stream_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  struct stream_resource * stream_resource;
+  ErlNifBinary binary;
+  struct scratch_arg scratch_arg;
 
-  if (argc != 1 ||
-      !get_scratch_resource(env, argv[0], &scratch)) {
+  if (argc != 3 ||
+      !get_stream_resource(env, argv[0], &stream_resource) ||
+      !enif_inspect_binary(env, argv[1], &binary) ||
+      !maybe_get_scratch_arg(env, argv[2], &scratch_arg)) {
     return enif_make_badarg(env);
   }
 
-  hs_scratch_t * scratch2;
-  hs_error_t error = hs_clone_scratch(scratch, &scratch2);
+  if (!lock_stream_resource(stream_resource)) {
+    return enif_make_tuple2(env, error_atom, enif_make_atom(env, "stream_in_use"));
+  }
+
+  if (!stream_resource->stream) {
+    unlock_stream_resource(stream_resource);
+    return enif_make_tuple2(env, error_atom, enif_make_atom(env, "stream_closed"));
+  }
+
+  struct match_tuples_context context;
+  init_match_tuples_context(env, &context);
+
+  hs_scratch_t * maybe_scratch;
+  hs_error_t error = acquire_scratch(&scratch_arg, &maybe_scratch);
+  if (error == HS_SUCCESS) {
+    struct stats_trampoline trampoline;
+    void * void_context = &context;
+    match_event_handler on_event = instrument_callback(stream_resource->database_resource, &trampoline, maybe_scratch ? match_tuples_callback : NULL, &void_context);
+    error = hs_reset_and_expand_stream(stream_resource->stream, (char *) binary.data, binary.size, maybe_scratch, on_event, void_context);
+    release_scratch(&scratch_arg, maybe_scratch);
+  }
+  unlock_stream_resource(stream_resource);
 
   switch (error) {
   case HS_SUCCESS:
-    return enif_make_tuple2(env, ok_atom, make_scratch_resource(env, scratch2));
+    return enif_make_tuple2(env, ok_atom, match_tuples_result(&context));
 
   default:
     return enif_make_tuple2(env, error_atom, error_name_atom(env, error));
   }
 }
 
-static ERL_NIF_TERM scratch_size_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
-  hs_scratch_t * scratch;
-
-  if (argc != 1 ||
-      !get_scratch_resource(env, argv[0], &scratch)) {
+static ERL_NIF_TERM chimera_enabled_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  if (argc != 0) {
     return enif_make_badarg(env);
   }
 
-  size_t scratch_size;
-  hs_error_t error = hs_scratch_size(scratch, &scratch_size);
+#ifdef HYPERSCAN_CHIMERA
+  return true_atom;
+#else
+  return false_atom;
+#endif
+}
 
-  switch (error) {
-  case HS_SUCCESS:
-    return enif_make_tuple2(env, ok_atom, enif_make_uint64(env, scratch_size));
+#ifdef HYPERSCAN_CHIMERA
+static ERL_NIF_TERM ch_compile_multi_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  ERL_NIF_TERM result;
 
-  default:
-    return enif_make_tuple2(env, error_atom, error_name_atom(env, error));
+  unsigned int num_expressions;
+  unsigned int num_flags;
+  unsigned int num_ids;
+  unsigned int mode;
+  hs_platform_info_t * maybe_platform_info;
+
+  if (argc != 5 ||
+      !enif_get_list_length(env, argv[0], &num_expressions) ||
+      !enif_get_list_length(env, argv[1], &num_flags) ||
+      !enif_get_list_length(env, argv[2], &num_ids) ||
+      num_expressions != num_flags ||
+      num_expressions != num_ids ||
+      !enif_get_uint(env, argv[3], &mode) ||
+      !maybe_get_platform_info_resource(env, argv[4], &maybe_platform_info)) {
+    result = enif_make_badarg(env);
+    goto ch_compile_multi_nif_return;
   }
-}
 
-int match_callback(unsigned int id, unsigned long long from, unsigned long long to, unsigned int flags, void *context) {
-  return 1;
-}
+  ErlNifBinary expression_bin;
+  char ** expression_array = calloc(num_expressions, sizeof(* expression_array));
+  unsigned int * flags_array = calloc(num_flags, sizeof(* flags_array));
+  unsigned int * id_array = calloc(num_ids, sizeof(* id_array));
 
-static ERL_NIF_TERM match_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
-  hs_database_t * db;
-  ErlNifBinary string;
-  hs_scratch_t * scratch;
+  ERL_NIF_TERM expression_head, expression_tail = argv[0];
+  ERL_NIF_TERM flags_head, flags_tail = argv[1];
+  ERL_NIF_TERM ids_head, ids_tail = argv[2];
 
-  if (argc != 3 ||
-      !get_database_resource(env, argv[0], &db) ||
-      !enif_inspect_binary(env, argv[1], &string) ||
-      !get_scratch_resource(env, argv[2], &scratch)) {
-    return enif_make_badarg(env);
+  for (int i = 0; i < num_expressions; i++) {
+    if (!enif_get_list_cell(env, expression_tail, &expression_head, &expression_tail) ||
+        !enif_get_list_cell(env, flags_tail, &flags_head, &flags_tail) ||
+        !enif_get_list_cell(env, ids_tail, &ids_head, &ids_tail) ||
+        !enif_inspect_binary(env, expression_head, &expression_bin) ||
+        !enif_get_uint(env, flags_head, &flags_array[i]) ||
+        !enif_get_uint(env, ids_head, &id_array[i])) {
+      result = enif_make_badarg(env);
+      goto ch_compile_multi_nif_free_and_return;
+    }
+    expression_array[i] = null_terminate(expression_bin);
   }
 
-  int flags = 0;
-  void * context = NULL;
-  hs_error_t error = hs_scan(db, (char *) string.data, string.size, flags, scratch, match_callback, context);
+  ch_database_t * db;
+  ch_compile_error_t * compile_error;
+  ch_error_t error = ch_compile_multi((const char *const *) expression_array, flags_array, id_array, num_expressions, mode, maybe_platform_info, &db, &compile_error);
 
   switch (error) {
-  case HS_SUCCESS:
-    return enif_make_tuple2(env, ok_atom, false_atom);
+  case CH_SUCCESS:
+    result = enif_make_tuple2(env, ok_atom, make_ch_database_resource(env, db));
+    break;
 
-  case HS_SCAN_TERMINATED:
-    return enif_make_tuple2(env, ok_atom, true_atom);
+  case CH_COMPILER_ERROR: {
+    ERL_NIF_TERM message = make_binary_const(env, compile_error->message);
+    ERL_NIF_TERM expression_id = enif_make_int(env, compile_error->expression);
+    ch_free_compile_error(compile_error);
+    result = enif_make_tuple2(env, error_atom, enif_make_tuple2(env, message, expression_id));
+    break;
+  }
 
   default:
-    return enif_make_tuple2(env, error_atom, error_name_atom(env, error));
+    result = enif_make_tuple2(env, error_atom, ch_error_name_atom(env, error));
+    break;
   }
-}
 
-struct match_multi_context {
-  ErlNifEnv * env;
-  ERL_NIF_TERM result;
-};
+ch_compile_multi_nif_free_and_return:
+  for (int i = 0; i < num_expressions; i++) {
+    if (expression_array[i])
+      free(expression_array[i]);
+  }
+  free(expression_array);
+  free(flags_array);
+  free(id_array);
 
-int match_multi_callback(unsigned int id, unsigned long long from, unsigned long long to, unsigned int flags, void * void_context) {
-  struct match_multi_context * context = (struct match_multi_context *) void_context;
-  ERL_NIF_TERM id_term = enif_make_uint(context->env, id);
-  context->result = enif_make_list_cell(context->env, id_term, context->result);
-  return 0;
+ch_compile_multi_nif_return:
+  return result;
 }
 
-static ERL_NIF_TERM match_multi_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
-  hs_database_t * db;
-  ErlNifBinary string;
-  hs_scratch_t * scratch;
+static ERL_NIF_TERM ch_alloc_scratch_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  ch_database_t * db;
 
-  if (argc != 3 ||
-      !get_database_resource(env, argv[0], &db) ||
-      !enif_inspect_binary(env, argv[1], &string) ||
-      !get_scratch_resource(env, argv[2], &scratch)) {
+  if (argc != 1 ||
+      !get_ch_database_resource(env, argv[0], &db)) {
     return enif_make_badarg(env);
   }
 
-  struct match_multi_context context;
-  context.env = env;
-  context.result = enif_make_list(env, 0);
-  void * void_context = &context;
-
-  int flags = 0;
-  hs_error_t error = hs_scan(db, (char *) string.data, string.size, flags, scratch, match_multi_callback, void_context);
+  ch_scratch_t * scratch = NULL;
+  ch_error_t error = ch_alloc_scratch(db, &scratch);
 
   switch (error) {
-  case HS_SUCCESS:
-    return enif_make_tuple2(env, ok_atom, context.result);
+  case CH_SUCCESS:
+    return enif_make_tuple2(env, ok_atom, make_ch_scratch_resource(env, scratch));
 
   default:
-    return enif_make_tuple2(env, error_atom, error_name_atom(env, error));
+    return enif_make_tuple2(env, error_atom, ch_error_name_atom(env, error));
   }
 }
 
-struct replace_context {
+struct ch_scan_context {
   ErlNifEnv * env;
-  ERL_NIF_TERM string;
-  ERL_NIF_TERM replacement;
   ERL_NIF_TERM result;
-  uint64_t last_to;
+  // The first PCRE match or recursion limit hit, if any.
+  ch_error_event_t limit;
 };
 
-int replace_callback(unsigned int id, unsigned long long from, unsigned long long to, unsigned int flags, void * void_context) {
-  struct replace_context * context = (struct replace_context *) void_context;
-  assert(from >= context->last_to);
-  if (from > context->last_to) {
-    context->result = enif_make_list_cell(context->env, context->result, enif_make_sub_binary(context->env, context->string, context->last_to, from - context->last_to));
+ch_callback_t ch_scan_callback(unsigned int id, unsigned long long from, unsigned long long to, unsigned int flags, unsigned int size, const ch_capture_t * captured, void * void_context) {
+  struct ch_scan_context * context = (struct ch_scan_context *) void_context;
+  ErlNifEnv * env = context->env;
+
+  // Groups that did not take part in the match are nil.
+  ERL_NIF_TERM captures = enif_make_list(env, 0);
+  for (unsigned int i = size; i > 0; i--) {
+    const ch_capture_t * capture = &captured[i - 1];
+    ERL_NIF_TERM term = nil_atom;
+    if (capture->flags == CH_CAPTURE_FLAG_ACTIVE) {
+      term = enif_make_tuple2(env, enif_make_uint64(env, capture->from), enif_make_uint64(env, capture->to));
+    }
+    captures = enif_make_list_cell(env, term, captures);
   }
-  context->last_to = to;
-  context->result = enif_make_list_cell(context->env, context->result, context->replacement);
-  return 0;
+
+  ERL_NIF_TERM match = enif_make_tuple4(env, enif_make_uint(env, id), enif_make_uint64(env, from), enif_make_uint64(env, to), captures);
+  context->result = enif_make_list_cell(env, match, context->result);
+  return CH_CALLBACK_CONTINUE;
 }
 
-static ERL_NIF_TERM replace_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
-  hs_database_t * db;
+ch_callback_t ch_scan_error_callback(ch_error_event_t error_type, unsigned int id, void * info, void * void_context) {
+  struct ch_scan_context * context = (struct ch_scan_context *) void_context;
+  if (!context->limit) {
+    context->limit = error_type;
+  }
+  return CH_CALLBACK_SKIP_PATTERN;
+}
+
+static ERL_NIF_TERM ch_scan_nif(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[]) {
+  ch_database_t * db;
   ErlNifBinary string;
-  ErlNifBinary replacement;
-  hs_scratch_t * scratch;
+  ch_scratch_t * scratch;
 
-  if (argc != 4 ||
-      !get_database_resource(env, argv[0], &db) ||
+  if (argc != 3 ||
+      !get_ch_database_resource(env, argv[0], &db) ||
       !enif_inspect_binary(env, argv[1], &string) ||
-      !enif_inspect_binary(env, argv[2], &replacement) ||
-      !get_scratch_resource(env, argv[3], &scratch)) {
+      !get_ch_scratch_resource(env, argv[2], &scratch)) {
     return enif_make_badarg(env);
   }
 
-  struct replace_context context;
-  context.env = env;
-  context.string = argv[1];
-  context.replacement = argv[2];
-  context.result = enif_make_list(env, 0);
-  context.last_to = 0;
-  void * void_context = &context;
+  if (should_schedule_dirty(string.size)) {
+    return enif_schedule_nif(env, "ch_scan", ERL_NIF_DIRTY_JOB_CPU_BOUND, ch_scan_nif, argc, argv);
+  }
 
+  struct ch_scan_context context = {env, enif_make_list(env, 0), 0};
   int flags = 0;
-  hs_error_t error = hs_scan(db, (char *) string.data, string.size, flags, scratch, replace_callback, void_context);
+  ch_error_t error = ch_scan(db, (char *) string.data, string.size, flags, scratch, ch_scan_callback, ch_scan_error_callback, &context);
+  consume_timeslice(env, string.size);
 
   switch (error) {
-  case HS_SUCCESS:
+  case CH_SUCCESS:
     break;
 
   default:
-    return enif_make_tuple2(env, error_atom, error_name_atom(env, error));
+    return enif_make_tuple2(env, error_atom, ch_error_name_atom(env, error));
   }
 
-  if (string.size > context.last_to) {
-    context.result = enif_make_list_cell(env, context.result, enif_make_sub_binary(env, context.string, context.last_to, string.size - context.last_to));
+  // A pattern that hit a PCRE limit stopped matching, so its results are
+  // incomplete.
+  if (context.limit == CH_ERROR_MATCHLIMIT) {
+    return enif_make_tuple2(env, error_atom, enif_make_atom(env, "CH_ERROR_MATCHLIMIT"));
+  }
+  if (context.limit == CH_ERROR_RECURSIONLIMIT) {
+    return enif_make_tuple2(env, error_atom, enif_make_atom(env, "CH_ERROR_RECURSIONLIMIT"));
   }
 
-  ErlNifBinary result_bin;
-  assert(enif_inspect_iolist_as_binary(env, context.result, &result_bin));
-  return enif_make_tuple2(env, ok_atom, enif_make_binary(env, &result_bin));
+  ERL_NIF_TERM result;
+  enif_make_reverse_list(env, context.result, &result);
+  return enif_make_tuple2(env, ok_atom, result);
 }
+#endif
 
 static ErlNifFunc nif_funcs[] = {
+#ifdef HYPERSCAN_CHIMERA
+  {"ch_compile_multi", 5, ch_compile_multi_nif, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+  {"ch_alloc_scratch", 1, ch_alloc_scratch_nif},
+  {"ch_scan", 3, ch_scan_nif},
+#endif
   {"populate_platform", 0, populate_platform_nif},
   {"platform_info_to_map", 1, platform_info_to_map_nif},
+  {"make_platform", 2, make_platform_nif},
+  {"tune", 1, tune_nif},
+  {"cpu_feature", 1, cpu_feature_nif},
   {"valid_platform", 0, valid_platform_nif},
   {"version", 0, version_nif},
+  {"chimera_enabled", 0, chimera_enabled_nif},
+  {"dirty_scan_threshold", 0, dirty_scan_threshold_nif},
+  {"set_dirty_scan_threshold", 1, set_dirty_scan_threshold_nif},
+  {"memory_stats", 0, memory_stats_nif},
   {"flag", 1, flag_nif},
   {"mode", 1, mode_nif},
-  {"compile", 4, compile_nif},
-  {"compile_multi", 5, compile_multi_nif},
+  {"compile", 4, compile_nif, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+  {"compile_multi", 5, compile_multi_nif, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+  {"compile_ext_multi", 6, compile_ext_multi_nif, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+  {"compile_literals", 5, compile_literals_nif, ERL_NIF_DIRTY_JOB_CPU_BOUND},
   {"expression_info", 2, expression_info_nif},
   {"database_info", 1, database_info_nif},
   {"database_size", 1, database_size_nif},
+  {"set_database_stats", 2, set_database_stats_nif},
+  {"reset_database_stats", 1, reset_database_stats_nif},
+  {"database_stats", 1, database_stats_nif},
   {"serialize_database", 1, serialize_database_nif},
   {"deserialize_database", 1, deserialize_database_nif},
+  {"deserialize_database", 2, deserialize_database_nif},
+  {"deserialize_database_at", 1, deserialize_database_at_nif},
+  {"deserialize_database_file", 1, deserialize_database_file_nif, ERL_NIF_DIRTY_JOB_IO_BOUND},
+  {"serialized_database_info", 1, serialized_database_info_nif},
+  {"serialized_database_size", 1, serialized_database_size_nif},
   {"alloc_scratch", 1, alloc_scratch_nif},
   {"realloc_scratch", 2, realloc_scratch_nif},
+  {"new_ruleset", 1, new_ruleset_nif},
+  {"swap_ruleset", 2, swap_ruleset_nif},
+  {"pin_ruleset", 1, pin_ruleset_nif},
   {"clone_scratch", 1, clone_scratch_nif},
   {"scratch_size", 1, scratch_size_nif},
   {"match", 3, match_nif},
   {"match_multi", 3, match_multi_nif},
-  {"replace", 4, replace_nif},
+  {"match_multi_batch", 3, match_multi_batch_nif},
+  {"alloc_scratch_pool", 1, alloc_scratch_pool_nif},
+  {"alloc_batch_pool", 1, alloc_batch_pool_nif},
+  {"match_multi_parallel", 2, match_multi_parallel_nif, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+  {"compile_sharded", 5, compile_sharded_nif, ERL_NIF_DIRTY_JOB_IO_BOUND},
+  {"recompile_sharded", 4, recompile_sharded_nif, ERL_NIF_DIRTY_JOB_IO_BOUND},
+  {"pin_sharded_database", 1, pin_sharded_database_nif},
+  {"match_multi_sharded", 2, match_multi_sharded_nif},
+  {"scan", 4, scan_nif},
+  {"replace", 5, replace_nif},
+  {"replace_multi", 5, replace_multi_nif},
+  {"match_vectored", 3, match_vectored_nif},
+  {"match_multi_vectored", 3, match_multi_vectored_nif},
+  {"open_stream", 1, open_stream_nif},
+  {"scan_stream", 3, scan_stream_nif},
+  {"reset_stream", 2, reset_stream_nif},
+  {"close_stream", 2, close_stream_nif},
+  {"compress_stream", 1, compress_stream_nif},
+  {"expand_stream", 2, expand_stream_nif},
+  {"reset_and_expand_stream", 3, reset_and_expand_stream_nif},
 };
 
 int load(ErlNifEnv * env, void ** priv_data, ERL_NIF_TERM load_info) {
   init_atoms(env);
 
-  if (!open_platform_info_resource_type(env) ||
+  if (!init_allocators() ||
+      !open_platform_info_resource_type(env) ||
       !open_database_resource_type(env) ||
-      !open_scratch_resource_type(env)) {
+      !open_serialized_resource_type(env) ||
+      !open_scratch_resource_type(env) ||
+      !open_stream_resource_type(env) ||
+      !open_scratch_pool_resource_type(env) ||
+      !open_ruleset_resource_type(env) ||
+#ifdef HYPERSCAN_CHIMERA
+      !open_ch_resource_types(env) ||
+#endif
+      !open_batch_pool_resource_type(env) ||
+      !open_sharded_database_resource_type(env) ||
+      !init_workers()) {
     return 1;
   }
 
   return 0;
 }
 
-ERL_NIF_INIT(Elixir.Hyperscan, nif_funcs, load, NULL, NULL, NULL)
+void unload(ErlNifEnv * env, void * priv_data) {
+  stop_workers();
+}
+
+ERL_NIF_INIT(Elixir.Hyperscan, nif_funcs, load, NULL, NULL, unload)
@@ -0,0 +1,57 @@
+defmodule Hyperscan.CacheTest do
+  alias Hyperscan.Cache
+  import Hyperscan
+  use ExUnit.Case
+
+  doctest Hyperscan.Cache
+
+  @tag :tmp_dir
+  test "compile_multi", %{tmp_dir: dir} do
+    mode = mode("HS_MODE_BLOCK")
+    path = Cache.path(dir, ["foo", "bar"], [0, 0], [1, 2], mode)
+    refute File.exists?(path)
+
+    {:ok, db} = Cache.compile_multi(dir, ["foo", "bar"], [0, 0], [1, 2], mode)
+    assert File.exists?(path)
+    assert Path.wildcard(Path.join(dir, "*.tmp")) == []
+    {:ok, serialized} = serialize_database(db)
+    assert File.read!(path) == serialized
+
+    {:ok, db} = Cache.compile_multi(dir, ["foo", "bar"], [0, 0], [1, 2], mode)
+    {:ok, scratch} = alloc_scratch(db)
+    assert match_multi(db, "foo", scratch) == {:ok, [1]}
+
+    assert Cache.path(dir, ["foo", "bar"], [0, 0], [1, 3], mode) != path
+  end
+
+  @tag :tmp_dir
+  test "compile_multi recompiles a corrupt file", %{tmp_dir: dir} do
+    mode = mode("HS_MODE_BLOCK")
+    path = Cache.path(dir, ["foo"], [0], [1], mode)
+    File.write!(path, "garbage")
+
+    {:ok, db} = Cache.compile_multi(dir, ["foo"], [0], [1], mode)
+    {:ok, scratch} = alloc_scratch(db)
+    assert match_multi(db, "foo", scratch) == {:ok, [1]}
+    assert {:ok, _} = serialized_database_info(File.read!(path))
+  end
+
+  @tag :tmp_dir
+  test "compile_multi loads databases with their IDs", %{tmp_dir: dir} do
+    mode = mode("HS_MODE_BLOCK")
+    {:ok, _} = Cache.compile_multi(dir, ["a", "b"], [0, 0], [1, 2], mode)
+    {:ok, db} = Cache.compile_multi(dir, ["a", "b"], [0, 0], [1, 2], mode)
+    {:ok, scratch} = alloc_scratch(db)
+
+    :ok = set_database_stats(db, true)
+    {:ok, _} = match_multi(db, "ab", scratch)
+    {:ok, stats} = database_stats(db)
+    assert stats.patterns == %{1 => 1, 2 => 1}
+  end
+
+  @tag :tmp_dir
+  test "compile_multi returns compile errors", %{tmp_dir: dir} do
+    assert {:error, {_, 0}} = Cache.compile_multi(dir, ["("], [0], [1], mode("HS_MODE_BLOCK"))
+    assert File.ls!(dir) == []
+  end
+end
@@ -0,0 +1,64 @@
+defmodule Hyperscan.PrefilterTest do
+  alias Hyperscan.Prefilter
+  import Hyperscan
+  use ExUnit.Case
+
+  doctest Hyperscan.Prefilter
+
+  test "compile and scan" do
+    expressions = ["foo", "(a+)b\\1", "(?i)(x)y\\1", "bar"]
+    {:ok, prefilter} = Prefilter.compile(expressions, [0, 0, 0, flag("HS_FLAG_CASELESS")], [10, 20, 30, 10])
+    assert Prefilter.prefiltered_ids(prefilter) == [20, 30]
+
+    {:ok, scratch} = alloc_scratch(prefilter.db)
+    assert Prefilter.scan(prefilter, "BAR foo", scratch) == {:ok, [{10, 0, 3}, {10, 0, 7}]}
+    assert Prefilter.scan(prefilter, "zabaz", scratch) == {:ok, [{20, 1, 4}]}
+    assert Prefilter.scan(prefilter, "aaab aab", scratch) == {:ok, []}
+    assert Prefilter.scan(prefilter, "XyX xyz", scratch) == {:ok, [{30, 0, 3}]}
+    assert Prefilter.scan(prefilter, "abb xyy", scratch) == {:ok, []}
+  end
+
+  test "single match reports the first verified match" do
+    single = flag("HS_FLAG_SINGLEMATCH")
+    {:ok, prefilter} = Prefilter.compile(["(a+)b\\1"], [single], [1])
+    {:ok, scratch} = alloc_scratch(prefilter.db)
+
+    # The prefiltered form is looser than the expression, so "aab" is a
+    # candidate that :re rejects ahead of the true matches.
+    assert Prefilter.scan(prefilter, "aab abz aba aabaa", scratch) == {:ok, [{1, 8, 11}]}
+    assert Prefilter.scan(prefilter, "aab", scratch) == {:ok, []}
+  end
+
+  test "lookback bounds the check of unbounded expressions" do
+    string = "a" <> String.duplicate("x", 100) <> "ba"
+    {:ok, bounded} = Prefilter.compile(["(a)x+b\\1"], [0], [1], lookback: 50)
+    {:ok, unbounded} = Prefilter.compile(["(a)x+b\\1"], [0], [1], lookback: :infinity)
+    assert Prefilter.prefiltered_ids(bounded) == [1]
+
+    {:ok, scratch} = alloc_scratch(bounded.db)
+    assert Prefilter.scan(bounded, string, scratch) == {:ok, []}
+    {:ok, scratch} = alloc_scratch(unbounded.db)
+    assert Prefilter.scan(unbounded, string, scratch) == {:ok, [{1, 0, 103}]}
+  end
+
+  test "lookback starts on a character boundary in UTF-8 input" do
+    string = String.duplicate("é", 10) <> "x" <> String.duplicate("é", 10)
+    utf8 = flag("HS_FLAG_UTF8")
+    {:ok, bounded} = Prefilter.compile(["(é+)x\\1"], [utf8], [1], lookback: 5)
+    {:ok, unbounded} = Prefilter.compile(["(é+)x\\1"], [utf8], [1], lookback: :infinity)
+    assert Prefilter.prefiltered_ids(bounded) == [1]
+
+    # Most windows start inside an "é", and must back up to its first byte.
+    {:ok, scratch} = alloc_scratch(bounded.db)
+    assert Prefilter.scan(bounded, string, scratch) == {:ok, [{1, 18, 23}]}
+    {:ok, scratch} = alloc_scratch(unbounded.db)
+    {:ok, matches} = Prefilter.scan(unbounded, string, scratch)
+    assert List.last(matches) == {1, 0, 41}
+  end
+
+  test "compile errors" do
+    assert {:error, {_, 1}} = Prefilter.compile(["foo", "("], [0, 0], [1, 2])
+    assert {:ok, prefilter} = Prefilter.compile(["foo"], [0], [1])
+    assert Prefilter.prefiltered_ids(prefilter) == []
+  end
+end
@@ -0,0 +1,66 @@
+defmodule Hyperscan.VariantsTest do
+  alias Hyperscan.Variants
+  import Hyperscan
+  use ExUnit.Case
+
+  doctest Hyperscan.Variants
+
+  setup do
+    generic = tune("HS_TUNE_FAMILY_GENERIC")
+    hsw = tune("HS_TUNE_FAMILY_HSW")
+    skx = tune("HS_TUNE_FAMILY_SKX")
+    avx2 = cpu_feature("HS_CPU_FEATURES_AVX2")
+    avx512 = Bitwise.bor(avx2, cpu_feature("HS_CPU_FEATURES_AVX512"))
+    {:ok, targets: [{generic, 0}, {hsw, avx2}, {skx, avx512}], generic: generic, hsw: hsw, skx: skx, avx2: avx2, avx512: avx512}
+  end
+
+  test "build", %{targets: targets} do
+    {:ok, variants} = Variants.build(["foo", "bar"], [0, 0], [1, 2], mode("HS_MODE_BLOCK"), targets)
+    assert Enum.map(variants, &{&1.tune, &1.cpu_features}) == targets
+
+    for variant <- variants do
+      {:ok, info} = serialized_database_info(variant.database)
+      assert info =~ "Mode: BLOCK"
+    end
+
+    {:ok, platform} = make_platform(0, 0)
+    {:ok, [variant]} = Variants.build(["foo"], [0], [1], mode("HS_MODE_BLOCK"), [platform])
+    assert %{tune: 0, cpu_features: 0} = variant
+
+    assert {:error, {_message, 1}} = Variants.build(["foo", "("], [0, 0], [1, 2], mode("HS_MODE_BLOCK"), targets)
+  end
+
+  test "select", %{targets: targets} = context do
+    {:ok, variants} = Variants.build(["foo"], [0], [1], mode("HS_MODE_BLOCK"), targets)
+
+    pick = fn tune, cpu_features ->
+      {:ok, platform} = make_platform(tune, cpu_features)
+      {:ok, variant} = Variants.select(variants, platform)
+      {variant.tune, variant.cpu_features}
+    end
+
+    assert pick.(context.generic, 0) == {context.generic, 0}
+    assert pick.(context.hsw, context.avx2) == {context.hsw, context.avx2}
+    assert pick.(context.skx, context.avx512) == {context.skx, context.avx512}
+
+    # Features outrank tuning, and tuning breaks ties.
+    assert pick.(context.generic, context.avx512) == {context.skx, context.avx512}
+    {:ok, tuned} = Variants.build(["foo"], [0], [1], mode("HS_MODE_BLOCK"), [{context.generic, 0}, {context.skx, 0}])
+    {:ok, platform} = make_platform(context.skx, context.avx2)
+    assert {:ok, %{tune: tune}} = Variants.select(tuned, platform)
+    assert tune == context.skx
+
+    {:ok, platform} = make_platform(context.generic, 0)
+    assert Variants.select(tl(variants), platform) == {:error, :no_compatible_variant}
+    assert Variants.select([], platform) == {:error, :no_compatible_variant}
+  end
+
+  test "load picks the variant for this host", %{targets: targets} do
+    {:ok, variants} = Variants.build(["foo"], [0], [1], mode("HS_MODE_BLOCK"), targets)
+    {:ok, local} = populate_platform()
+    {:ok, expected} = Variants.select(variants, local)
+    {:ok, db} = Variants.load(variants)
+    {:ok, serialized} = serialize_database(db)
+    assert serialized == expected.database
+  end
+end
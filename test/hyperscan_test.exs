@@ -77,6 +77,24 @@ defmodule HyperscanTest do
     {:ok, _size} = scratch_size(scratch)
   end
 
+  test "scratch pool" do
+    {:ok, db} = compile_multi(["a", "b"], [0, 0], [1, 2], mode("HS_MODE_BLOCK"))
+    {:ok, pool} = alloc_scratch_pool(db)
+    assert match(db, "abc", pool) == {:ok, true}
+    assert match_multi(db, "abc", pool) == {:ok, [2, 1]}
+    assert scan(db, "abc", pool, result: :tuples) == {:ok, [{1, 0, 1}, {2, 0, 2}]}
+    assert match_multi_batch(db, ["a", "b"], pool) == {:ok, [[1], [2]]}
+
+    input = String.duplicate("ab", 100_000)
+
+    results =
+      1..32
+      |> Enum.map(fn _ -> Task.async(fn -> scan(db, input, pool, unique: true) end) end)
+      |> Enum.map(&Task.await/1)
+
+    assert Enum.uniq(results) == [{:ok, [1, 2]}]
+  end
+
   test "match" do
     {:ok, db} = compile("a", 0, mode("HS_MODE_BLOCK"))
     {:ok, scratch} = alloc_scratch(db)
@@ -92,10 +110,480 @@ defmodule HyperscanTest do
     assert match_multi(db, "xyz", scratch) == {:ok, []}
   end
 
+  test "memory_stats" do
+    {:ok, db} = compile_multi(["foo", "bar"], [0, 0], [1, 2], mode("HS_MODE_STREAM"))
+    {:ok, size} = database_size(db)
+    {:ok, scratch} = alloc_scratch(db)
+    {:ok, stream} = open_stream(db)
+
+    stats = memory_stats()
+    assert Map.keys(stats) == [:database, :misc, :scratch, :stream]
+    assert stats.database.bytes >= size
+    assert stats.database.count >= 1
+    assert stats.scratch.count >= 1
+    assert stats.stream.count >= 1
+
+    {:ok, _} = serialize_database(db)
+    {:ok, _} = database_info(db)
+    assert scan_stream(stream, "foo", scratch) == {:ok, [{1, 0, 3}]}
+  end
+
+  test "dirty_scan_threshold" do
+    default = dirty_scan_threshold()
+    assert is_integer(default)
+
+    {:ok, db} = compile("a", flag("HS_FLAG_SOM_LEFTMOST"), mode("HS_MODE_BLOCK"))
+    {:ok, scratch} = alloc_scratch(db)
+
+    try do
+      :ok = set_dirty_scan_threshold(0)
+      assert dirty_scan_threshold() == 0
+      assert match(db, "abc", scratch) == {:ok, true}
+      assert match_multi(db, "abc", scratch) == {:ok, [0]}
+      assert replace(db, "abab", "A", scratch) == {:ok, "AbAb"}
+    after
+      set_dirty_scan_threshold(default)
+    end
+  end
+
+  test "match_multi_batch" do
+    {:ok, db} = compile_multi(["a", "b"], [0, 0], [1, 2], mode("HS_MODE_BLOCK"))
+    {:ok, scratch} = alloc_scratch(db)
+    assert match_multi_batch(db, [], scratch) == {:ok, []}
+    assert match_multi_batch(db, ["abc", "ayz", "xyz"], scratch) == {:ok, [[2, 1], [1], []]}
+
+    strings = for i <- 1..100_000, do: if(rem(i, 2) == 0, do: "xa", else: "xy")
+    {:ok, results} = match_multi_batch(db, strings, scratch)
+    assert results == Enum.map(strings, fn string -> elem(match_multi(db, string, scratch), 1) end)
+
+    default = dirty_scan_threshold()
+
+    try do
+      :ok = set_dirty_scan_threshold(2)
+      assert match_multi_batch(db, ["a", "ab", "b"], scratch) == {:ok, [[1], [2, 1], [2]]}
+    after
+      set_dirty_scan_threshold(default)
+    end
+
+    assert_raise ArgumentError, fn -> match_multi_batch(db, ["a", :b], scratch) end
+    assert_raise ArgumentError, fn -> match_multi_batch(db, "a", scratch) end
+  end
+
+  test "match_multi_parallel" do
+    {:ok, db} = compile_multi(["a", "b"], [0, 0], [1, 2], mode("HS_MODE_BLOCK"))
+    {:ok, scratch} = alloc_scratch(db)
+    {:ok, pool} = alloc_batch_pool(db)
+
+    await = fn ref ->
+      receive do
+        {:hyperscan_batch, ^ref, result} -> result
+      after
+        5000 -> flunk("no reply")
+      end
+    end
+
+    {:ok, ref} = match_multi_parallel(pool, [])
+    assert await.(ref) == {:ok, []}
+
+    {:ok, ref} = match_multi_parallel(pool, ["abc", "ayz", "xyz"])
+    assert await.(ref) == {:ok, [[2, 1], [1], []]}
+
+    {:ok, ref} = match_multi_parallel(pool, "abc\n\nxyz")
+    assert await.(ref) == {:ok, [[2, 1], [], []]}
+
+    strings = for i <- 1..50_000, do: String.duplicate("x", rem(i, 100)) <> Enum.at(["a", "b", "c"], rem(i, 3))
+    refs = for _ <- 1..4, do: elem(match_multi_parallel(pool, strings), 1)
+    {:ok, expected} = match_multi_batch(db, strings, scratch)
+    for ref <- refs, do: assert(await.(ref) == {:ok, expected})
+
+    {:ok, ref} = match_multi_parallel(pool, Enum.join(strings, "\n"))
+    assert await.(ref) == {:ok, expected}
+
+    assert_raise ArgumentError, fn -> match_multi_parallel(pool, ["a", :b]) end
+  end
+
+  test "sharded databases" do
+    ids = Enum.to_list(1..200)
+    exprs = Enum.map(ids, &"w#{&1}x")
+    flags = List.duplicate(0, 200)
+    {:ok, sharded} = compile_sharded(exprs, flags, ids, mode("HS_MODE_BLOCK"), 8)
+
+    {generation, dbs} = pin_sharded_database(sharded)
+    assert length(dbs) == 8
+    {:ok, found} = match_multi_sharded(sharded, "w5x w17x w5x")
+    assert Enum.sort(found) == [5, 5, 17]
+    assert match_multi_sharded(sharded, "nothing") == {:ok, []}
+
+    # Changing one rule recompiles only its shard.
+    exprs = List.replace_at(exprs, 16, "v17x")
+    {:ok, [shard]} = recompile_sharded(sharded, exprs, flags, ids)
+    {new_generation, new_dbs} = pin_sharded_database(sharded)
+    assert new_generation == generation + 1
+    for {{db, new_db}, i} <- Enum.with_index(Enum.zip(dbs, new_dbs)), i != shard, do: assert(db == new_db)
+    assert match_multi_sharded(sharded, "w5x w17x v17x") |> elem(1) |> Enum.sort() == [5, 17]
+
+    assert recompile_sharded(sharded, exprs, flags, ids) == {:ok, []}
+
+    # A failed recompile keeps the old rules.
+    assert {:error, {_message, 3}} = recompile_sharded(sharded, List.replace_at(exprs, 3, "("), flags, ids)
+    assert match_multi_sharded(sharded, "w4x") == {:ok, [4]}
+
+    results =
+      1..8
+      |> Enum.map(fn _ ->
+        Task.async(fn ->
+          for _ <- 1..100, do: match_multi_sharded(sharded, "w4x")
+        end)
+      end)
+
+    {:ok, _} = recompile_sharded(sharded, List.replace_at(exprs, 0, "u1x"), flags, ids)
+    assert results |> Enum.flat_map(&Task.await/1) |> Enum.uniq() == [{:ok, [4]}]
+
+    assert_raise ArgumentError, fn -> compile_sharded(exprs, flags, ids, mode("HS_MODE_BLOCK"), 0) end
+    assert_raise ArgumentError, fn -> recompile_sharded(sharded, [:a], [0], [1]) end
+  end
+
+  test "scan" do
+    flags = flag("HS_FLAG_SOM_LEFTMOST")
+    {:ok, db} = compile_multi(["a", "bc"], [flags, flags], [1, 2], mode("HS_MODE_BLOCK"))
+    {:ok, scratch} = alloc_scratch(db)
+    assert scan(db, "abca", scratch) == {:ok, [1, 2, 1]}
+    assert scan(db, "abca", scratch, result: :ids) == {:ok, [1, 2, 1]}
+    assert scan(db, "abca", scratch, result: :tuples) == {:ok, [{1, 0, 1}, {2, 1, 3}, {1, 3, 4}]}
+    assert scan(db, "xyz", scratch, result: :tuples) == {:ok, []}
+
+    {:ok, packed} = scan(db, "abca", scratch, result: :packed)
+    assert byte_size(packed) == 60
+    assert <<1::32-native, 1::64-native, 3::64-native>> == binary_part(packed, 20, 20)
+    assert scan(db, "xyz", scratch, result: :packed) == {:ok, ""}
+
+    input = String.duplicate("a", 10_000)
+    {:ok, packed} = scan(db, input, scratch, result: :packed)
+    assert byte_size(packed) == 10_000 * 20
+
+    assert_raise ArgumentError, fn -> scan(db, "a", scratch, result: :maps) end
+    assert_raise ArgumentError, fn -> scan(db, "a", scratch, bogus: true) end
+  end
+
+  test "scan unique" do
+    {:ok, db} = compile_multi(["a", "b"], [0, 0], [1, 2], mode("HS_MODE_BLOCK"))
+    {:ok, scratch} = alloc_scratch(db)
+    input = String.duplicate("ab", 10_000)
+    assert scan(db, input, scratch, unique: true) == {:ok, [1, 2]}
+    assert scan(db, input, scratch, unique: true, result: :tuples) == {:ok, [{1, 0, 1}, {2, 0, 2}]}
+    assert scan(db, "bbb", scratch, unique: true) == {:ok, [2]}
+
+    # Sparse IDs and IDs shared by several expressions.
+    {:ok, db} = compile_multi(["a", "b", "c"], [0, 0, 0], [1000, 7, 1000], mode("HS_MODE_BLOCK"))
+    {:ok, scratch} = alloc_scratch(db)
+    assert scan(db, "cabcab", scratch, unique: true) == {:ok, [1000, 7]}
+
+    # IDs are unknown after deserializing.
+    {:ok, binary} = serialize_database(db)
+    {:ok, db} = deserialize_database(binary)
+    :ok = realloc_scratch(db, scratch)
+    assert scan(db, "cabcab", scratch, unique: true) == {:ok, [1000, 7]}
+  end
+
+  test "scan stop_on" do
+    {:ok, db} = compile_multi(["a", "b", "c"], [0, 0, 0], [1, 2, 3], mode("HS_MODE_BLOCK"))
+    {:ok, scratch} = alloc_scratch(db)
+    assert scan(db, "abcabc", scratch, stop_on: :all) == {:ok, [1, 2, 3]}
+    assert scan(db, "aabbc", scratch, stop_on: :all, unique: true) == {:ok, [1, 2, 3]}
+    assert scan(db, "abab", scratch, stop_on: :all) == {:ok, [1, 2, 1, 2]}
+    assert scan(db, "aabca", scratch, stop_on: [2, 3]) == {:ok, [1, 1, 2]}
+    assert scan(db, "aaa", scratch, stop_on: []) == {:ok, [1, 1, 1]}
+
+    {:ok, binary} = serialize_database(db)
+    {:ok, db} = deserialize_database(binary)
+    :ok = realloc_scratch(db, scratch)
+    assert scan(db, "abcabc", scratch, stop_on: :all) == {:ok, [1, 2, 3, 1, 2, 3]}
+
+    assert_raise ArgumentError, fn -> scan(db, "a", scratch, stop_on: [:a]) end
+  end
+
+  test "match_vectored" do
+    {:ok, db} = compile("abc", 0, mode("HS_MODE_VECTORED"))
+    {:ok, scratch} = alloc_scratch(db)
+    assert match_vectored(db, "abc", scratch) == {:ok, true}
+    assert match_vectored(db, ["a", [?b, []], "c"], scratch) == {:ok, true}
+    assert match_vectored(db, [[[?a] | "b"] | "c"], scratch) == {:ok, true}
+    assert match_vectored(db, ["ab", "", "x", "c"], scratch) == {:ok, false}
+    assert match_vectored(db, [], scratch) == {:ok, false}
+    assert_raise ArgumentError, fn -> match_vectored(db, [256], scratch) end
+    assert_raise ArgumentError, fn -> match_vectored(db, [:a], scratch) end
+  end
+
+  test "match_multi_vectored" do
+    {:ok, db} = compile_multi(["a", "b"], [0, 0], [1, 2], mode("HS_MODE_VECTORED"))
+    {:ok, scratch} = alloc_scratch(db)
+    assert match_multi_vectored(db, ["x", [?a, ?b]], scratch) == {:ok, [{1, 0, 2}, {2, 0, 3}]}
+    assert match_multi_vectored(db, ["xyz"], scratch) == {:ok, []}
+  end
+
+  test "compile_ext_multi" do
+    mode = mode("HS_MODE_BLOCK")
+
+    {:ok, db} = compile_ext_multi(["abc", "xyz"], [0, 0], [1, 2], [%{min_offset: 5}, %{hamming_distance: 1}], mode)
+    {:ok, scratch} = alloc_scratch(db)
+    assert match_multi(db, "abc", scratch) == {:ok, []}
+    assert match_multi(db, "--abc", scratch) == {:ok, [1]}
+    assert match_multi(db, "xqz", scratch) == {:ok, [2]}
+
+    {:ok, db} = compile_ext_multi(["a+"], [0], [1], [%{min_length: 3, max_offset: 10}], mode)
+    {:ok, scratch} = alloc_scratch(db)
+    assert match(db, "aa", scratch) == {:ok, false}
+    assert match(db, "aaa", scratch) == {:ok, true}
+
+    assert_raise ArgumentError, fn -> compile_ext_multi(["a"], [0], [1], [%{bogus: 1}], mode) end
+    assert_raise ArgumentError, fn -> compile_ext_multi(["a"], [0], [1], [], mode) end
+    assert {:error, {_, 0}} = compile_ext_multi(["a"], [0], [1], [%{min_offset: 5, max_offset: 1}], mode)
+  end
+
+  test "compile_literals" do
+    mode = mode("HS_MODE_BLOCK")
+
+    {:ok, db} = compile_literals(["foo", <<0, ?x>>, "(bar)"], 0, [10, 20, 30], mode)
+    {:ok, scratch} = alloc_scratch(db)
+    assert match_multi(db, <<"a foo ", 0, "x">>, scratch) == {:ok, [20, 10]}
+    assert match_multi(db, "(bar)", scratch) == {:ok, [30]}
+    assert match_multi(db, "bar", scratch) == {:ok, []}
+
+    packed = pack_literals(["foo", "bar"])
+    caseless = flag("HS_FLAG_CASELESS")
+    {:ok, db} = compile_literals(packed, [caseless, 0], nil, mode)
+    {:ok, scratch} = alloc_scratch(db)
+    assert match_multi(db, "FOO BAR bar", scratch) == {:ok, [1, 1, 0]}
+
+    assert_raise ArgumentError, fn -> compile_literals(["a"], [0, 0], nil, mode) end
+    assert_raise ArgumentError, fn -> compile_literals(["a"], 0, [1, 2], mode) end
+    assert_raise ArgumentError, fn -> compile_literals(<<0, 0, 0, 5, ?a>>, 0, nil, mode) end
+  end
+
   test "replace" do
     {:ok, db} = compile("a", flag("HS_FLAG_SOM_LEFTMOST"), mode("HS_MODE_BLOCK"))
     {:ok, scratch} = alloc_scratch(db)
     assert replace(db, "abab", "A", scratch) == {:ok, "AbAb"}
     assert replace(db, "baba", "A", scratch) == {:ok, "bAbA"}
+    assert replace(db, "xyz", "A", scratch) == {:ok, "xyz"}
+    assert replace(db, "", "A", scratch) == {:ok, ""}
+    assert replace(db, "aaa", "", scratch) == {:ok, ""}
+    assert replace(db, "abab", "A", scratch, result: :binary) == {:ok, "AbAb"}
+    assert replace(db, "abab", "A", scratch, result: :iodata) == {:ok, ["A", "b", "A", "b"]}
+    assert replace(db, "xyz", "A", scratch, result: :iodata) == {:ok, ["xyz"]}
+    assert_raise ArgumentError, fn -> replace(db, "a", "A", scratch, result: :list) end
+
+    input = String.duplicate("xa", 100_000)
+    {:ok, iodata} = replace(db, input, "yy", scratch, result: :iodata)
+    assert IO.iodata_to_binary(iodata) == String.duplicate("xyy", 100_000)
+  end
+
+  test "replace resolves overlaps leftmost-longest" do
+    {:ok, db} = compile("a+", flag("HS_FLAG_SOM_LEFTMOST"), mode("HS_MODE_BLOCK"))
+    {:ok, scratch} = alloc_scratch(db)
+    assert replace(db, "baaab", "X", scratch) == {:ok, "bXb"}
+    assert replace(db, "baaab", "X", scratch, result: :iodata) == {:ok, ["b", "X", "b"]}
+  end
+
+  test "replace_multi" do
+    som = flag("HS_FLAG_SOM_LEFTMOST")
+    {:ok, db} = compile_multi(["abc", "bcd", "b"], [som, som, som], [1, 2, 0], mode("HS_MODE_BLOCK"))
+    {:ok, scratch} = alloc_scratch(db)
+
+    assert replace_multi(db, "xabcdx", %{1 => "1", 2 => "2"}, scratch) == {:ok, "x1dx"}
+    assert replace_multi(db, "xabcdx", %{2 => "2"}, scratch) == {:ok, "xa2x"}
+    assert replace_multi(db, "xabcdx", %{0 => "0", 1 => "1", 2 => "2"}, scratch) == {:ok, "x1dx"}
+    assert replace_multi(db, "xabcdx", %{0 => "0", 1 => "1", 2 => "2"}, scratch, overlap: :priority) == {:ok, "xa0cdx"}
+    assert replace_multi(db, "xabcdx", %{0 => "0", 2 => "2"}, scratch) == {:ok, "xa2x"}
+    assert replace_multi(db, "xabcdx", %{1 => {:mask, ?*}}, scratch) == {:ok, "x***dx"}
+    assert replace_multi(db, "xabcdx", %{1 => {:mask, ?*}}, scratch, result: :iodata) == {:ok, ["x", "***", "dx"]}
+    assert replace_multi(db, "xabcdx", %{}, scratch) == {:ok, "xabcdx"}
+    assert_raise ArgumentError, fn -> replace_multi(db, "x", %{1 => {:mask, 256}}, scratch) end
+    assert_raise ArgumentError, fn -> replace_multi(db, "x", %{1 => 2}, scratch) end
+    assert_raise ArgumentError, fn -> replace_multi(db, "x", %{}, scratch, overlap: :first) end
+  end
+
+  test "serialize and deserialize" do
+    {:ok, db} = compile_multi(["foo", "bar"], [0, 0], [1, 2], mode("HS_MODE_BLOCK"))
+    {:ok, binary} = serialize_database(db)
+    {:ok, size} = database_size(db)
+    assert serialized_database_size(binary) == {:ok, size}
+
+    {:ok, db} = deserialize_database(binary)
+    {:ok, scratch} = alloc_scratch(db)
+    assert match_multi(db, "bar", scratch) == {:ok, [2]}
+
+    {:ok, db} = deserialize_database_at(binary)
+    assert database_size(db) == {:ok, size}
+    {:ok, scratch} = alloc_scratch(db)
+    assert match_multi(db, "foo", scratch) == {:ok, [1]}
+
+    assert {:error, _} = deserialize_database_at("garbage")
+    assert {:error, _} = serialized_database_size("garbage")
+  end
+
+  @tag :tmp_dir
+  test "deserialize_database_file", %{tmp_dir: dir} do
+    {:ok, db} = compile_multi(["foo", "bar"], [0, 0], [1, 2], mode("HS_MODE_BLOCK"))
+    {:ok, binary} = serialize_database(db)
+    path = Path.join(dir, "db")
+    File.write!(path, binary)
+
+    {:ok, db} = deserialize_database_file(path)
+    {:ok, scratch} = alloc_scratch(db)
+    assert match_multi(db, "bar", scratch) == {:ok, [2]}
+
+    assert deserialize_database_file(Path.join(dir, "missing")) == {:error, :enoent}
+    assert {:error, _} = deserialize_database_file(dir)
+    File.write!(path, "")
+    assert {:error, _} = deserialize_database_file(path)
+    assert_raise ArgumentError, fn -> deserialize_database_file(<<"a", 0>>) end
+  end
+
+  test "rulesets" do
+    mode = mode("HS_MODE_BLOCK")
+    {:ok, db1} = compile_multi(["a"], [0], [1], mode)
+    {:ok, ruleset} = new_ruleset(db1)
+    {1, db, pool} = pin_ruleset(ruleset)
+    assert match_multi(db, "ab", pool) == {:ok, [1]}
+
+    {:ok, db2} = compile_multi(["a", "b", "c(d|e)+f"], [0, 0, 0], [1, 2, 3], mode)
+    assert swap_ruleset(ruleset, db2) == {:ok, 2}
+
+    # The pinned generation still works, and the new one has its own scratch.
+    assert match_multi(db, "ab", pool) == {:ok, [1]}
+    {2, db, pool} = pin_ruleset(ruleset)
+    assert match_multi(db, "ab", pool) == {:ok, [2, 1]}
+    assert scan(db, "cdef", pool) == {:ok, [3]}
+
+    results =
+      1..8
+      |> Enum.map(fn _ ->
+        Task.async(fn ->
+          for _ <- 1..100 do
+            {_, db, pool} = pin_ruleset(ruleset)
+            {:ok, ids} = match_multi(db, "a", pool)
+            ids
+          end
+        end)
+      end)
+      |> Enum.map(&Task.await/1)
+
+    assert List.flatten(results) |> Enum.uniq() == [1]
+    assert_raise ArgumentError, fn -> swap_ruleset(ruleset, :db) end
+  end
+
+  test "rulesets swapped while scans run" do
+    mode = mode("HS_MODE_BLOCK")
+    {:ok, db} = compile_multi(["a"], [0], [1], mode)
+    {:ok, ruleset} = new_ruleset(db)
+    old = {:ok, [1]}
+    new = {:ok, [2, 1]}
+
+    scanners =
+      for _ <- 1..8 do
+        Task.async(fn ->
+          for _ <- 1..500 do
+            {_, db, pool} = pin_ruleset(ruleset)
+            match_multi(db, "ab", pool)
+          end
+        end)
+      end
+
+    # Fresh databases each time, so that swapped out generations are freed
+    # while the scanners run.
+    for i <- 1..50 do
+      {:ok, db} =
+        if rem(i, 2) == 1,
+          do: compile_multi(["a", "b"], [0, 0], [1, 2], mode),
+          else: compile_multi(["a"], [0], [1], mode)
+
+      {:ok, _generation} = swap_ruleset(ruleset, db)
+      :erlang.garbage_collect()
+    end
+
+    results = Enum.flat_map(scanners, &Task.await(&1, 30_000))
+    assert length(results) == 4000
+    assert Enum.all?(results, &(&1 in [old, new]))
+  end
+
+  test "database stats" do
+    {:ok, db} = compile_multi(["a", "b"], [0, 0], [1, 2], mode("HS_MODE_BLOCK"))
+    {:ok, scratch} = alloc_scratch(db)
+    assert database_stats(db) == {:error, :stats_not_enabled}
+
+    :ok = set_database_stats(db, true)
+    {:ok, _} = match_multi(db, "ab", scratch)
+    {:ok, _} = scan(db, "bbbb", scratch)
+    {:ok, true} = match(db, "xa", scratch)
+    {:ok, stats} = database_stats(db)
+    assert stats.enabled
+    assert stats.scans == 3
+    assert stats.bytes == 8
+    assert stats.matches == 7
+    assert stats.patterns == %{1 => 2, 2 => 5}
+    assert stats.latency_ns |> Enum.map(&elem(&1, 1)) |> Enum.sum() == 3
+    assert stats.scan_ns > 0
+
+    :ok = set_database_stats(db, false)
+    {:ok, _} = match_multi(db, "ab", scratch)
+    assert {:ok, %{enabled: false, scans: 3}} = database_stats(db)
+
+    :ok = reset_database_stats(db)
+    assert {:ok, %{scans: 0, matches: 0, patterns: %{}, latency_ns: []}} = database_stats(db)
+
+    {:ok, db} = compile_multi(["foo"], [0], [7], mode("HS_MODE_STREAM"))
+    {:ok, scratch} = alloc_scratch(db)
+    :ok = set_database_stats(db, true)
+    {:ok, stream} = open_stream(db)
+    {:ok, _} = scan_stream(stream, "fo", scratch)
+    {:ok, _} = scan_stream(stream, "o", scratch)
+    assert {:ok, %{scans: 2, bytes: 3, patterns: %{7 => 1}}} = database_stats(db)
+  end
+
+  @tag :chimera
+  test "chimera" do
+    {:ok, db} = ch_compile_multi(["(\\w+)@(\\w+)", "(a)|(b)", "(x)\\1"], [0, 0, 0], [1, 2, 3], mode("CH_MODE_GROUPS"))
+    {:ok, scratch} = ch_alloc_scratch(db)
+    assert ch_scan(db, "mail bob@example", scratch) == {:ok, [{1, 5, 16, [{5, 16}, {5, 8}, {9, 16}]}]}
+    assert ch_scan(db, "b", scratch) == {:ok, [{2, 0, 1, [{0, 1}, nil, {0, 1}]}]}
+    assert ch_scan(db, "xx", scratch) == {:ok, [{3, 0, 2, [{0, 2}, {0, 1}]}]}
+    assert ch_scan(db, "...", scratch) == {:ok, []}
+
+    {:ok, db} = ch_compile_multi(["a+"], [0], [1], mode("CH_MODE_NOGROUPS"))
+    {:ok, scratch} = ch_alloc_scratch(db)
+    assert {:ok, [{1, 0, _, []} | _]} = ch_scan(db, "aa", scratch)
+
+    assert {:error, {_, 0}} = ch_compile_multi(["("], [0], [1], mode("CH_MODE_GROUPS"))
+  end
+
+  test "streams" do
+    {:ok, db} = compile_multi(["foo", "bar$"], [0, 0], [1, 2], mode("HS_MODE_STREAM"))
+    {:ok, scratch} = alloc_scratch(db)
+    {:ok, stream} = open_stream(db)
+    assert scan_stream(stream, "f", scratch) == {:ok, []}
+    assert scan_stream(stream, "oo b", scratch) == {:ok, [{1, 0, 3}]}
+    assert scan_stream(stream, "ar", scratch) == {:ok, []}
+    assert reset_stream(stream, scratch) == {:ok, [{2, 0, 7}]}
+    assert scan_stream(stream, "bar", scratch) == {:ok, []}
+    assert close_stream(stream, nil) == {:ok, []}
+    assert scan_stream(stream, "foo", scratch) == {:error, :stream_closed}
+    assert close_stream(stream, scratch) == {:error, :stream_closed}
+  end
+
+  test "compress and expand streams" do
+    {:ok, db} = compile_multi(["foo", "bar"], [0, 0], [1, 2], mode("HS_MODE_STREAM"))
+    {:ok, scratch} = alloc_scratch(db)
+    {:ok, stream} = open_stream(db)
+    {:ok, []} = scan_stream(stream, "xfo", scratch)
+    {:ok, state} = compress_stream(stream)
+    assert is_binary(state)
+
+    {:ok, stream2} = expand_stream(db, state)
+    assert scan_stream(stream2, "o", scratch) == {:ok, [{1, 0, 4}]}
+
+    {:ok, []} = scan_stream(stream, "ba", scratch)
+    assert reset_and_expand_stream(stream, state, scratch) == {:ok, []}
+    assert scan_stream(stream, "o", scratch) == {:ok, [{1, 0, 4}]}
   end
 end
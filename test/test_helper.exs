@@ -1 +1 @@
-ExUnit.start()
+ExUnit.start(exclude: if(Hyperscan.chimera_enabled(), do: [], else: [:chimera]))